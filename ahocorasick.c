@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ahocorasick.h"
+
+static unsigned char to_lower_ascii(unsigned char c) {
+	return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+AhoCorasick *ac_create(const char *const *patterns, int count, int case_insensitive) {
+	AhoCorasick *ac = calloc(1, sizeof(AhoCorasick));
+	if (ac == NULL) {
+		return NULL;
+	}
+
+	// Class 0 is every byte no pattern uses; from any state it leads back to
+	// the root.
+	size_t total_len = 0;
+	ac->class_count = 1;
+	for (int i = 0; i < count; i++) {
+		for (const unsigned char *p = (const unsigned char *)patterns[i]; *p != '\0'; p++) {
+			unsigned char c = case_insensitive ? to_lower_ascii(*p) : *p;
+			if (ac->classes[c] == 0) {
+				ac->classes[c] = (unsigned char)ac->class_count++;
+			}
+			total_len++;
+		}
+	}
+	if (case_insensitive) {
+		for (int c = 'A'; c <= 'Z'; c++) {
+			ac->classes[c] = ac->classes[c | 0x20];
+		}
+	}
+
+	size_t max_states = total_len + 1;
+	ac->next = malloc(sizeof(int32_t) * max_states * (size_t)ac->class_count);
+	ac->output = malloc(sizeof(int32_t) * max_states);
+	ac->output_link = malloc(sizeof(int32_t) * max_states);
+	ac->accepting = calloc(max_states, 1);
+	ac->pattern_next = malloc(sizeof(int32_t) * (size_t)(count > 0 ? count : 1));
+	int32_t *fail = malloc(sizeof(int32_t) * max_states);
+	int32_t *queue = malloc(sizeof(int32_t) * max_states);
+	if (ac->next == NULL || ac->output == NULL || ac->output_link == NULL || ac->accepting == NULL || ac->pattern_next == NULL || fail == NULL || queue == NULL) {
+		free(fail);
+		free(queue);
+		ac_free(ac);
+		return NULL;
+	}
+	memset(ac->next, 0xff, sizeof(int32_t) * max_states * (size_t)ac->class_count);
+	ac->pattern_count = count;
+
+	// The trie. Missing edges stay -1 until the failure links fill them in.
+	ac->state_count = 1;
+	ac->output[0] = -1;
+	for (int i = 0; i < count; i++) {
+		int32_t state = 0;
+		for (const unsigned char *p = (const unsigned char *)patterns[i]; *p != '\0'; p++) {
+			int32_t *edge = &ac->next[(size_t)state * ac->class_count + ac->classes[*p]];
+			if (*edge == -1) {
+				*edge = ac->state_count;
+				ac->output[ac->state_count] = -1;
+				ac->state_count++;
+			}
+			state = *edge;
+		}
+		// Patterns ending in the same state are chained, first one first.
+		ac->pattern_next[i] = -1;
+		if (ac->output[state] == -1) {
+			ac->output[state] = i;
+		} else {
+			int32_t last = ac->output[state];
+			while (ac->pattern_next[last] != -1) {
+				last = ac->pattern_next[last];
+			}
+			ac->pattern_next[last] = i;
+		}
+	}
+
+	// Breadth first, so a state's failure target is complete before the
+	// state is visited: trie edges get failure links, missing edges become
+	// the transition of the failure target.
+	size_t head = 0;
+	size_t tail = 0;
+	fail[0] = 0;
+	ac->output_link[0] = -1;
+	ac->accepting[0] = 0;
+	queue[tail++] = 0;
+	while (head < tail) {
+		int32_t state = queue[head++];
+		int32_t *row = &ac->next[(size_t)state * ac->class_count];
+		const int32_t *fail_row = &ac->next[(size_t)fail[state] * ac->class_count];
+		for (int c = 0; c < ac->class_count; c++) {
+			if (row[c] == -1) {
+				row[c] = state == 0 ? 0 : fail_row[c];
+				continue;
+			}
+			int32_t child = row[c];
+			int32_t target = state == 0 ? 0 : fail_row[c];
+			fail[child] = target;
+			ac->output_link[child] = ac->output[target] != -1 ? target : ac->output_link[target];
+			ac->accepting[child] = ac->output[child] != -1 || ac->output_link[child] != -1;
+			queue[tail++] = child;
+		}
+	}
+
+	free(fail);
+	free(queue);
+	return ac;
+}
+
+void ac_free(AhoCorasick *ac) {
+	if (ac == NULL) {
+		return;
+	}
+	free(ac->next);
+	free(ac->output);
+	free(ac->output_link);
+	free(ac->accepting);
+	free(ac->pattern_next);
+	free(ac);
+}
+
+int ac_contains(const AhoCorasick *ac, const unsigned char *text, size_t len) {
+	const int32_t *next = ac->next;
+	const unsigned char *classes = ac->classes;
+	int class_count = ac->class_count;
+	int32_t state = 0;
+	for (size_t i = 0; i < len; i++) {
+		state = next[(size_t)state * class_count + classes[text[i]]];
+		if (ac->accepting[state]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Inserts id into the sorted ids unless it is there already. Returns the new
+// count, which stays below max_ids.
+static int add_id(int *ids, int found, int id) {
+	int i = found;
+	for (int j = 0; j < found; j++) {
+		if (ids[j] == id) {
+			return found;
+		}
+	}
+	while (i > 0 && ids[i - 1] > id) {
+		ids[i] = ids[i - 1];
+		i--;
+	}
+	ids[i] = id;
+	return found + 1;
+}
+
+int ac_find_all(const AhoCorasick *ac, const char *text, int *ids, int max_ids) {
+	int stored = 0;
+	int extra = 0;
+	unsigned char *seen = NULL; // patterns not stored, allocated once ids is full
+	int32_t state = 0;
+	for (const unsigned char *p = (const unsigned char *)text; *p != '\0'; p++) {
+		state = ac->next[(size_t)state * ac->class_count + ac->classes[*p]];
+		if (!ac->accepting[state]) {
+			continue;
+		}
+		for (int32_t s = ac->output[state] != -1 ? state : ac->output_link[state]; s != -1; s = ac->output_link[s]) {
+			for (int32_t id = ac->output[s]; id != -1; id = ac->pattern_next[id]) {
+				if (stored < max_ids) {
+					stored = add_id(ids, stored, id);
+					continue;
+				}
+				int is_stored = 0;
+				for (int j = 0; j < stored && !is_stored; j++) {
+					is_stored = ids[j] == id;
+				}
+				if (is_stored) {
+					continue;
+				}
+				if (seen == NULL) {
+					seen = calloc((size_t)ac->pattern_count, 1);
+					if (seen == NULL) {
+						perror("calloc");
+						exit(EXIT_FAILURE);
+					}
+				}
+				if (!seen[id]) {
+					seen[id] = 1;
+					extra++;
+				}
+			}
+		}
+	}
+	free(seen);
+	return stored + extra;
+}
@@ -0,0 +1,38 @@
+#ifndef AHOCORASICK_H
+#define AHOCORASICK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A set of literal patterns compiled into one Aho-Corasick automaton, so that
+// text is scanned once no matter how many patterns there are. The failure
+// links are folded into a complete transition table over byte classes (every
+// byte that occurs in no pattern shares one class), which makes a step a
+// single table lookup. Case-insensitive automata fold ASCII letters in the
+// class table, so neither the patterns nor the text are lowercased.
+typedef struct {
+	unsigned char classes[256]; // byte -> column in next
+	int class_count;
+
+	int32_t *next;        // state * class_count + class -> state, 0 is the root
+	int32_t *output;      // state -> first pattern ending there, or -1
+	int32_t *output_link; // state -> closest state on its failure chain with an output, or -1
+	unsigned char *accepting; // state -> some pattern ends there or on its failure chain
+	int state_count;
+
+	int32_t *pattern_next; // pattern -> next pattern ending in the same state, or -1
+	int pattern_count;
+} AhoCorasick;
+
+// Patterns must not be empty. Returns NULL when out of memory.
+AhoCorasick *ac_create(const char *const *patterns, int count, int case_insensitive);
+void ac_free(AhoCorasick *ac);
+
+// Whether any of the patterns occurs in text.
+int ac_contains(const AhoCorasick *ac, const unsigned char *text, size_t len);
+
+// Returns how many distinct patterns occur in text. The first max_ids of them
+// to be found are stored in ids, in ascending order.
+int ac_find_all(const AhoCorasick *ac, const char *text, int *ids, int max_ids);
+
+#endif
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+struct ArenaBlock {
+	ArenaBlock *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+static ArenaBlock *arena_block_new(size_t size) {
+	ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+	if (block == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+	size = (size + 7) & ~(size_t)7;
+
+	ArenaBlock *block = arena->current;
+	while (block != NULL && block->size - block->used < size) {
+		block = block->next;
+	}
+
+	// Blocks left over from earlier files are reused in order; a request that
+	// fits none of them gets a new block at the end of the chain.
+	if (block == NULL) {
+		block = arena_block_new(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+		if (arena->head == NULL) {
+			arena->head = block;
+		} else {
+			ArenaBlock *last = arena->current != NULL ? arena->current : arena->head;
+			while (last->next != NULL) {
+				last = last->next;
+			}
+			last->next = block;
+		}
+	}
+	arena->current = block;
+
+	void *ptr = block->data + block->used;
+	block->used += size;
+	return ptr;
+}
+
+char *arena_strndup(Arena *arena, const char *str, size_t len) {
+	char *copy = arena_alloc(arena, len + 1);
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+void arena_reset(Arena *arena) {
+	for (ArenaBlock *block = arena->head; block != NULL; block = block->next) {
+		block->used = 0;
+	}
+	arena->current = arena->head;
+}
+
+void arena_free(Arena *arena) {
+	ArenaBlock *block = arena->head;
+	while (block != NULL) {
+		ArenaBlock *next = block->next;
+		free(block);
+		block = next;
+	}
+	arena->head = NULL;
+	arena->current = NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for scratch memory that lives as long as one unit of work,
+// typically one file. Nothing is freed individually: arena_reset makes all of
+// it reusable at once and keeps the blocks for the next file.
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+	ArenaBlock *head;
+	ArenaBlock *current;
+} Arena;
+
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
+#endif
@@ -0,0 +1,739 @@
+// End-to-end benchmark. Generates deterministic source trees, runs the crep
+// binary over them with every combination of layout, search mode and thread
+// count, and reports throughput, CPU time and peak RSS. Results are written
+// as CSV and can be compared against a saved run to catch regressions. Built
+// and run by `make bench`.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// splitmix64: the corpus only depends on the seed, never on the platform's
+// rand() or libm, so a baseline recorded on one machine stays comparable.
+typedef struct {
+	uint64_t state;
+} Rng;
+
+static uint64_t rng_next(Rng *rng) {
+	uint64_t z = (rng->state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static unsigned rng_below(Rng *rng, unsigned bound) {
+	return bound > 0 ? (unsigned)(rng_next(rng) % bound) : 0;
+}
+
+// Chance of per_mille out of 1000.
+static int rng_chance(Rng *rng, unsigned per_mille) {
+	return rng_below(rng, 1000) < per_mille;
+}
+
+// Source templates. Each function gets a header, a random number of body
+// statements and a footer; every statement format takes two unsigned values.
+
+typedef struct {
+	const char *ext;
+	const char *prologue;
+	const char *header; // takes the function name
+	const char *statement;
+	const char *footer;
+	int camel_case;
+} SourceKind;
+
+static const SourceKind source_kinds[] = {
+	{"c", "#include <stdio.h>\n\n", "int %s(int a, const char *b)\n{\n\tint x = a;\n", "\tif (x > %u) x -= b[%u %% 4];\n", "\treturn x;\n}\n\n", 0},
+	{"h", "#pragma once\n\n", "static inline int %s(int a, const char *b)\n{\n\tint x = a;\n", "\tx = x * %u + b[%u %% 4];\n", "\treturn x;\n}\n\n", 0},
+	{"cpp", "#include <string>\n\n", "int %s(int a, const std::string &b)\n{\n\tint x = a;\n", "\tx += static_cast<int>(b.size()) * %u - %u;\n", "\treturn x;\n}\n\n", 0},
+	{"go", "package bench\n\n", "func %s(a int, b string) int {\n\tx := a\n", "\tx = x*%u + len(b)%%%u\n", "\treturn x\n}\n\n", 1},
+	{"py", "import os\n\n\n", "def %s(a, b):\n    x = a\n", "    x = x * %u + len(b) %% %u\n", "    return x\n\n\n", 0},
+	{"js", "'use strict';\n\n", "function %s(a, b) {\n  let x = a;\n", "  x = x * %u + (b.length %% %u);\n", "  return x;\n}\n\n", 1},
+	{"rs", "use std::fmt;\n\n", "fn %s(a: i64, b: &str) -> i64 {\n    let mut x = a;\n", "    x = x * %u + (b.len() as i64) %% %u;\n", "    x\n}\n\n", 0},
+	{"lua", "local M = {}\n\n", "local function %s(a, b)\n  local x = a\n", "  x = x * %u + #b %% %u\n", "  return x\nend\n\n", 0},
+	{"tcl", "package require Tcl\n\n", "proc %s {a b} {\n    set x $a\n", "    set x [expr {$x * %u + [string length $b] %% %u}]\n", "    return $x\n}\n\n", 0},
+	// Not searched; the walker has to look at them and move on.
+	{"md", "# Notes\n\n", "## %s\n\n", "Step %u of %u is described here in a line of plain prose.\n", "\n", 0},
+};
+
+#define SOURCE_KIND_COUNT (sizeof(source_kinds) / sizeof(source_kinds[0]))
+
+static const char *syllables[] = {"read", "write", "parse", "load", "init", "free", "node", "tree", "list", "map", "buf", "hash", "scan", "emit", "push", "pop", "lock", "sync", "walk", "find"};
+
+#define SYLLABLE_COUNT (sizeof(syllables) / sizeof(syllables[0]))
+
+static const char *directory_names[] = {"src", "lib", "core", "util", "net", "fs", "drivers", "api", "internal", "tools", "pkg", "common"};
+
+// A synthetic tree. File sizes are log-uniform between 2^min_log2 and
+// 2^max_log2 bytes, which gives many small files and a long tail of big ones
+// like real trees have.
+typedef struct {
+	const char *name;
+	unsigned files;
+	unsigned min_log2;
+	unsigned max_log2;
+	unsigned depth;
+	unsigned fanout;
+	const char *kinds;        // extensions drawn uniformly, repeat one to weight it
+	unsigned ignored_per_mille; // share of files placed under node_modules/
+} Layout;
+
+static const Layout layouts[] = {
+	{"mixed", 1000, 8, 12, 4, 6, "c h cpp go py js rs lua tcl md", 0},
+	{"kernel", 300, 10, 14, 5, 8, "c c c h h", 0},
+	{"monorepo", 3000, 8, 11, 6, 10, "js js js py go md", 100},
+	{"flat", 4, 18, 19, 0, 1, "c py go", 0},
+};
+
+#define LAYOUT_COUNT (sizeof(layouts) / sizeof(layouts[0]))
+
+typedef struct {
+	const char *name;
+	const char *args[4]; // NULL terminated
+} Mode;
+
+static const Mode modes[] = {
+	{"substring", {"needle", NULL}},
+	{"case", {"-c", "Needle", NULL}},
+	{"fuzzy", {"-l", "2", "needle", NULL}},
+};
+
+#define MODE_COUNT (sizeof(modes) / sizeof(modes[0]))
+
+typedef struct {
+	unsigned files; // files crep searches, ignored ones excluded
+	uint64_t bytes;
+} CorpusSize;
+
+static void make_directories(char *path) {
+	for (char *p = path + 1; *p != '\0'; p++) {
+		if (*p == '/') {
+			*p = '\0';
+			if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+				perror(path);
+				exit(EXIT_FAILURE);
+			}
+			*p = '/';
+		}
+	}
+}
+
+static void function_name(Rng *rng, const SourceKind *kind, unsigned density, char *name, size_t size) {
+	const char *a = syllables[rng_below(rng, SYLLABLE_COUNT)];
+	const char *b = syllables[rng_below(rng, SYLLABLE_COUNT)];
+	if (!rng_chance(rng, density)) {
+		snprintf(name, size, kind->camel_case ? "%s%c%s%u" : "%s_%c%s%u", a, kind->camel_case ? b[0] - 'a' + 'A' : b[0], b + 1, rng_below(rng, 1000));
+		return;
+	}
+
+	// Matches for every mode: the name contains "needle" for substring
+	// search, "Needle" for case-sensitive search, and the short ones are
+	// within distance 2 of "needle" for fuzzy search.
+	switch (rng_below(rng, 5)) {
+	case 0:
+		snprintf(name, size, kind->camel_case ? "%sNeedle" : "%s_needle", a);
+		break;
+	case 1:
+		snprintf(name, size, kind->camel_case ? "needle%c%s" : "needle_%c%s", kind->camel_case ? b[0] - 'a' + 'A' : b[0], b + 1);
+		break;
+	case 2:
+		snprintf(name, size, "Needle%u", rng_below(rng, 100));
+		break;
+	case 3:
+		snprintf(name, size, "needles");
+		break;
+	default:
+		snprintf(name, size, "neddle");
+		break;
+	}
+}
+
+static uint64_t write_source(FILE *file, Rng *rng, const SourceKind *kind, uint64_t target, unsigned density) {
+	uint64_t written = (uint64_t)fprintf(file, "%s", kind->prologue);
+	while (written < target) {
+		char name[64];
+		function_name(rng, kind, density, name, sizeof(name));
+		written += (uint64_t)fprintf(file, kind->header, name);
+		unsigned statements = 1 + rng_below(rng, 24);
+		for (unsigned i = 0; i < statements; i++) {
+			written += (uint64_t)fprintf(file, kind->statement, 1 + rng_below(rng, 97), 1 + rng_below(rng, 97));
+		}
+		written += (uint64_t)fprintf(file, "%s", kind->footer);
+	}
+	return written;
+}
+
+static const SourceKind *pick_kind(Rng *rng, const char *kinds) {
+	const SourceKind *choices[32];
+	size_t count = 0;
+	const char *p = kinds;
+	while (*p != '\0' && count < 32) {
+		size_t len = strcspn(p, " ");
+		for (size_t i = 0; i < SOURCE_KIND_COUNT; i++) {
+			if (strlen(source_kinds[i].ext) == len && strncmp(source_kinds[i].ext, p, len) == 0) {
+				choices[count++] = &source_kinds[i];
+			}
+		}
+		p += len;
+		p += strspn(p, " ");
+	}
+	return choices[rng_below(rng, (unsigned)count)];
+}
+
+// Writes the tree into root unless a complete one for the same parameters is
+// already there; the marker file records its size so reruns skip generation.
+static CorpusSize generate_corpus(const Layout *layout, const char *root, uint64_t seed, double scale, unsigned density) {
+	CorpusSize size = {0, 0};
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/.bench-complete", root);
+	FILE *marker = fopen(path, "r");
+	if (marker != NULL) {
+		int ok = fscanf(marker, "%u %lu", &size.files, &size.bytes) == 2;
+		fclose(marker);
+		if (ok) {
+			return size;
+		}
+	}
+
+	// Dependencies are left out the way real repositories do it.
+	if (layout->ignored_per_mille > 0) {
+		snprintf(path, sizeof(path), "%s/.gitignore", root);
+		make_directories(path);
+		FILE *gitignore = fopen(path, "w");
+		if (gitignore == NULL) {
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+		fputs("node_modules/\n", gitignore);
+		fclose(gitignore);
+	}
+
+	unsigned files = (unsigned)(layout->files * scale + 0.5);
+	if (files == 0) {
+		files = 1;
+	}
+	for (unsigned i = 0; i < files; i++) {
+		Rng rng = {seed * 1000003 + i};
+		int ignored = rng_chance(&rng, layout->ignored_per_mille);
+
+		int len = snprintf(path, sizeof(path), "%s/", root);
+		if (ignored) {
+			len += snprintf(path + len, sizeof(path) - len, "node_modules/pkg%u/", rng_below(&rng, 20));
+		}
+		unsigned depth = rng_below(&rng, layout->depth + 1);
+		for (unsigned d = 0; d < depth; d++) {
+			len += snprintf(path + len, sizeof(path) - len, "%s/", directory_names[rng_below(&rng, layout->fanout)]);
+		}
+
+		const SourceKind *kind = pick_kind(&rng, layout->kinds);
+		snprintf(path + len, sizeof(path) - len, "f%05u.%s", i, kind->ext);
+		make_directories(path);
+
+		unsigned exponent = layout->min_log2 + rng_below(&rng, layout->max_log2 - layout->min_log2 + 1);
+		uint64_t target = (1ULL << exponent) + rng_below(&rng, 1U << exponent);
+
+		FILE *file = fopen(path, "w");
+		if (file == NULL) {
+			perror(path);
+			exit(EXIT_FAILURE);
+		}
+		uint64_t written = write_source(file, &rng, kind, target, density);
+		fclose(file);
+
+		if (!ignored && strcmp(kind->ext, "md") != 0) {
+			size.files++;
+			size.bytes += written;
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/.bench-complete", root);
+	marker = fopen(path, "w");
+	if (marker == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	fprintf(marker, "%u %lu\n", size.files, size.bytes);
+	fclose(marker);
+	return size;
+}
+
+// An existing tree passed with --corpus is measured by counting the files
+// with an extension crep knows. Hidden directories are skipped but ignore
+// files are not read, so the count can be a little high.
+static const char *known_extensions[] = {"c", "h", "cpp", "hpp", "cu", "cuh", "glsl", "go", "js", "kt", "lua", "odin", "php", "py", "rs", "tcl", "zig"};
+static CorpusSize measured_size;
+
+static int measure_entry(const char *path, const struct stat *statbuf, int type, struct FTW *ftw) {
+	const char *base = path + ftw->base;
+	if (ftw->level > 0 && base[0] == '.') {
+		return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+	}
+	if (type != FTW_F || !S_ISREG(statbuf->st_mode)) {
+		return FTW_CONTINUE;
+	}
+	const char *dot = strrchr(base, '.');
+	if (dot == NULL) {
+		return FTW_CONTINUE;
+	}
+	for (size_t i = 0; i < sizeof(known_extensions) / sizeof(known_extensions[0]); i++) {
+		if (strcmp(dot + 1, known_extensions[i]) == 0) {
+			measured_size.files++;
+			measured_size.bytes += (uint64_t)statbuf->st_size;
+			break;
+		}
+	}
+	return FTW_CONTINUE;
+}
+
+static CorpusSize measure_corpus(const char *root) {
+	measured_size.files = 0;
+	measured_size.bytes = 0;
+	if (nftw(root, measure_entry, 64, FTW_PHYS | FTW_ACTIONRETVAL) == -1) {
+		perror(root);
+		exit(EXIT_FAILURE);
+	}
+	return measured_size;
+}
+
+typedef struct {
+	double wall_ms;
+	double cpu_ms;
+	long rss_kb;
+	unsigned long matches; // output lines
+} RunResult;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Runs crep once with its output on a pipe, counting lines, and takes CPU
+// time and peak RSS of the child from wait4().
+static RunResult run_crep(const char *crep, const Mode *mode, int threads, const char *root) {
+	char threads_arg[16];
+	snprintf(threads_arg, sizeof(threads_arg), "%d", threads);
+	const char *argv[16];
+	int argc = 0;
+	argv[argc++] = crep;
+	argv[argc++] = "-j";
+	argv[argc++] = threads_arg;
+	for (int i = 0; mode->args[i] != NULL; i++) {
+		argv[argc++] = mode->args[i];
+	}
+	argv[argc++] = root;
+	argv[argc] = NULL;
+
+	int pipefd[2];
+	if (pipe(pipefd) == -1) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	double start = now();
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		dup2(pipefd[1], STDOUT_FILENO);
+		close(pipefd[0]);
+		close(pipefd[1]);
+		execv(crep, (char *const *)argv);
+		perror(crep);
+		_exit(127);
+	}
+	close(pipefd[1]);
+
+	RunResult result = {0, 0, 0, 0};
+	char buffer[65536];
+	ssize_t n;
+	while ((n = read(pipefd[0], buffer, sizeof(buffer))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		for (ssize_t i = 0; i < n; i++) {
+			result.matches += buffer[i] == '\n';
+		}
+	}
+	close(pipefd[0]);
+
+	int status;
+	struct rusage usage;
+	while (wait4(pid, &status, 0, &usage) == -1) {
+		if (errno != EINTR) {
+			perror("wait4");
+			exit(EXIT_FAILURE);
+		}
+	}
+	result.wall_ms = (now() - start) * 1000;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed on %s\n", crep, root);
+		exit(EXIT_FAILURE);
+	}
+	result.cpu_ms = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+	result.rss_kb = usage.ru_maxrss;
+	return result;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static int compare_longs(const void *a, const void *b) {
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+#define MAX_RUNS 64
+
+// Median of each measurement over the runs; one bad run does not move it.
+static RunResult measure(const char *crep, const Mode *mode, int threads, const char *root, int runs) {
+	double wall[MAX_RUNS], cpu[MAX_RUNS];
+	long rss[MAX_RUNS];
+	RunResult result = {0, 0, 0, 0};
+	for (int i = 0; i < runs; i++) {
+		RunResult run = run_crep(crep, mode, threads, root);
+		wall[i] = run.wall_ms;
+		cpu[i] = run.cpu_ms;
+		rss[i] = run.rss_kb;
+		if (i > 0 && run.matches != result.matches) {
+			fprintf(stderr, "%s: output changed between runs (%lu vs %lu lines)\n", root, run.matches, result.matches);
+		}
+		result.matches = run.matches;
+	}
+	qsort(wall, runs, sizeof(double), compare_doubles);
+	qsort(cpu, runs, sizeof(double), compare_doubles);
+	qsort(rss, runs, sizeof(long), compare_longs);
+	result.wall_ms = wall[runs / 2];
+	result.cpu_ms = cpu[runs / 2];
+	result.rss_kb = rss[runs / 2];
+	return result;
+}
+
+typedef struct {
+	char layout[64];
+	char mode[32];
+	int threads;
+	unsigned long matches;
+	double wall_ms;
+	long rss_kb;
+} BaselineRow;
+
+typedef struct {
+	BaselineRow *rows;
+	size_t count;
+} Baseline;
+
+static Baseline load_baseline(const char *path) {
+	Baseline baseline = {NULL, 0};
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	char line[512];
+	size_t capacity = 0;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		BaselineRow row;
+		unsigned files;
+		unsigned long bytes;
+		double cpu_ms;
+		// layout,mode,threads,files,bytes,matches,wall_ms,cpu_ms,rss_kb,...
+		if (sscanf(line, "%63[^,],%31[^,],%d,%u,%lu,%lu,%lf,%lf,%ld", row.layout, row.mode, &row.threads, &files, &bytes, &row.matches, &row.wall_ms, &cpu_ms, &row.rss_kb) != 9) {
+			continue; // header
+		}
+		if (baseline.count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			baseline.rows = realloc(baseline.rows, capacity * sizeof(BaselineRow));
+			if (baseline.rows == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		baseline.rows[baseline.count++] = row;
+	}
+	fclose(file);
+	return baseline;
+}
+
+static const BaselineRow *baseline_find(const Baseline *baseline, const char *layout, const char *mode, int threads) {
+	for (size_t i = 0; i < baseline->count; i++) {
+		const BaselineRow *row = &baseline->rows[i];
+		if (row->threads == threads && strcmp(row->layout, layout) == 0 && strcmp(row->mode, mode) == 0) {
+			return row;
+		}
+	}
+	return NULL;
+}
+
+// Differences smaller than this are timer and scheduler noise on short runs.
+#define NOISE_FLOOR_MS 5.0
+
+static void print_usage(const char *program) {
+	fprintf(stderr,
+	        "Usage: %s [--crep <path>] [--dir <path>] [--layout <name>] [--corpus <dir>] [--scale <factor>]\n"
+	        "          [--seed <n>] [--density <per mille>] [--threads <n,n,...>] [--runs <n>]\n"
+	        "          [--out <file.csv>] [--baseline <file.csv>] [--tolerance <percent>]\n"
+	        "Layouts:",
+	        program);
+	for (size_t i = 0; i < LAYOUT_COUNT; i++) {
+		fprintf(stderr, " %s", layouts[i].name);
+	}
+	fprintf(stderr, "\n");
+}
+
+enum {
+	OPT_CREP = 256,
+	OPT_DIR,
+	OPT_LAYOUT,
+	OPT_CORPUS,
+	OPT_SCALE,
+	OPT_SEED,
+	OPT_DENSITY,
+	OPT_THREADS,
+	OPT_RUNS,
+	OPT_OUT,
+	OPT_BASELINE,
+	OPT_TOLERANCE,
+};
+
+#define MAX_TARGETS 16
+
+typedef struct {
+	const char *name;
+	char root[4096];
+	CorpusSize size;
+} Target;
+
+int main(int argc, char *argv[]) {
+	const char *crep = "./crep";
+	const char *dir = "bench-corpus";
+	const char *layout_names[MAX_TARGETS];
+	int layout_count = 0;
+	const char *corpora[MAX_TARGETS];
+	int corpus_count = 0;
+	double scale = 1.0;
+	uint64_t seed = 1;
+	unsigned density = 10;
+	const char *thread_list = NULL;
+	int runs = 3;
+	const char *out_path = "bench_results.csv";
+	const char *baseline_path = NULL;
+	double tolerance = 10.0;
+
+	struct option long_options[] = {
+		{"crep", required_argument, 0, OPT_CREP},
+		{"dir", required_argument, 0, OPT_DIR},
+		{"layout", required_argument, 0, OPT_LAYOUT},
+		{"corpus", required_argument, 0, OPT_CORPUS},
+		{"scale", required_argument, 0, OPT_SCALE},
+		{"seed", required_argument, 0, OPT_SEED},
+		{"density", required_argument, 0, OPT_DENSITY},
+		{"threads", required_argument, 0, OPT_THREADS},
+		{"runs", required_argument, 0, OPT_RUNS},
+		{"out", required_argument, 0, OPT_OUT},
+		{"baseline", required_argument, 0, OPT_BASELINE},
+		{"tolerance", required_argument, 0, OPT_TOLERANCE},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case OPT_CREP:
+			crep = optarg;
+			break;
+		case OPT_DIR:
+			dir = optarg;
+			break;
+		case OPT_LAYOUT:
+			if (layout_count < MAX_TARGETS) {
+				layout_names[layout_count++] = optarg;
+			}
+			break;
+		case OPT_CORPUS:
+			if (corpus_count < MAX_TARGETS) {
+				corpora[corpus_count++] = optarg;
+			}
+			break;
+		case OPT_SCALE:
+			scale = atof(optarg);
+			break;
+		case OPT_SEED:
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case OPT_DENSITY:
+			density = (unsigned)atoi(optarg);
+			break;
+		case OPT_THREADS:
+			thread_list = optarg;
+			break;
+		case OPT_RUNS:
+			runs = atoi(optarg);
+			break;
+		case OPT_OUT:
+			out_path = optarg;
+			break;
+		case OPT_BASELINE:
+			baseline_path = optarg;
+			break;
+		case OPT_TOLERANCE:
+			tolerance = atof(optarg);
+			break;
+		case 'h':
+			print_usage(argv[0]);
+			return 0;
+		default:
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (runs < 1 || runs > MAX_RUNS || scale <= 0 || density > 1000) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	int thread_counts[32];
+	int thread_count = 0;
+	if (thread_list != NULL) {
+		for (const char *p = thread_list; *p != '\0' && thread_count < 32;) {
+			int threads = atoi(p);
+			if (threads > 0) {
+				thread_counts[thread_count++] = threads;
+			}
+			p += strcspn(p, ",");
+			p += *p == ',';
+		}
+	} else {
+		int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		for (int threads = 1; thread_count < 32; threads *= 2) {
+			thread_counts[thread_count++] = threads < max_threads ? threads : max_threads;
+			if (threads >= max_threads) {
+				break;
+			}
+		}
+	}
+	if (thread_count == 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	// Generated layouts first, then real trees. Without either, every
+	// generated layout is run.
+	Target targets[MAX_TARGETS * 2];
+	int target_count = 0;
+	if (layout_count == 0 && corpus_count == 0) {
+		for (size_t i = 0; i < LAYOUT_COUNT; i++) {
+			layout_names[layout_count++] = layouts[i].name;
+		}
+	}
+	for (int i = 0; i < layout_count; i++) {
+		const Layout *layout = NULL;
+		for (size_t j = 0; j < LAYOUT_COUNT; j++) {
+			if (strcmp(layouts[j].name, layout_names[i]) == 0) {
+				layout = &layouts[j];
+			}
+		}
+		if (layout == NULL) {
+			fprintf(stderr, "Unknown layout: %s\n", layout_names[i]);
+			print_usage(argv[0]);
+			return 1;
+		}
+		Target *target = &targets[target_count++];
+		target->name = layout->name;
+		snprintf(target->root, sizeof(target->root), "%s/%s-s%lu-x%g-d%u/", dir, layout->name, (unsigned long)seed, scale, density);
+		make_directories(target->root);
+		target->root[strlen(target->root) - 1] = '\0';
+		fprintf(stderr, "Preparing %s...\n", target->root);
+		target->size = generate_corpus(layout, target->root, seed, scale, density);
+	}
+	for (int i = 0; i < corpus_count; i++) {
+		Target *target = &targets[target_count++];
+		const char *base = strrchr(corpora[i], '/');
+		target->name = base != NULL && base[1] != '\0' ? base + 1 : corpora[i];
+		snprintf(target->root, sizeof(target->root), "%s", corpora[i]);
+		target->size = measure_corpus(target->root);
+	}
+
+	Baseline baseline = {NULL, 0};
+	if (baseline_path != NULL) {
+		baseline = load_baseline(baseline_path);
+	}
+
+	FILE *out = fopen(out_path, "w");
+	if (out == NULL) {
+		perror(out_path);
+		return 1;
+	}
+	fprintf(out, "layout,mode,threads,files,bytes,matches,wall_ms,cpu_ms,rss_kb,files_per_sec,mb_per_sec\n");
+
+	printf("%-10s %-9s %7s %7s %8s %9s %9s %8s %9s %8s %8s", "layout", "mode", "threads", "files", "MB", "wall ms", "cpu ms", "rss MB", "files/s", "MB/s", "matches");
+	printf(baseline_path != NULL ? " %9s\n" : "\n", "vs base");
+
+	int regressions = 0;
+	for (int t = 0; t < target_count; t++) {
+		Target *target = &targets[t];
+		double mb = target->size.bytes / 1e6;
+
+		// Untimed run so every measurement sees a warm page cache.
+		run_crep(crep, &modes[0], thread_counts[thread_count - 1], target->root);
+
+		for (size_t m = 0; m < MODE_COUNT; m++) {
+			for (int i = 0; i < thread_count; i++) {
+				int threads = thread_counts[i];
+				RunResult result = measure(crep, &modes[m], threads, target->root, runs);
+				double files_per_sec = target->size.files / (result.wall_ms / 1000);
+				double mb_per_sec = mb / (result.wall_ms / 1000);
+
+				fprintf(out, "%s,%s,%d,%u,%lu,%lu,%.2f,%.2f,%ld,%.1f,%.2f\n", target->name, modes[m].name, threads, target->size.files, (unsigned long)target->size.bytes, result.matches, result.wall_ms, result.cpu_ms, result.rss_kb, files_per_sec, mb_per_sec);
+				printf("%-10s %-9s %7d %7u %8.1f %9.1f %9.1f %8.1f %9.0f %8.1f %8lu", target->name, modes[m].name, threads, target->size.files, mb, result.wall_ms, result.cpu_ms, result.rss_kb / 1024.0, files_per_sec, mb_per_sec, result.matches);
+
+				const BaselineRow *base = baseline_path != NULL ? baseline_find(&baseline, target->name, modes[m].name, threads) : NULL;
+				if (base != NULL) {
+					double change = (result.wall_ms - base->wall_ms) / base->wall_ms * 100;
+					printf(" %+8.1f%%", change);
+					if (base->matches != result.matches) {
+						printf("  MISMATCH (%lu matches before)", base->matches);
+						regressions++;
+					} else if (change > tolerance && result.wall_ms - base->wall_ms > NOISE_FLOOR_MS) {
+						printf("  REGRESSION");
+						regressions++;
+					}
+				} else if (baseline_path != NULL) {
+					printf(" %9s", "-");
+				}
+				printf("\n");
+				fflush(stdout);
+			}
+		}
+	}
+	fclose(out);
+	free(baseline.rows);
+
+	fprintf(stderr, "Results written to %s\n", out_path);
+	if (regressions > 0) {
+		fprintf(stderr, "%d result(s) regressed against %s\n", regressions, baseline_path);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,128 @@
+// Randomized cross-check of the bounded Levenshtein matcher against a plain
+// full-table DP. Built and run by `make check`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "levenshtein.h"
+
+static int reference_distance(const char *s1, const char *s2) {
+	size_t len1 = strlen(s1);
+	size_t len2 = strlen(s2);
+	unsigned int *row = malloc(sizeof(unsigned int) * (len2 + 1));
+	if (row == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t j = 0; j <= len2; j++) {
+		row[j] = (unsigned int)j;
+	}
+	for (size_t i = 1; i <= len1; i++) {
+		unsigned int diagonal = row[0];
+		row[0] = (unsigned int)i;
+		for (size_t j = 1; j <= len2; j++) {
+			unsigned int up = row[j];
+			unsigned int best = diagonal + (s1[i - 1] != s2[j - 1]);
+			if (up + 1 < best) {
+				best = up + 1;
+			}
+			if (row[j - 1] + 1 < best) {
+				best = row[j - 1] + 1;
+			}
+			row[j] = best;
+			diagonal = up;
+		}
+	}
+
+	int distance = (int)row[len2];
+	free(row);
+	return distance;
+}
+
+static void random_string(char *buffer, size_t len, const char *alphabet) {
+	size_t alphabet_len = strlen(alphabet);
+	for (size_t i = 0; i < len; i++) {
+		buffer[i] = alphabet[rand() % alphabet_len];
+	}
+	buffer[len] = '\0';
+}
+
+// Derives a candidate from the pattern with a few random edits, so that many
+// pairs land close to the bound.
+static void mutate(const char *pattern, char *buffer, size_t capacity, const char *alphabet) {
+	size_t alphabet_len = strlen(alphabet);
+	size_t len = strlen(pattern);
+	memcpy(buffer, pattern, len + 1);
+
+	int edits = rand() % 6;
+	for (int e = 0; e < edits; e++) {
+		size_t pos = len ? (size_t)rand() % (len + 1) : 0;
+		switch (rand() % 3) {
+		case 0:
+			if (len + 1 < capacity) {
+				memmove(buffer + pos + 1, buffer + pos, len - pos + 1);
+				buffer[pos] = alphabet[rand() % alphabet_len];
+				len++;
+			}
+			break;
+		case 1:
+			if (pos < len) {
+				memmove(buffer + pos, buffer + pos + 1, len - pos);
+				len--;
+			}
+			break;
+		default:
+			if (pos < len) {
+				buffer[pos] = alphabet[rand() % alphabet_len];
+			}
+			break;
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	unsigned seed = argc > 1 ? (unsigned)atoi(argv[1]) : 1;
+	int cases = argc > 2 ? atoi(argv[2]) : 200000;
+	srand(seed);
+
+	static const char *alphabets[] = {"ab", "abcd", "abcdefghijklmnopqrstuvwxyz_", "aAbB01_"};
+	char pattern[200];
+	char text[220];
+	int failures = 0;
+
+	for (int c = 0; c < cases; c++) {
+		const char *alphabet = alphabets[rand() % 4];
+		// Mostly identifier sized, with a share above 64 bytes for the banded path.
+		size_t len = (size_t)(rand() % 4 == 0 ? rand() % 150 : rand() % 40);
+		random_string(pattern, len, alphabet);
+		if (rand() % 2) {
+			mutate(pattern, text, sizeof(text), alphabet);
+		} else {
+			random_string(text, (size_t)(rand() % 150), alphabet);
+		}
+
+		int k = rand() % 12;
+		LevenshteinPattern lp;
+		levenshtein_init(&lp, pattern);
+
+		int expected = reference_distance(pattern, text);
+		if (expected > k) {
+			expected = k + 1;
+		}
+		int actual = levenshtein_bounded(&lp, text, k);
+		if (actual != expected) {
+			if (failures++ < 10) {
+				fprintf(stderr, "mismatch: k=%d \"%s\" \"%s\": expected %d, got %d\n", k, pattern, text, expected, actual);
+			}
+		}
+	}
+
+	if (failures > 0) {
+		fprintf(stderr, "levenshtein: %d of %d cases failed\n", failures, cases);
+		return 1;
+	}
+	printf("levenshtein: %d cases OK\n", cases);
+	return 0;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extract.h"
+
+TextView text_view(const char *str) {
+	TextView view = {str, str != NULL ? strlen(str) : 0};
+	return view;
+}
+
+// Returns a heap copy of view, or NULL for a missing capture. Parameter lists
+// are stored without their line breaks.
+char *text_view_dup(TextView view, int drop_newlines) {
+	if (view.data == NULL) {
+		return NULL;
+	}
+	char *copy = malloc(view.len + 1);
+	if (copy == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	size_t len = 0;
+	for (size_t i = 0; i < view.len; i++) {
+		if (!drop_newlines || view.data[i] != '\n') {
+			copy[len++] = view.data[i];
+		}
+	}
+	copy[len] = '\0';
+	return copy;
+}
+
+// Runs the language's query over node and reports every match that captured
+// a name. Only the name is copied, into arena, so that it can be matched as
+// a C string; the return type and parameters stay views into source_code, and
+// a rejected match costs no allocation at all once the arena has warmed up.
+void extract_functions(const Language *lang, TSQueryCursor *cursor, TSNode node, const char *source_code, Arena *arena, function_visitor_t visit, void *ctx) {
+	ts_query_cursor_exec(cursor, lang->query, node);
+
+	TSQueryMatch match;
+	while (ts_query_cursor_next_match(cursor, &match)) {
+		Function fn = {0};
+		fn.kind = lang->pattern_kinds[match.pattern_index];
+		fn.start_byte = UINT32_MAX;
+
+		for (unsigned i = 0; i < match.capture_count; i++) {
+			TSQueryCapture capture = match.captures[i];
+			TSNode captured_node = capture.node;
+
+			uint32_t start = ts_node_start_byte(captured_node);
+			uint32_t end = ts_node_end_byte(captured_node);
+			if (start < fn.start_byte) {
+				fn.start_byte = start;
+			}
+			if (end > fn.end_byte) {
+				fn.end_byte = end;
+			}
+
+			TextView view = {source_code + start, end - start};
+			switch (lang->capture_roles[capture.index]) {
+			case CAPTURE_FNAME:
+				fn.fname = arena_strndup(arena, view.data, view.len);
+				fn.lineno = ts_node_start_point(captured_node).row + 1;
+				break;
+			case CAPTURE_FTYPE:
+				fn.ftype = view;
+				break;
+			case CAPTURE_FPARAMS:
+				fn.fparams = view;
+				break;
+			default:
+				break;
+			}
+		}
+
+		if (fn.fname != NULL && visit(&fn, ctx) != 0) {
+			break;
+		}
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tree_sitter/api.h>
+
+#include "arena.h"
+#include "lang.h"
+
+// A slice of some longer text, not NUL terminated. data is NULL when the
+// query did not capture anything for it.
+typedef struct {
+	const char *data;
+	size_t len;
+} TextView;
+
+typedef struct {
+	const char *fname; // NUL terminated, the only capture that is copied
+	TextView ftype;    // point into the source until somebody needs them
+	TextView fparams;
+	const char *kind; // node type of the matched query pattern
+	size_t lineno;
+	uint32_t start_byte; // extent of the captured nodes
+	uint32_t end_byte;
+} Function;
+
+// Called once per query match that captured a name. The name lives in the
+// arena handed to the extractor and the views in the source, so both are only
+// valid until the caller resets the arena or releases the source. Returning
+// nonzero stops the query, the remaining matches are never computed.
+typedef int (*function_visitor_t)(const Function *fn, void *ctx);
+
+void extract_functions(const Language *lang, TSQueryCursor *cursor, TSNode node, const char *source_code, Arena *arena, function_visitor_t visit, void *ctx);
+TextView text_view(const char *str);
+char *text_view_dup(TextView view, int drop_newlines);
+
+#endif
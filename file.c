@@ -1,49 +1,170 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "file.h"
 
-struct FileContent read_entire_file(const char *file_path) {
-	struct FileContent file_data;
-	file_data.content = NULL;
-	file_data.count = 0;
+// Below this size a plain read() into a heap buffer is cheaper than setting up
+// and tearing down a mapping.
+#define MMAP_THRESHOLD (16 * 1024)
 
-	FILE *file = fopen(file_path, "rb");
-	if (file == NULL) {
-		perror("Error opening file");
+// Reads until EOF, for files whose size is unknown or too small to map.
+static struct FileContent read_fd_into_buffer(int fd, size_t size_hint) {
+	struct FileContent file_data = {NULL, 0, 0};
+
+	size_t capacity = size_hint > 0 ? size_hint + 1 : 4096;
+	char *content = (char *)malloc(capacity);
+	if (content == NULL) {
+		perror("Error allocating memory");
 		return file_data;
 	}
 
-	fseek(file, 0, SEEK_END);
-	long raw_size = ftell(file);
-	fseek(file, 0, SEEK_SET);
+	size_t count = 0;
+	while (1) {
+		if (count == capacity) {
+			capacity *= 2;
+			char *grown = (char *)realloc(content, capacity);
+			if (grown == NULL) {
+				perror("Error allocating memory");
+				free(content);
+				return file_data;
+			}
+			content = grown;
+		}
 
-	if (raw_size == -1) {
-		perror("Error getting file size");
-		fclose(file);
-		return file_data;
+		ssize_t bytes_read = read(fd, content + count, capacity - count);
+		if (bytes_read == 0) {
+			break;
+		}
+		if (bytes_read < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("Error reading file");
+			free(content);
+			return file_data;
+		}
+		count += (size_t)bytes_read;
 	}
 
-	size_t file_size = (size_t)raw_size;
-	char *content = (char *)malloc(file_size + 1);
-	if (content == NULL) {
-		perror("Error allocating memory");
-		fclose(file);
-		return file_data;
+	file_data.content = content;
+	file_data.count = count;
+	return file_data;
+}
+
+struct FileContent read_file_descriptor(int fd, const struct stat *statbuf) {
+	struct FileContent file_data = {NULL, 0, 0};
+
+	// Special files and files reporting a zero size (procfs and friends) can
+	// not be mapped reliably, so they always go through read().
+	if (!S_ISREG(statbuf->st_mode) || statbuf->st_size == 0) {
+		return read_fd_into_buffer(fd, 0);
 	}
 
-	size_t bytes_read = fread(content, 1, file_size, file);
-	if (bytes_read != file_size) {
-		perror("Error reading file");
-		free(content);
-		fclose(file);
-		return file_data;
+	size_t file_size = (size_t)statbuf->st_size;
+	if (file_size < MMAP_THRESHOLD) {
+		return read_fd_into_buffer(fd, file_size);
 	}
 
-	content[file_size] = '\0';
-	file_data.content = content;
+	void *content = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (content == MAP_FAILED) {
+		return read_fd_into_buffer(fd, file_size);
+	}
+
+	// The parser reads the buffer front to back exactly once.
+	madvise(content, file_size, MADV_SEQUENTIAL);
+	madvise(content, file_size, MADV_WILLNEED);
+
+	file_data.content = (const char *)content;
 	file_data.count = file_size;
+	file_data.mapped = 1;
+	return file_data;
+}
+
+// open() that also accepts paths longer than PATH_MAX, which the walker can
+// produce: the leading directories are then opened a piece at a time, each
+// relative to the one before.
+int open_path(const char *path, int flags) {
+	int fd = open(path, flags);
+	if (fd != -1 || errno != ENAMETOOLONG) {
+		return fd;
+	}
+
+	int dir_fd = AT_FDCWD;
+	const char *rest = path;
+	while (strlen(rest) >= PATH_MAX) {
+		const char *cut = rest + PATH_MAX - 1;
+		while (cut > rest + 1 && *cut != '/') {
+			cut--;
+		}
+
+		int next_fd = -1;
+		if (*cut == '/') {
+			char *dir_path = strndup(rest, (size_t)(cut - rest));
+			if (dir_path != NULL) {
+				next_fd = openat(dir_fd, dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				free(dir_path);
+			}
+		} else {
+			errno = ENAMETOOLONG;
+		}
+		if (dir_fd != AT_FDCWD) {
+			close(dir_fd);
+		}
+		if (next_fd == -1) {
+			return -1;
+		}
+		dir_fd = next_fd;
+		rest = cut + 1;
+	}
+
+	fd = openat(dir_fd, rest, flags);
+	if (dir_fd != AT_FDCWD) {
+		int saved_errno = errno;
+		close(dir_fd);
+		errno = saved_errno;
+	}
+	return fd;
+}
+
+struct FileContent read_entire_file(const char *file_path) {
+	struct FileContent file_data = {NULL, 0, 0};
 
-	fclose(file);
+	int fd = open_path(file_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror("Error opening file");
+		return file_data;
+	}
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == -1) {
+		perror("Error getting file size");
+		close(fd);
+		return file_data;
+	}
+
+	file_data = read_file_descriptor(fd, &statbuf);
+	close(fd);
 	return file_data;
 }
+
+void free_file_content(struct FileContent *file) {
+	if (file->content == NULL) {
+		return;
+	}
+
+	if (file->mapped) {
+		munmap((void *)file->content, file->count);
+	} else {
+		free((void *)file->content);
+	}
+
+	file->content = NULL;
+	file->count = 0;
+	file->mapped = 0;
+}
@@ -2,12 +2,19 @@
 #define FILE_H
 
 #include <stdio.h>
+#include <sys/stat.h>
 
+// Contents are either mapped or heap allocated depending on the file, and are
+// not guaranteed to be NUL terminated; always use count.
 struct FileContent {
 	const char *content;
 	size_t count;
+	int mapped;
 };
 
+int open_path(const char *path, int flags);
 struct FileContent read_entire_file(const char *file_path);
+struct FileContent read_file_descriptor(int fd, const struct stat *statbuf);
+void free_file_content(struct FileContent *file);
 
 #endif
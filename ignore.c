@@ -0,0 +1,471 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "ignore.h"
+
+// Bytes sniffed for NULs when deciding whether a file is binary.
+#define BINARY_SNIFF_BYTES 1024
+
+// Generated files are recognised by a marker comment in their first bytes,
+// minified ones by an average line length way above what anybody writes by
+// hand.
+#define GENERATED_SNIFF_BYTES 1024
+#define MINIFIED_SNIFF_BYTES (64 * 1024)
+#define MINIFIED_MIN_BYTES 4096
+#define MINIFIED_LINE_LENGTH 512
+
+// Comment leaders a marker may follow, longest first.
+static const char *comment_leaders[] = {"<!--", "//", "/*", "--", "#", "*", ";", "%", NULL};
+
+enum {
+	RULE_LITERAL, // plain name or path, compared with memcmp
+	RULE_SUFFIX,  // "*.ext" style, compared against the end of the name
+	RULE_GLOB,    // anything else goes through glob_match
+};
+
+struct IgnoreRule {
+	char *pattern;
+	size_t len;
+	int kind;
+	int negate;
+	int dir_only;
+	int anchored; // matched against the path relative to the ignore file
+};
+
+// Version control metadata, crep's own index directory (INDEX_DIR) and
+// dependency caches that never hold a project's own sources, skipped unless
+// --no-ignore is given. Build output is left to ignore files: a directory
+// called build or target is just as often a source package.
+static const char *default_skips[] = {
+	".git",
+	".hg",
+	".svn",
+	".bzr",
+	".crep",
+	"node_modules",
+	"bower_components",
+	"__pycache__",
+	NULL,
+};
+
+int ignore_default_skip(const char *name) {
+	for (int i = 0; default_skips[i] != NULL; i++) {
+		if (strcmp(name, default_skips[i]) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int ignore_is_binary(const char *content, size_t len) {
+	return memchr(content, '\0', len < BINARY_SNIFF_BYTES ? len : BINARY_SNIFF_BYTES) != NULL;
+}
+
+static int starts_with(const char *p, const char *end, const char *prefix) {
+	size_t len = strlen(prefix);
+	return (size_t)(end - p) >= len && memcmp(p, prefix, len) == 0;
+}
+
+// Only the two conventions generators actually write count, and only at the
+// start of a comment: "@generated" (Buck, Hack, Relay and others) and a
+// line of its own reading "Code generated ... DO NOT EDIT." (Go, protoc and
+// others). The words turning up in ordinary prose do not.
+static int is_marker_line(const char *p, const char *end) {
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	int commented = 0;
+	for (int i = 0; comment_leaders[i] != NULL; i++) {
+		if (starts_with(p, end, comment_leaders[i])) {
+			p += strlen(comment_leaders[i]);
+			commented = 1;
+			break;
+		}
+	}
+	if (!commented) {
+		return 0;
+	}
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '*' || *p == '!')) {
+		p++;
+	}
+	if (starts_with(p, end, "@generated")) {
+		return 1;
+	}
+
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) {
+		end--;
+	}
+	for (int i = 0; i < 2; i++) {
+		const char *closer = i == 0 ? "*/" : "-->";
+		size_t closer_len = strlen(closer);
+		if ((size_t)(end - p) >= closer_len && memcmp(end - closer_len, closer, closer_len) == 0) {
+			end -= closer_len;
+			while (end > p && (end[-1] == ' ' || end[-1] == '\t')) {
+				end--;
+			}
+		}
+	}
+	static const char tail[] = "DO NOT EDIT.";
+	return starts_with(p, end, "Code generated ") && (size_t)(end - p) >= sizeof(tail) - 1 &&
+		   memcmp(end - (sizeof(tail) - 1), tail, sizeof(tail) - 1) == 0;
+}
+
+int ignore_is_generated(const char *content, size_t len) {
+	size_t head = len < GENERATED_SNIFF_BYTES ? len : GENERATED_SNIFF_BYTES;
+	for (const char *line = content, *end = content + head; line < end;) {
+		const char *newline = memchr(line, '\n', (size_t)(end - line));
+		const char *line_end = newline != NULL ? newline : end;
+		if (is_marker_line(line, line_end)) {
+			return GENERATED_MARKER;
+		}
+		line = line_end + 1;
+	}
+
+	if (len < MINIFIED_MIN_BYTES) {
+		return GENERATED_NONE;
+	}
+	size_t sample = len < MINIFIED_SNIFF_BYTES ? len : MINIFIED_SNIFF_BYTES;
+	size_t lines = 1;
+	for (const char *p = content, *end = content + sample; (p = memchr(p, '\n', (size_t)(end - p))) != NULL; p++) {
+		lines++;
+	}
+	return sample / lines > MINIFIED_LINE_LENGTH ? GENERATED_MINIFIED : GENERATED_NONE;
+}
+
+static int class_match(const char **pattern, char c) {
+	const char *p = *pattern + 1; // skip '['
+	int negate = 0;
+	int matched = 0;
+
+	if (*p == '!' || *p == '^') {
+		negate = 1;
+		p++;
+	}
+
+	int first = 1;
+	while (*p && (*p != ']' || first)) {
+		char lo = *p;
+		if (lo == '\\' && p[1]) {
+			lo = *++p;
+		}
+		char hi = lo;
+		if (p[1] == '-' && p[2] && p[2] != ']') {
+			hi = p[2];
+			p += 2;
+		}
+		if (c >= lo && c <= hi) {
+			matched = 1;
+		}
+		p++;
+		first = 0;
+	}
+
+	if (*p != ']') {
+		return -1; // unterminated, treat '[' literally
+	}
+	*pattern = p + 1;
+	return matched != negate;
+}
+
+// gitignore flavoured glob: '*', '?' and classes never match '/', while "**"
+// matches across directories ("**/x", "x/**" and "a/**/b").
+static int glob_match(const char *p, const char *s) {
+	while (*p) {
+		if (p[0] == '*' && p[1] == '*') {
+			p += 2;
+			if (*p == '/') {
+				p++;
+				while (1) {
+					if (glob_match(p, s)) {
+						return 1;
+					}
+					const char *slash = strchr(s, '/');
+					if (slash == NULL) {
+						return 0;
+					}
+					s = slash + 1;
+				}
+			}
+			while (1) {
+				if (glob_match(p, s)) {
+					return 1;
+				}
+				if (*s == '\0') {
+					return 0;
+				}
+				s++;
+			}
+		}
+
+		if (*p == '*') {
+			p++;
+			while (1) {
+				if (glob_match(p, s)) {
+					return 1;
+				}
+				if (*s == '\0' || *s == '/') {
+					return 0;
+				}
+				s++;
+			}
+		}
+
+		if (*s == '\0') {
+			return 0;
+		}
+
+		if (*p == '?') {
+			if (*s == '/') {
+				return 0;
+			}
+			p++;
+			s++;
+			continue;
+		}
+
+		if (*p == '[') {
+			const char *next = p;
+			int result = class_match(&next, *s);
+			if (result >= 0) {
+				if (!result || *s == '/') {
+					return 0;
+				}
+				p = next;
+				s++;
+				continue;
+			}
+		}
+
+		if (*p == '\\' && p[1]) {
+			p++;
+		}
+		if (*p != *s) {
+			return 0;
+		}
+		p++;
+		s++;
+	}
+
+	return *s == '\0';
+}
+
+static int rule_matches(const IgnoreRule *rule, const char *target, size_t target_len) {
+	switch (rule->kind) {
+	case RULE_LITERAL:
+		return target_len == rule->len && memcmp(target, rule->pattern, rule->len) == 0;
+	case RULE_SUFFIX:
+		return target_len >= rule->len && memcmp(target + target_len - rule->len, rule->pattern, rule->len) == 0;
+	default:
+		return glob_match(rule->pattern, target);
+	}
+}
+
+static int has_glob_chars(const char *s) {
+	return strpbrk(s, "*?[\\") != NULL;
+}
+
+// Parses one line of an ignore file into rule. Returns 0 for blank lines and
+// comments.
+static int parse_rule(char *line, size_t len, IgnoreRule *rule) {
+	memset(rule, 0, sizeof(IgnoreRule));
+
+	while (len > 0 && (line[len - 1] == '\r' || (line[len - 1] == ' ' && (len < 2 || line[len - 2] != '\\')))) {
+		len--;
+	}
+	line[len] = '\0';
+
+	if (len == 0 || line[0] == '#') {
+		return 0;
+	}
+
+	if (line[0] == '!') {
+		rule->negate = 1;
+		line++;
+		len--;
+	} else if (line[0] == '\\' && (line[1] == '#' || line[1] == '!')) {
+		line++;
+		len--;
+	}
+
+	if (len > 0 && line[len - 1] == '/') {
+		rule->dir_only = 1;
+		line[--len] = '\0';
+	}
+
+	if (strchr(line, '/') != NULL) {
+		rule->anchored = 1;
+		if (line[0] == '/') {
+			line++;
+			len--;
+		}
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+	if (!has_glob_chars(line)) {
+		rule->kind = RULE_LITERAL;
+		rule->pattern = strdup(line);
+		rule->len = len;
+	} else if (!rule->anchored && line[0] == '*' && !has_glob_chars(line + 1)) {
+		rule->kind = RULE_SUFFIX;
+		rule->pattern = strdup(line + 1);
+		rule->len = len - 1;
+	} else {
+		rule->kind = RULE_GLOB;
+		rule->pattern = strdup(line);
+		rule->len = len;
+	}
+
+	if (rule->pattern == NULL) {
+		perror("strdup");
+		exit(EXIT_FAILURE);
+	}
+	return 1;
+}
+
+static void load_rules(IgnoreList *list, int dir_fd, const char *file_name) {
+	int fd = openat(dir_fd, file_name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return;
+	}
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == -1 || !S_ISREG(statbuf.st_mode)) {
+		close(fd);
+		return;
+	}
+
+	struct FileContent file = read_file_descriptor(fd, &statbuf);
+	close(fd);
+	if (file.content == NULL) {
+		return;
+	}
+
+	// Work on a private, NUL terminated copy so lines can be cut in place.
+	char *text = malloc(file.count + 1);
+	if (text == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(text, file.content, file.count);
+	text[file.count] = '\0';
+	free_file_content(&file);
+
+	char *line = text;
+	while (*line) {
+		char *end = strchr(line, '\n');
+		size_t len = end ? (size_t)(end - line) : strlen(line);
+
+		IgnoreRule rule;
+		if (parse_rule(line, len, &rule)) {
+			IgnoreRule *rules = realloc(list->rules, sizeof(IgnoreRule) * (list->rule_count + 1));
+			if (rules == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+			list->rules = rules;
+			list->rules[list->rule_count++] = rule;
+		}
+
+		if (end == NULL) {
+			break;
+		}
+		line = end + 1;
+	}
+
+	free(text);
+}
+
+// Reads the ignore files of the directory open at dir_fd. When it has none the
+// parent list is shared as is, so plain directories cost nothing.
+IgnoreList *ignore_load(IgnoreList *parent, int dir_fd, const char *rel_dir, size_t rel_dir_len) {
+	IgnoreList *list = calloc(1, sizeof(IgnoreList));
+	if (list == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	load_rules(list, dir_fd, ".gitignore");
+	load_rules(list, dir_fd, ".ignore");
+
+	if (list->rule_count == 0) {
+		free(list);
+		if (parent != NULL) {
+			ignore_retain(parent);
+		}
+		return parent;
+	}
+
+	list->base = malloc(rel_dir_len + 1);
+	if (list->base == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(list->base, rel_dir, rel_dir_len);
+	list->base[rel_dir_len] = '\0';
+	list->base_len = rel_dir_len;
+	list->parent = parent;
+	list->refs = 1;
+	if (parent != NULL) {
+		ignore_retain(parent);
+	}
+
+	return list;
+}
+
+// rel_path is relative to the walk root. Rules in deeper directories take
+// precedence, and within a file the last matching rule wins, as in git.
+int ignore_match(const IgnoreList *list, const char *rel_path, size_t rel_path_len, int is_dir) {
+	const char *name = strrchr(rel_path, '/');
+	name = name ? name + 1 : rel_path;
+	size_t name_len = rel_path_len - (size_t)(name - rel_path);
+
+	for (; list != NULL; list = list->parent) {
+		const char *sub = rel_path;
+		size_t sub_len = rel_path_len;
+		if (list->base_len > 0) {
+			if (rel_path_len <= list->base_len || memcmp(rel_path, list->base, list->base_len) != 0 || rel_path[list->base_len] != '/') {
+				continue;
+			}
+			sub += list->base_len + 1;
+			sub_len -= list->base_len + 1;
+		}
+
+		for (int i = list->rule_count - 1; i >= 0; i--) {
+			const IgnoreRule *rule = &list->rules[i];
+			if (rule->dir_only && !is_dir) {
+				continue;
+			}
+
+			int matched = rule->anchored ? rule_matches(rule, sub, sub_len) : rule_matches(rule, name, name_len);
+			if (matched) {
+				return !rule->negate;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void ignore_retain(IgnoreList *list) {
+	__atomic_fetch_add(&list->refs, 1, __ATOMIC_RELAXED);
+}
+
+void ignore_release(IgnoreList *list) {
+	while (list != NULL && __atomic_sub_fetch(&list->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		IgnoreList *parent = list->parent;
+		for (int i = 0; i < list->rule_count; i++) {
+			free(list->rules[i].pattern);
+		}
+		free(list->rules);
+		free(list->base);
+		free(list);
+		list = parent;
+	}
+}
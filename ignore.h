@@ -0,0 +1,36 @@
+#ifndef IGNORE_H
+#define IGNORE_H
+
+#include <stddef.h>
+
+typedef struct IgnoreRule IgnoreRule;
+
+// Rules from the .gitignore and .ignore files of one directory, chained to
+// the lists of its parent directories. Lists are shared between the walker
+// jobs of all subdirectories and are reference counted.
+typedef struct IgnoreList {
+	struct IgnoreList *parent;
+	char *base; // directory holding the files, relative to the walk root
+	size_t base_len;
+	IgnoreRule *rules;
+	int rule_count;
+	int refs;
+} IgnoreList;
+
+IgnoreList *ignore_load(IgnoreList *parent, int dir_fd, const char *rel_dir, size_t rel_dir_len);
+int ignore_match(const IgnoreList *list, const char *rel_path, size_t rel_path_len, int is_dir);
+int ignore_default_skip(const char *name);
+int ignore_is_binary(const char *content, size_t len);
+
+// Text files that are not worth parsing: output of code generators that say
+// so near the top, and minified code with very long lines.
+enum {
+	GENERATED_NONE = 0,
+	GENERATED_MARKER,
+	GENERATED_MINIFIED,
+};
+int ignore_is_generated(const char *content, size_t len);
+void ignore_retain(IgnoreList *list);
+void ignore_release(IgnoreList *list);
+
+#endif
@@ -0,0 +1,564 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "index.h"
+
+typedef struct {
+	char *name;
+	char *kind;
+	char *ftype;
+	char *fparams;
+	uint32_t lineno;
+} IndexEntrySymbol;
+
+struct IndexEntry {
+	char *path;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t hash;
+	IndexEntrySymbol *symbols;
+	size_t symbol_count;
+	size_t symbol_capacity;
+};
+
+struct IndexBuilder {
+	pthread_mutex_t lock;
+	IndexEntry **entries;
+	size_t count;
+	size_t capacity;
+	size_t symbol_count;
+};
+
+// Interns strings into the pool written at the end of the index.
+typedef struct {
+	char *data;
+	size_t size;
+	size_t capacity;
+	uint32_t *slots; // offset + 1, 0 = empty
+	size_t slot_count;
+	size_t used;
+} StringPool;
+
+static char *xstrdup(const char *str) {
+	char *copy = strdup(str != NULL ? str : "");
+	if (copy == NULL) {
+		perror("strdup");
+		exit(EXIT_FAILURE);
+	}
+	return copy;
+}
+
+// 64-bit hash over the raw bytes, used to tell whether a touched file really
+// changed. Not cryptographic; collisions only cost a missed re-parse.
+uint64_t index_hash(const char *data, size_t len) {
+	uint64_t h = 0x9E3779B97F4A7C15ULL ^ (len * 0xC2B2AE3D27D4EB4FULL);
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		word *= 0x87C37B91114253D5ULL;
+		word = (word << 31) | (word >> 33);
+		h ^= word * 0x4CF5AD432745937FULL;
+		h = ((h << 27) | (h >> 37)) * 5 + 0x52DCE729;
+	}
+
+	uint64_t tail = 0;
+	memcpy(&tail, data + i, len - i);
+	h ^= tail * 0x87C37B91114253D5ULL;
+
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// The index is found in the tree being searched and is used without further
+// checks afterwards, so every offset and range in it is validated once up
+// front: a damaged or crafted index is ignored rather than read out of
+// bounds.
+static int index_is_valid(const IndexHeader *header, const IndexFile *files, const IndexSymbol *symbols, const char *strings) {
+	uint64_t strings_size = header->strings_size;
+	if (strings[strings_size - 1] != '\0') {
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < header->file_count; i++) {
+		const IndexFile *file = &files[i];
+		if (file->path >= strings_size || (uint64_t)file->first_symbol + file->symbol_count > header->symbol_count) {
+			return 0;
+		}
+		// Strictly ascending, index_find_file is a binary search.
+		if (i > 0 && strcmp(strings + files[i - 1].path, strings + file->path) >= 0) {
+			return 0;
+		}
+	}
+
+	for (uint32_t i = 0; i < header->symbol_count; i++) {
+		const IndexSymbol *symbol = &symbols[i];
+		if (symbol->name >= strings_size || symbol->kind >= strings_size || symbol->ftype >= strings_size || symbol->fparams >= strings_size) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Checks the header and sets up the section pointers over an index image,
+// either mapped from disk or built in memory.
+static Index *index_wrap(void *map, size_t map_size, int mapped) {
+	const IndexHeader *header = (const IndexHeader *)map;
+	size_t files_size = sizeof(IndexFile) * (size_t)header->file_count;
+	size_t symbols_size = sizeof(IndexSymbol) * (size_t)header->symbol_count;
+	size_t symbols_offset = (sizeof(IndexHeader) + files_size + 7) & ~(size_t)7;
+	size_t strings_offset = symbols_offset + symbols_size;
+
+	if (memcmp(header->magic, INDEX_MAGIC, 8) != 0 || header->version != INDEX_VERSION || header->strings_size == 0 ||
+		header->strings_size > map_size || strings_offset != map_size - header->strings_size) {
+		return NULL;
+	}
+
+	const IndexFile *files = (const IndexFile *)((const char *)map + sizeof(IndexHeader));
+	const IndexSymbol *symbols = (const IndexSymbol *)((const char *)map + symbols_offset);
+	const char *strings = (const char *)map + strings_offset;
+	if (!index_is_valid(header, files, symbols, strings)) {
+		return NULL;
+	}
+
+	Index *index = malloc(sizeof(Index));
+	if (index == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	index->map = map;
+	index->map_size = map_size;
+	index->mapped = mapped;
+	index->header = header;
+	index->files = files;
+	index->symbols = symbols;
+	index->strings = strings;
+	return index;
+}
+
+Index *index_open(const char *root) {
+	size_t root_len = strlen(root);
+	char *path = malloc(root_len + sizeof("/" INDEX_DIR "/" INDEX_FILE));
+	if (path == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	sprintf(path, "%s/%s/%s", root, INDEX_DIR, INDEX_FILE);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == -1 || (size_t)statbuf.st_size < sizeof(IndexHeader)) {
+		close(fd);
+		return NULL;
+	}
+
+	size_t map_size = (size_t)statbuf.st_size;
+	void *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	Index *index = index_wrap(map, map_size, 1);
+	if (index == NULL) {
+		munmap(map, map_size);
+	}
+	return index;
+}
+
+// Files are sorted by path, so lookups are a binary search over the map.
+const IndexFile *index_find_file(const Index *index, const char *rel_path) {
+	size_t lo = 0;
+	size_t hi = index->header->file_count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(index->strings + index->files[mid].path, rel_path);
+		if (cmp == 0) {
+			return &index->files[mid];
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+int index_file_is_fresh(const IndexFile *file, const struct stat *statbuf) {
+	return file->size == (uint64_t)statbuf->st_size &&
+		   file->mtime_sec == (int64_t)statbuf->st_mtim.tv_sec &&
+		   file->mtime_nsec == (int64_t)statbuf->st_mtim.tv_nsec;
+}
+
+void index_file_function(const Index *index, const IndexSymbol *symbol, Function *fn) {
+	fn->fname = index->strings + symbol->name;
+	fn->kind = index->strings + symbol->kind;
+	fn->ftype = text_view(symbol->ftype != 0 ? index->strings + symbol->ftype : NULL);
+	fn->fparams = text_view(symbol->fparams != 0 ? index->strings + symbol->fparams : NULL);
+	fn->lineno = symbol->lineno;
+	fn->start_byte = 0;
+	fn->end_byte = 0;
+}
+
+void index_close(Index *index) {
+	if (index == NULL) {
+		return;
+	}
+	if (index->mapped) {
+		munmap(index->map, index->map_size);
+	} else {
+		free(index->map);
+	}
+	free(index);
+}
+
+IndexEntry *index_entry_create(const char *rel_path, const struct stat *statbuf, uint64_t hash) {
+	IndexEntry *entry = calloc(1, sizeof(IndexEntry));
+	if (entry == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	entry->path = xstrdup(rel_path);
+	entry->size = (uint64_t)statbuf->st_size;
+	entry->mtime_sec = (int64_t)statbuf->st_mtim.tv_sec;
+	entry->mtime_nsec = (int64_t)statbuf->st_mtim.tv_nsec;
+	entry->hash = hash;
+	return entry;
+}
+
+void index_entry_add_function(IndexEntry *entry, const Function *fn) {
+	if (entry->symbol_count == entry->symbol_capacity) {
+		entry->symbol_capacity = entry->symbol_capacity ? entry->symbol_capacity * 2 : 16;
+		entry->symbols = realloc(entry->symbols, sizeof(IndexEntrySymbol) * entry->symbol_capacity);
+		if (entry->symbols == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	IndexEntrySymbol *symbol = &entry->symbols[entry->symbol_count++];
+	symbol->name = xstrdup(fn->fname);
+	symbol->kind = xstrdup(fn->kind);
+	symbol->ftype = text_view_dup(fn->ftype, 0);
+	symbol->fparams = text_view_dup(fn->fparams, 1);
+	symbol->lineno = (uint32_t)fn->lineno;
+}
+
+void index_entry_copy_functions(IndexEntry *entry, const Index *index, const IndexFile *file) {
+	for (uint32_t i = 0; i < file->symbol_count; i++) {
+		Function fn;
+		index_file_function(index, &index->symbols[file->first_symbol + i], &fn);
+		index_entry_add_function(entry, &fn);
+	}
+}
+
+void index_entry_free(IndexEntry *entry) {
+	for (size_t i = 0; i < entry->symbol_count; i++) {
+		free(entry->symbols[i].name);
+		free(entry->symbols[i].kind);
+		free(entry->symbols[i].ftype);
+		free(entry->symbols[i].fparams);
+	}
+	free(entry->symbols);
+	free(entry->path);
+	free(entry);
+}
+
+IndexBuilder *index_builder_create(void) {
+	IndexBuilder *builder = calloc(1, sizeof(IndexBuilder));
+	if (builder == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&builder->lock, NULL);
+	return builder;
+}
+
+void index_builder_add(IndexBuilder *builder, IndexEntry *entry) {
+	pthread_mutex_lock(&builder->lock);
+	if (builder->count == builder->capacity) {
+		builder->capacity = builder->capacity ? builder->capacity * 2 : 256;
+		builder->entries = realloc(builder->entries, sizeof(IndexEntry *) * builder->capacity);
+		if (builder->entries == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	builder->entries[builder->count++] = entry;
+	builder->symbol_count += entry->symbol_count;
+	pthread_mutex_unlock(&builder->lock);
+}
+
+size_t index_builder_file_count(const IndexBuilder *builder) {
+	return builder->count;
+}
+
+size_t index_builder_symbol_count(const IndexBuilder *builder) {
+	return builder->symbol_count;
+}
+
+static uint64_t string_hash(const char *str) {
+	uint64_t h = 0xCBF29CE484222325ULL;
+	for (; *str; str++) {
+		h = (h ^ (unsigned char)*str) * 0x100000001B3ULL;
+	}
+	return h;
+}
+
+static void pool_grow_slots(StringPool *pool) {
+	size_t slot_count = pool->slot_count ? pool->slot_count * 2 : 1024;
+	uint32_t *slots = calloc(slot_count, sizeof(uint32_t));
+	if (slots == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < pool->slot_count; i++) {
+		if (pool->slots[i] != 0) {
+			size_t j = string_hash(pool->data + pool->slots[i] - 1) & (slot_count - 1);
+			while (slots[j] != 0) {
+				j = (j + 1) & (slot_count - 1);
+			}
+			slots[j] = pool->slots[i];
+		}
+	}
+
+	free(pool->slots);
+	pool->slots = slots;
+	pool->slot_count = slot_count;
+}
+
+static uint32_t pool_intern(StringPool *pool, const char *str) {
+	if (str == NULL || *str == '\0') {
+		return 0;
+	}
+
+	if ((pool->used + 1) * 2 > pool->slot_count) {
+		pool_grow_slots(pool);
+	}
+
+	size_t mask = pool->slot_count - 1;
+	size_t i = string_hash(str) & mask;
+	while (pool->slots[i] != 0) {
+		if (strcmp(pool->data + pool->slots[i] - 1, str) == 0) {
+			return pool->slots[i] - 1;
+		}
+		i = (i + 1) & mask;
+	}
+
+	size_t len = strlen(str) + 1;
+	if (pool->size + len > pool->capacity) {
+		while (pool->size + len > pool->capacity) {
+			pool->capacity = pool->capacity ? pool->capacity * 2 : 64 * 1024;
+		}
+		pool->data = realloc(pool->data, pool->capacity);
+		if (pool->data == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	uint32_t offset = (uint32_t)pool->size;
+	memcpy(pool->data + pool->size, str, len);
+	pool->size += len;
+	pool->slots[i] = offset + 1;
+	pool->used++;
+	return offset;
+}
+
+static int compare_entries(const void *a, const void *b) {
+	const IndexEntry *x = *(const IndexEntry *const *)a;
+	const IndexEntry *y = *(const IndexEntry *const *)b;
+	return strcmp(x->path, y->path);
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+	const char *p = (const char *)data;
+	while (len > 0) {
+		ssize_t written = write(fd, p, len);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += written;
+		len -= (size_t)written;
+	}
+	return 0;
+}
+
+// Lays out the complete index image in one buffer: header, files, padding to
+// 8 bytes, symbols and the string pool.
+static char *index_builder_serialize(IndexBuilder *builder, size_t *image_size) {
+	qsort(builder->entries, builder->count, sizeof(IndexEntry *), compare_entries);
+
+	StringPool pool = {0};
+	pool.data = malloc(1);
+	if (pool.data == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	pool.data[0] = '\0';
+	pool.size = 1;
+	pool.capacity = 1;
+
+	IndexFile *files = calloc(builder->count ? builder->count : 1, sizeof(IndexFile));
+	IndexSymbol *symbols = calloc(builder->symbol_count ? builder->symbol_count : 1, sizeof(IndexSymbol));
+	if (files == NULL || symbols == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	// Readers reject an index whose paths are not strictly ascending, so a
+	// path that somehow got added twice is only written once.
+	uint32_t file_index = 0;
+	uint32_t symbol_index = 0;
+	for (size_t i = 0; i < builder->count; i++) {
+		IndexEntry *entry = builder->entries[i];
+		if (i > 0 && strcmp(builder->entries[i - 1]->path, entry->path) == 0) {
+			continue;
+		}
+		IndexFile *file = &files[file_index++];
+
+		file->path = pool_intern(&pool, entry->path);
+		file->first_symbol = symbol_index;
+		file->symbol_count = (uint32_t)entry->symbol_count;
+		file->size = entry->size;
+		file->mtime_sec = entry->mtime_sec;
+		file->mtime_nsec = entry->mtime_nsec;
+		file->hash = entry->hash;
+
+		for (size_t j = 0; j < entry->symbol_count; j++) {
+			IndexEntrySymbol *source = &entry->symbols[j];
+			IndexSymbol *symbol = &symbols[symbol_index++];
+			symbol->name = pool_intern(&pool, source->name);
+			symbol->kind = pool_intern(&pool, source->kind);
+			symbol->ftype = pool_intern(&pool, source->ftype);
+			symbol->fparams = pool_intern(&pool, source->fparams);
+			symbol->lineno = source->lineno;
+		}
+	}
+
+	IndexHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, 8);
+	header.version = INDEX_VERSION;
+	header.file_count = file_index;
+	header.symbol_count = symbol_index;
+	header.strings_size = pool.size;
+
+	size_t files_size = sizeof(IndexFile) * file_index;
+	size_t symbols_offset = (sizeof(IndexHeader) + files_size + 7) & ~(size_t)7;
+	size_t symbols_size = sizeof(IndexSymbol) * symbol_index;
+	size_t size = symbols_offset + symbols_size + pool.size;
+
+	char *image = calloc(1, size);
+	if (image == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(image, &header, sizeof(header));
+	memcpy(image + sizeof(IndexHeader), files, files_size);
+	memcpy(image + symbols_offset, symbols, symbols_size);
+	memcpy(image + symbols_offset + symbols_size, pool.data, pool.size);
+
+	free(files);
+	free(symbols);
+	free(pool.data);
+	free(pool.slots);
+
+	*image_size = size;
+	return image;
+}
+
+// Writes the index next to the tree it describes. The new file is written
+// under a temporary name and renamed over the old one, so concurrent readers
+// always see a complete index.
+int index_builder_write(IndexBuilder *builder, const char *root) {
+	size_t image_size;
+	char *image = index_builder_serialize(builder, &image_size);
+
+	size_t root_len = strlen(root);
+	char *dir_path = malloc(root_len + sizeof("/" INDEX_DIR));
+	char *tmp_path = malloc(root_len + sizeof("/" INDEX_DIR "/" INDEX_FILE ".tmp"));
+	char *final_path = malloc(root_len + sizeof("/" INDEX_DIR "/" INDEX_FILE));
+	if (dir_path == NULL || tmp_path == NULL || final_path == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	sprintf(dir_path, "%s/%s", root, INDEX_DIR);
+	sprintf(tmp_path, "%s/%s/%s.tmp", root, INDEX_DIR, INDEX_FILE);
+	sprintf(final_path, "%s/%s/%s", root, INDEX_DIR, INDEX_FILE);
+
+	int result = -1;
+	if (mkdir(dir_path, 0755) == -1 && errno != EEXIST) {
+		perror("Error creating index directory");
+		goto cleanup;
+	}
+
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		perror("Error creating index");
+		goto cleanup;
+	}
+
+	if (write_all(fd, image, image_size) != 0) {
+		perror("Error writing index");
+		close(fd);
+		unlink(tmp_path);
+		goto cleanup;
+	}
+	close(fd);
+
+	if (rename(tmp_path, final_path) == -1) {
+		perror("Error replacing index");
+		unlink(tmp_path);
+		goto cleanup;
+	}
+	result = 0;
+
+cleanup:
+	free(dir_path);
+	free(tmp_path);
+	free(final_path);
+	free(image);
+	return result;
+}
+
+// Turns the collected entries into an index held in memory only, in the same
+// layout as the file, so it is queried the same way.
+Index *index_builder_finish(IndexBuilder *builder) {
+	size_t image_size;
+	char *image = index_builder_serialize(builder, &image_size);
+	Index *index = index_wrap(image, image_size, 0);
+	if (index == NULL) {
+		free(image);
+	}
+	return index;
+}
+
+void index_builder_free(IndexBuilder *builder) {
+	for (size_t i = 0; i < builder->count; i++) {
+		index_entry_free(builder->entries[i]);
+	}
+	free(builder->entries);
+	pthread_mutex_destroy(&builder->lock);
+	free(builder);
+}
@@ -0,0 +1,83 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "extract.h"
+
+// On-disk symbol index stored in <root>/.crep/index. The file is mapped
+// read-only and used in place: a header, the file records sorted by path, the
+// symbol rows of all files back to back, and a pool of NUL terminated strings
+// the records point into. Offset 0 of the pool is the empty string.
+
+#define INDEX_DIR ".crep"
+#define INDEX_FILE "index"
+#define INDEX_MAGIC "CREPIDX1"
+#define INDEX_VERSION 1
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t file_count;
+	uint32_t symbol_count;
+	uint32_t reserved;
+	uint64_t strings_size;
+} IndexHeader;
+
+typedef struct {
+	uint32_t path; // relative to the indexed root
+	uint32_t first_symbol;
+	uint32_t symbol_count;
+	uint32_t reserved;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t hash;
+} IndexFile;
+
+typedef struct {
+	uint32_t name;
+	uint32_t kind;
+	uint32_t ftype;
+	uint32_t fparams;
+	uint32_t lineno;
+} IndexSymbol;
+
+typedef struct {
+	void *map;
+	size_t map_size;
+	int mapped; // otherwise map is a heap buffer
+	const IndexHeader *header;
+	const IndexFile *files;
+	const IndexSymbol *symbols;
+	const char *strings;
+} Index;
+
+typedef struct IndexBuilder IndexBuilder;
+typedef struct IndexEntry IndexEntry;
+
+uint64_t index_hash(const char *data, size_t len);
+
+Index *index_open(const char *root);
+const IndexFile *index_find_file(const Index *index, const char *rel_path);
+int index_file_is_fresh(const IndexFile *file, const struct stat *statbuf);
+void index_file_function(const Index *index, const IndexSymbol *symbol, Function *fn);
+void index_close(Index *index);
+
+// Entries are filled by one worker each and then handed to the shared builder.
+IndexEntry *index_entry_create(const char *rel_path, const struct stat *statbuf, uint64_t hash);
+void index_entry_add_function(IndexEntry *entry, const Function *fn);
+void index_entry_copy_functions(IndexEntry *entry, const Index *index, const IndexFile *file);
+void index_entry_free(IndexEntry *entry);
+
+IndexBuilder *index_builder_create(void);
+void index_builder_add(IndexBuilder *builder, IndexEntry *entry);
+int index_builder_write(IndexBuilder *builder, const char *root);
+Index *index_builder_finish(IndexBuilder *builder);
+size_t index_builder_file_count(const IndexBuilder *builder);
+size_t index_builder_symbol_count(const IndexBuilder *builder);
+void index_builder_free(IndexBuilder *builder);
+
+#endif
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef CREP_DYNAMIC_GRAMMARS
+#include <dlfcn.h>
+#endif
+
+#include "lang.h"
+
+#include "queries/c.h"
+#include "queries/cpp.h"
+#include "queries/cuda.h"
+#include "queries/glsl.h"
+#include "queries/go.h"
+#include "queries/javascript.h"
+#include "queries/kotlin.h"
+#include "queries/lua.h"
+#include "queries/odin.h"
+#include "queries/php.h"
+#include "queries/python.h"
+#include "queries/rust.h"
+#include "queries/tcl.h"
+#include "queries/zig.h"
+
+extern int debug_enabled;
+
+// With CREP_DYNAMIC_GRAMMARS every grammar is a shared object that is opened
+// the first time a file of its language is parsed, so a search that only
+// touches C files never maps the other parse tables. Otherwise they are all
+// linked in.
+#ifdef CREP_DYNAMIC_GRAMMARS
+#define GRAMMAR(lang) NULL
+#else
+TSLanguage *tree_sitter_c(void);
+TSLanguage *tree_sitter_cpp(void);
+TSLanguage *tree_sitter_go(void);
+TSLanguage *tree_sitter_python(void);
+TSLanguage *tree_sitter_php(void);
+TSLanguage *tree_sitter_rust(void);
+TSLanguage *tree_sitter_javascript(void);
+TSLanguage *tree_sitter_lua(void);
+TSLanguage *tree_sitter_zig(void);
+TSLanguage *tree_sitter_kotlin(void);
+TSLanguage *tree_sitter_odin(void);
+TSLanguage *tree_sitter_tcl(void);
+TSLanguage *tree_sitter_glsl(void);
+TSLanguage *tree_sitter_cuda(void);
+#define GRAMMAR(lang) tree_sitter_##lang
+#endif
+
+#define LANGUAGE(ID, lang, cost)                    \
+	[LANG_##ID] = {                                 \
+		.id = LANG_##ID,                            \
+		.name = #lang,                              \
+		.grammar = GRAMMAR(lang),                   \
+		.query_source = query_##lang,               \
+		.query_len = &query_##lang##_len,           \
+		.cost_factor = cost,                        \
+		.lock = PTHREAD_MUTEX_INITIALIZER,          \
+	}
+
+// Cost factors were measured on the grammars' test files; the rest default
+// to the cost of C.
+static Language languages[LANG_COUNT] = {
+	LANGUAGE(C, c, 100),
+	LANGUAGE(CPP, cpp, 100),
+	LANGUAGE(GO, go, 97),
+	LANGUAGE(PYTHON, python, 107),
+	LANGUAGE(PHP, php, 100),
+	LANGUAGE(RUST, rust, 100),
+	LANGUAGE(JAVASCRIPT, javascript, 100),
+	LANGUAGE(LUA, lua, 84),
+	LANGUAGE(ZIG, zig, 100),
+	LANGUAGE(KOTLIN, kotlin, 100),
+	LANGUAGE(ODIN, odin, 100),
+	LANGUAGE(TCL, tcl, 82),
+	LANGUAGE(GLSL, glsl, 100),
+	LANGUAGE(CUDA, cuda, 100),
+};
+
+static const struct {
+	const char *extension;
+	int id;
+} extensions[] = {
+	{"c", LANG_C},
+	{"h", LANG_C},
+	{"cpp", LANG_CPP},
+	{"hpp", LANG_CPP},
+	{"go", LANG_GO},
+	{"py", LANG_PYTHON},
+	{"php", LANG_PHP},
+	{"rs", LANG_RUST},
+	{"js", LANG_JAVASCRIPT},
+	{"lua", LANG_LUA},
+	{"zig", LANG_ZIG},
+	{"kt", LANG_KOTLIN},
+	{"odin", LANG_ODIN},
+	{"tcl", LANG_TCL},
+	{"glsl", LANG_GLSL},
+	{"cu", LANG_CUDA},
+	{"cuh", LANG_CUDA},
+};
+
+#define EXTENSION_COUNT (sizeof(extensions) / sizeof(extensions[0]))
+#define EXTENSION_SLOTS 64 // power of two
+#define EXTENSION_MAX_LEN 8
+
+// Perfect hash over the extension table: the seed is picked once so that
+// every extension lands in a slot of its own, and a lookup is one hash and
+// one string compare. Slots hold an index into extensions plus one.
+static uint8_t extension_slots[EXTENSION_SLOTS];
+static uint32_t extension_seed;
+static pthread_once_t extension_once = PTHREAD_ONCE_INIT;
+
+static uint32_t extension_hash(const char *extension, size_t len, uint32_t seed) {
+	uint32_t h = seed;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)extension[i]) * 16777619u;
+	}
+	return h ^ (h >> 16);
+}
+
+static void extension_table_build(void) {
+	for (uint32_t seed = 2166136261u;; seed++) {
+		memset(extension_slots, 0, sizeof(extension_slots));
+		size_t i;
+		for (i = 0; i < EXTENSION_COUNT; i++) {
+			const char *extension = extensions[i].extension;
+			uint32_t slot = extension_hash(extension, strlen(extension), seed) & (EXTENSION_SLOTS - 1);
+			if (extension_slots[slot] != 0) {
+				break;
+			}
+			extension_slots[slot] = (uint8_t)(i + 1);
+		}
+		if (i == EXTENSION_COUNT) {
+			extension_seed = seed;
+			return;
+		}
+	}
+}
+
+Language *language_for_extension(const char *extension) {
+	if (extension == NULL) {
+		return NULL;
+	}
+
+	size_t len = strnlen(extension, EXTENSION_MAX_LEN + 1);
+	if (len == 0 || len > EXTENSION_MAX_LEN) {
+		return NULL;
+	}
+
+	pthread_once(&extension_once, extension_table_build);
+	uint8_t entry = extension_slots[extension_hash(extension, len, extension_seed) & (EXTENSION_SLOTS - 1)];
+	if (entry == 0 || strcmp(extensions[entry - 1].extension, extension) != 0) {
+		return NULL;
+	}
+	return &languages[extensions[entry - 1].id];
+}
+
+#ifdef CREP_DYNAMIC_GRAMMARS
+// Grammars live in $CREP_GRAMMAR_DIR, or in grammars/ next to the binary, as
+// libtree-sitter-<name>.so. They stay loaded until the process exits, since
+// parsers and trees of any thread may still point into them.
+static int load_grammar(Language *lang) {
+	char path[PATH_MAX + 64];
+	const char *env = getenv("CREP_GRAMMAR_DIR");
+	if (env != NULL) {
+		snprintf(path, sizeof(path), "%s/libtree-sitter-%s.so", env, lang->name);
+	} else {
+		char exe[PATH_MAX];
+		ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+		if (len <= 0) {
+			return -1;
+		}
+		exe[len] = '\0';
+		char *slash = strrchr(exe, '/');
+		if (slash != NULL) {
+			*slash = '\0';
+		}
+		snprintf(path, sizeof(path), "%s/grammars/libtree-sitter-%s.so", exe, lang->name);
+	}
+
+	void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL) {
+		if (debug_enabled) {
+			fprintf(stderr, "Failed to load grammar %s: %s\n", lang->name, dlerror());
+		}
+		return -1;
+	}
+
+	char symbol[64];
+	snprintf(symbol, sizeof(symbol), "tree_sitter_%s", lang->name);
+	*(void **)&lang->grammar = dlsym(handle, symbol);
+	if (lang->grammar == NULL) {
+		if (debug_enabled) {
+			fprintf(stderr, "Grammar %s has no symbol %s\n", path, symbol);
+		}
+		dlclose(handle);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+static CaptureRole capture_role_for_name(const char *name, uint32_t length) {
+	if (length == 5 && memcmp(name, "fname", 5) == 0) {
+		return CAPTURE_FNAME;
+	}
+	if (length == 5 && memcmp(name, "ftype", 5) == 0) {
+		return CAPTURE_FTYPE;
+	}
+	if (length == 7 && memcmp(name, "fparams", 7) == 0) {
+		return CAPTURE_FPARAMS;
+	}
+	return CAPTURE_NONE;
+}
+
+// Names a pattern after the first node type it mentions, e.g.
+// "function_definition" for "(function_definition ...)".
+static char *pattern_kind(const char *source, uint32_t start, uint32_t end) {
+	while (start < end && (source[start] == '(' || source[start] == '[' || source[start] == ' ' || source[start] == '\n' || source[start] == '\t')) {
+		start++;
+	}
+
+	uint32_t len = 0;
+	while (start + len < end && (source[start + len] == '_' || (source[start + len] >= 'a' && source[start + len] <= 'z') || (source[start + len] >= 'A' && source[start + len] <= 'Z') || (source[start + len] >= '0' && source[start + len] <= '9'))) {
+		len++;
+	}
+
+	char *kind = malloc(len + 1);
+	if (kind == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(kind, source + start, len);
+	kind[len] = '\0';
+	return kind;
+}
+
+// Compiles the language's query on first use. Safe to call from any worker;
+// only the first caller pays for ts_query_new, everybody else sees the cached
+// query. Returns 0 when the query is ready to use.
+int language_prepare(Language *lang) {
+	int state = __atomic_load_n(&lang->state, __ATOMIC_ACQUIRE);
+	if (state != 0) {
+		return state == 1 ? 0 : -1;
+	}
+
+	pthread_mutex_lock(&lang->lock);
+#ifdef CREP_DYNAMIC_GRAMMARS
+	if (lang->state == 0 && lang->grammar == NULL && load_grammar(lang) != 0) {
+		__atomic_store_n(&lang->state, -1, __ATOMIC_RELEASE);
+	}
+#endif
+	if (lang->state == 0) {
+		TSLanguage *language = lang->grammar();
+
+		uint32_t error_offset;
+		TSQueryError error_type;
+		TSQuery *query = ts_query_new(language, (const char *)lang->query_source, *lang->query_len, &error_offset, &error_type);
+
+		if (query == NULL) {
+			if (debug_enabled) {
+				fprintf(stderr, "Query creation failed for %s at offset %u with error type %d\n", lang->name, error_offset, error_type);
+			}
+			__atomic_store_n(&lang->state, -1, __ATOMIC_RELEASE);
+		} else {
+			uint32_t capture_count = ts_query_capture_count(query);
+			uint8_t *roles = malloc(capture_count > 0 ? capture_count : 1);
+			if (roles == NULL) {
+				perror("malloc");
+				exit(EXIT_FAILURE);
+			}
+
+			for (uint32_t i = 0; i < capture_count; i++) {
+				uint32_t length;
+				const char *name = ts_query_capture_name_for_id(query, i, &length);
+				roles[i] = capture_role_for_name(name, length);
+			}
+
+			uint32_t pattern_count = ts_query_pattern_count(query);
+			char **kinds = malloc(sizeof(char *) * (pattern_count > 0 ? pattern_count : 1));
+			if (kinds == NULL) {
+				perror("malloc");
+				exit(EXIT_FAILURE);
+			}
+
+			const char *source = (const char *)lang->query_source;
+			for (uint32_t i = 0; i < pattern_count; i++) {
+				uint32_t start = ts_query_start_byte_for_pattern(query, i);
+				uint32_t end = i + 1 < pattern_count ? ts_query_start_byte_for_pattern(query, i + 1) : *lang->query_len;
+				kinds[i] = pattern_kind(source, start, end);
+			}
+
+			lang->language = language;
+			lang->query = query;
+			lang->capture_roles = roles;
+			lang->pattern_kinds = kinds;
+			__atomic_store_n(&lang->state, 1, __ATOMIC_RELEASE);
+		}
+	}
+	state = lang->state;
+	pthread_mutex_unlock(&lang->lock);
+
+	return state == 1 ? 0 : -1;
+}
+
+void language_cleanup(void) {
+	for (int i = 0; i < LANG_COUNT; i++) {
+		Language *lang = &languages[i];
+		if (lang->query != NULL) {
+			for (uint32_t j = 0; j < ts_query_pattern_count(lang->query); j++) {
+				free(lang->pattern_kinds[j]);
+			}
+			ts_query_delete(lang->query);
+		}
+		free(lang->capture_roles);
+		free(lang->pattern_kinds);
+		lang->pattern_kinds = NULL;
+		lang->query = NULL;
+		lang->capture_roles = NULL;
+		lang->state = 0;
+	}
+}
@@ -0,0 +1,55 @@
+#ifndef LANG_H
+#define LANG_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <tree_sitter/api.h>
+
+typedef enum {
+	CAPTURE_NONE = 0,
+	CAPTURE_FNAME,
+	CAPTURE_FTYPE,
+	CAPTURE_FPARAMS,
+} CaptureRole;
+
+enum {
+	LANG_C,
+	LANG_CPP,
+	LANG_GO,
+	LANG_PYTHON,
+	LANG_PHP,
+	LANG_RUST,
+	LANG_JAVASCRIPT,
+	LANG_LUA,
+	LANG_ZIG,
+	LANG_KOTLIN,
+	LANG_ODIN,
+	LANG_TCL,
+	LANG_GLSL,
+	LANG_CUDA,
+	LANG_COUNT,
+};
+
+typedef struct {
+	int id;
+	const char *name;
+	TSLanguage *(*grammar)(void);
+	const unsigned char *query_source;
+	const unsigned int *query_len;
+	int cost_factor; // parse time per byte relative to C = 100, for scheduling
+
+	// Compiled once on first use and shared read-only by all workers.
+	pthread_mutex_t lock;
+	int state; // 0 = not compiled, 1 = ready, -1 = failed
+	TSLanguage *language;
+	TSQuery *query;
+	uint8_t *capture_roles; // capture id -> CaptureRole
+	char **pattern_kinds;   // pattern index -> outermost node type
+} Language;
+
+Language *language_for_extension(const char *extension);
+int language_prepare(Language *lang);
+void language_cleanup(void);
+
+#endif
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "levenshtein.h"
+
+// Band widths up to this many cells are kept on the stack.
+#define BAND_STACK_CELLS 128
+
+void levenshtein_init(LevenshteinPattern *lp, const char *pattern) {
+	memset(lp, 0, sizeof(LevenshteinPattern));
+	lp->pattern = pattern;
+	lp->len = strlen(pattern);
+
+	if (lp->len <= 64) {
+		for (size_t i = 0; i < lp->len; i++) {
+			lp->peq[(unsigned char)pattern[i]] |= 1ULL << i;
+		}
+	}
+}
+
+// One column per text byte; Pv/Mv hold the vertical +1/-1 deltas of the
+// column and score tracks the last row. The score can drop by at most one per
+// remaining byte, so the scan stops as soon as it can no longer get within k.
+static int bit_parallel(const LevenshteinPattern *lp, const unsigned char *text, size_t text_len, int k) {
+	size_t m = lp->len;
+	uint64_t high = 1ULL << (m - 1);
+	uint64_t pv = ~0ULL;
+	uint64_t mv = 0;
+	long score = (long)m;
+
+	for (size_t j = 0; j < text_len; j++) {
+		uint64_t eq = lp->peq[text[j]];
+		uint64_t xv = eq | mv;
+		uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+		uint64_t ph = mv | ~(xh | pv);
+		uint64_t mh = pv & xh;
+
+		if (ph & high) {
+			score++;
+		} else if (mh & high) {
+			score--;
+		}
+
+		if (score - (long)(text_len - j - 1) > k) {
+			return k + 1;
+		}
+
+		ph = (ph << 1) | 1;
+		mh <<= 1;
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+	}
+
+	return score > k ? k + 1 : (int)score;
+}
+
+// Only the cells within k of the diagonal can end up at most k, so each row
+// keeps 2k + 1 of them. Cells are indexed by d = j - i + k.
+static int banded(const unsigned char *pattern, size_t m, const unsigned char *text, size_t n, int k) {
+	size_t width = 2 * (size_t)k + 1;
+	int stack_cells[2 * BAND_STACK_CELLS];
+	int *cells = stack_cells;
+	if (width > BAND_STACK_CELLS) {
+		cells = malloc(sizeof(int) * 2 * width);
+		if (cells == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	int limit = k + 1;
+	int *prev = cells;
+	int *cur = cells + width;
+
+	for (size_t d = 0; d < width; d++) {
+		long j = (long)d - k;
+		prev[d] = (j >= 0 && j <= (long)n) ? (int)j : limit;
+	}
+
+	int exceeded = 0;
+	for (size_t i = 1; i <= m && !exceeded; i++) {
+		int row_min = limit;
+		for (size_t d = 0; d < width; d++) {
+			long j = (long)d - k + (long)i;
+			int best;
+			if (j < 0 || j > (long)n) {
+				best = limit;
+			} else if (j == 0) {
+				best = (long)i < limit ? (int)i : limit;
+			} else {
+				best = prev[d] + (pattern[i - 1] != text[j - 1]);
+				if (d + 1 < width && prev[d + 1] + 1 < best) {
+					best = prev[d + 1] + 1;
+				}
+				if (d > 0 && cur[d - 1] + 1 < best) {
+					best = cur[d - 1] + 1;
+				}
+				if (best > limit) {
+					best = limit;
+				}
+			}
+			cur[d] = best;
+			if (best < row_min) {
+				row_min = best;
+			}
+		}
+
+		int *tmp = prev;
+		prev = cur;
+		cur = tmp;
+
+		exceeded = row_min > k;
+	}
+
+	int result = limit;
+	long d = (long)n - (long)m + k;
+	if (!exceeded && d >= 0 && d < (long)width) {
+		result = prev[d];
+	}
+
+	if (cells != stack_cells) {
+		free(cells);
+	}
+	return result > k ? k + 1 : result;
+}
+
+int levenshtein_bounded(const LevenshteinPattern *lp, const char *text, int max_distance) {
+	size_t n = strlen(text);
+	size_t m = lp->len;
+
+	// The length difference alone is a lower bound.
+	size_t diff = m > n ? m - n : n - m;
+	if (diff > (size_t)max_distance) {
+		return max_distance + 1;
+	}
+	if (m == 0) {
+		return (int)n;
+	}
+	if (m <= 64) {
+		return bit_parallel(lp, (const unsigned char *)text, n, max_distance);
+	}
+	return banded((const unsigned char *)lp->pattern, m, (const unsigned char *)text, n, max_distance);
+}
@@ -0,0 +1,22 @@
+#ifndef LEVENSHTEIN_H
+#define LEVENSHTEIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A search term prepared once for bounded edit distance checks against many
+// candidates. Terms of up to 64 bytes use the bit-parallel algorithm of Myers
+// as formulated by Hyyrö; longer ones fall back to a banded DP.
+typedef struct {
+	const char *pattern; // borrowed, must outlive the struct
+	size_t len;
+	uint64_t peq[256]; // byte -> positions of that byte in the pattern
+} LevenshteinPattern;
+
+void levenshtein_init(LevenshteinPattern *lp, const char *pattern);
+
+// Returns the edit distance between the pattern and text if it is at most
+// max_distance, otherwise max_distance + 1.
+int levenshtein_bounded(const LevenshteinPattern *lp, const char *text, int max_distance);
+
+#endif
@@ -1,89 +1,639 @@
+#define _GNU_SOURCE
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "ignore.h"
 #include "list.h"
+#include "stats.h"
+
+// Directories are walked as jobs on the same thread pool that parses the
+// files, so the walk itself runs in parallel and files start flowing to the
+// workers immediately. Each directory is opened once, relative to its
+// parent, and its entries are examined relative to that descriptor; d_type
+// is trusted whenever the file system provides it, so most entries never
+// need a stat call.
+
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+} InodeKey;
+
+struct Walker {
+	ThreadPool *pool;
+	int max_depth;
+	file_filter_t filter;
+	file_visitor_t visit;
+	dir_visitor_t visit_dir;
+	dir_visitor_t leave_dir;
+	void *ctx;
+
+	int use_ignore;
+	int stat_files;
+	int sorted;
+	size_t rel_offset; // strips the root path to get paths relative to it
+
+	// (dev, ino) of every directory entered and of every hard-linked file
+	// claimed, used to break symlink loops and skip duplicates.
+	pthread_mutex_t seen_lock;
+	InodeKey *seen;
+	size_t seen_count;
+	size_t seen_capacity; // power of two
+};
+
+// An open directory. Its subdirectories are opened relative to it rather than
+// by their full path, which may be longer than PATH_MAX, so it stays open
+// until the last of their jobs has started.
+typedef struct {
+	int fd;
+	int refs;
+} DirHandle;
+
+typedef struct {
+	Walker *walker;
+	char *path;
+	size_t path_len;
+	size_t name_offset; // where the name within parent starts in path
+	int depth;
+	IgnoreList *ignore; // rules inherited from the parent directories
+	DirHandle *parent;  // NULL for the root, which is opened by path
+} DirJob;
+
+// Entries of one directory, collected to be visited in name order.
+typedef struct {
+	char *name;
+	unsigned char type;
+} DirEntry;
+
+typedef struct {
+	DirEntry *entries;
+	size_t count;
+	size_t capacity;
+} DirEntryList;
+
+// A directory that was entered and whose entries are being handed out.
+typedef struct {
+	DirJob *job;
+	DirHandle *handle; // NULL if the directory could not be entered
+	IgnoreList *ignore;
+	DirEntryList list; // sorted walks only
+	size_t next;
+} DirFrame;
+
+// Directories that did not fit in the pool queue, walked by the thread that
+// found them once it is done with the current one.
+typedef struct {
+	DirJob **jobs;
+	size_t count;
+	size_t capacity;
+} DirJobList;
+
+static __thread DirJobList *overflow_jobs = NULL;
+
+static uint64_t inode_hash(dev_t dev, ino_t ino) {
+	uint64_t h = (uint64_t)ino * 0x9E3779B97F4A7C15ULL;
+	h ^= (uint64_t)dev + 0x632BE59BD9B4E019ULL + (h << 6) + (h >> 2);
+	return h;
+}
+
+static void seen_insert_unlocked(Walker *walker, InodeKey key) {
+	size_t mask = walker->seen_capacity - 1;
+	size_t i = inode_hash(key.dev, key.ino) & mask;
+	while (walker->seen[i].ino != 0) {
+		i = (i + 1) & mask;
+	}
+	walker->seen[i] = key;
+	walker->seen_count++;
+}
+
+// Returns 1 if the inode was already seen, otherwise records it and returns 0.
+int walker_seen_inode(Walker *walker, dev_t dev, ino_t ino) {
+	pthread_mutex_lock(&walker->seen_lock);
+
+	size_t mask = walker->seen_capacity - 1;
+	size_t i = inode_hash(dev, ino) & mask;
+	while (walker->seen[i].ino != 0) {
+		if (walker->seen[i].ino == ino && walker->seen[i].dev == dev) {
+			pthread_mutex_unlock(&walker->seen_lock);
+			return 1;
+		}
+		i = (i + 1) & mask;
+	}
 
-void add_file_path(Node **head, char *file_path) {
-	Node *new = (Node *)malloc(sizeof(Node));
-	if (new == NULL) {
+	if ((walker->seen_count + 1) * 2 > walker->seen_capacity) {
+		InodeKey *old = walker->seen;
+		size_t old_capacity = walker->seen_capacity;
+
+		walker->seen_capacity *= 2;
+		walker->seen = calloc(walker->seen_capacity, sizeof(InodeKey));
+		if (walker->seen == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		walker->seen_count = 0;
+		for (size_t j = 0; j < old_capacity; j++) {
+			if (old[j].ino != 0) {
+				seen_insert_unlocked(walker, old[j]);
+			}
+		}
+		free(old);
+	}
+
+	InodeKey key = {dev, ino};
+	seen_insert_unlocked(walker, key);
+
+	pthread_mutex_unlock(&walker->seen_lock);
+	return 0;
+}
+
+static char *join_path(const char *base, size_t base_len, const char *name, size_t *out_len) {
+	size_t name_len = strlen(name);
+	int needs_slash = base_len > 0 && base[base_len - 1] != '/';
+	size_t len = base_len + needs_slash + name_len;
+
+	char *path = malloc(len + 1);
+	if (path == NULL) {
 		perror("malloc");
 		exit(EXIT_FAILURE);
 	}
-	new->file_path = strdup(file_path);
-	if (new->file_path == NULL) {
-		perror("strdup");
-		free(new);
+	memcpy(path, base, base_len);
+	if (needs_slash) {
+		path[base_len] = '/';
+	}
+	memcpy(path + base_len + needs_slash, name, name_len + 1);
+
+	if (out_len != NULL) {
+		*out_len = len;
+	}
+	return path;
+}
+
+static DirHandle *dir_handle_create(int fd) {
+	DirHandle *handle = malloc(sizeof(DirHandle));
+	if (handle == NULL) {
+		perror("malloc");
 		exit(EXIT_FAILURE);
 	}
-	new->next = *head;
-	*head = new;
+	handle->fd = fd;
+	handle->refs = 1;
+	return handle;
 }
 
-void list_files_recursively(char *base_path, Node **head, int max_depth, int current_depth) {
-	struct stat statbuf;
-	if (stat(base_path, &statbuf) == -1) {
-		perror("stat");
+static void dir_handle_release(DirHandle *handle) {
+	if (handle != NULL && __atomic_sub_fetch(&handle->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(handle->fd);
+		free(handle);
+	}
+}
+
+static DirJob *dir_job_create(Walker *walker, char *path, size_t path_len, size_t name_offset, int depth, IgnoreList *ignore, DirHandle *parent) {
+	DirJob *job = malloc(sizeof(DirJob));
+	if (job == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	job->walker = walker;
+	job->path = path;
+	job->path_len = path_len;
+	job->name_offset = name_offset;
+	job->depth = depth;
+	job->ignore = ignore;
+	if (ignore != NULL) {
+		ignore_retain(ignore);
+	}
+	job->parent = parent;
+	if (parent != NULL) {
+		__atomic_fetch_add(&parent->refs, 1, __ATOMIC_RELAXED);
+	}
+	return job;
+}
+
+static void dir_job_free(DirJob *job) {
+	dir_handle_release(job->parent);
+	ignore_release(job->ignore);
+	free(job->path);
+	free(job);
+}
+
+static void walk_directory(void *arg);
+
+static void queue_directory(Walker *walker, DirJob *job) {
+	if (tp_try_add_job(walker->pool, walk_directory, job)) {
 		return;
 	}
 
-	if (S_ISREG(statbuf.st_mode)) {
-		add_file_path(head, base_path);
+	// When the queue is full the directory is kept for later instead of
+	// blocking, otherwise walkers running on pool threads could all end up
+	// waiting for queue space that only they could free. It is not walked
+	// right away either, which would nest a walk, and its read buffer, for
+	// every level of a deep tree.
+	DirJobList *list = overflow_jobs;
+	if (list == NULL) {
+		walk_directory(job);
 		return;
 	}
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->jobs = realloc(list->jobs, sizeof(DirJob *) * list->capacity);
+		if (list->jobs == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	list->jobs[list->count++] = job;
+}
 
-	char path[2048];
-	struct dirent *dp;
-	DIR *dir = opendir(base_path);
+static int is_ignored(Walker *walker, IgnoreList *ignore, const char *path, size_t path_len, int is_dir) {
+	if (!walker->use_ignore || ignore == NULL) {
+		return 0;
+	}
+	return ignore_match(ignore, path + walker->rel_offset, path_len - walker->rel_offset, is_dir);
+}
+
+// Hands a file to the visitor. Returns the job for a subdirectory still to
+// be walked, or NULL.
+static DirJob *handle_entry(Walker *walker, DirFrame *frame, const char *name, unsigned char type) {
+	if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+		return NULL;
+	}
 
-	if (!dir)
+	DirJob *job = frame->job;
+	int dir_fd = frame->handle->fd;
+
+	// Symlinks are followed like stat() would, and some file systems do not
+	// report a type at all; only those entries cost a stat call.
+	struct stat statbuf;
+	int have_stat = 0;
+	if (type == DT_LNK || type == DT_UNKNOWN) {
+		have_stat = 1;
+		if (fstatat(dir_fd, name, &statbuf, 0) == -1) {
+			return NULL;
+		}
+		if (S_ISDIR(statbuf.st_mode)) {
+			type = DT_DIR;
+		} else if (S_ISREG(statbuf.st_mode)) {
+			type = DT_REG;
+		} else {
+			return NULL;
+		}
+	}
+
+	if (type == DT_DIR) {
+		if (walker->max_depth != -1 && job->depth >= walker->max_depth) {
+			return NULL;
+		}
+		if (walker->use_ignore && ignore_default_skip(name)) {
+			return NULL;
+		}
+
+		size_t path_len;
+		char *path = join_path(job->path, job->path_len, name, &path_len);
+		if (is_ignored(walker, frame->ignore, path, path_len, 1)) {
+			free(path);
+			return NULL;
+		}
+		return dir_job_create(walker, path, path_len, path_len - strlen(name), job->depth + 1, frame->ignore, frame->handle);
+	} else if (type == DT_REG) {
+		void *tag = walker->filter(name);
+		if (tag == NULL) {
+			return NULL;
+		}
+
+		size_t path_len;
+		char *path = join_path(job->path, job->path_len, name, &path_len);
+		if (is_ignored(walker, frame->ignore, path, path_len, 0)) {
+			free(path);
+			return NULL;
+		}
+		if (walker->stat_files && !have_stat) {
+			have_stat = fstatat(dir_fd, name, &statbuf, 0) == 0;
+		}
+		walker->visit(path, tag, have_stat ? &statbuf : NULL, walker->ctx);
+	}
+	return NULL;
+}
+
+static void add_entry(Walker *walker, DirFrame *frame, DirEntryList *list, const char *name, unsigned char type) {
+	if (list == NULL) {
+		DirJob *child = handle_entry(walker, frame, name, type);
+		if (child != NULL) {
+			queue_directory(walker, child);
+		}
 		return;
+	}
 
-	while ((dp = readdir(dir)) != NULL) {
-		if (strcmp(dp->d_name, ".") != 0 && strcmp(dp->d_name, "..") != 0) {
-			int ret = snprintf(path, sizeof(path), "%s%s%s", base_path, (base_path[strlen(base_path) - 1] == '/' ? "" : "/"), dp->d_name);
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->entries = realloc(list->entries, sizeof(DirEntry) * list->capacity);
+		if (list->entries == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	list->entries[list->count].name = strdup(name);
+	if (list->entries[list->count].name == NULL) {
+		perror("strdup");
+		exit(EXIT_FAILURE);
+	}
+	list->entries[list->count].type = type;
+	list->count++;
+}
 
-			if (ret >= (int)sizeof(path)) {
-				fprintf(stderr, "Path too long: %s/%s\n", base_path, dp->d_name);
-				continue;
-			}
+static int compare_entries(const void *a, const void *b) {
+	return strcmp(((const DirEntry *)a)->name, ((const DirEntry *)b)->name);
+}
 
-			if (stat(path, &statbuf) != -1) {
-				if (S_ISDIR(statbuf.st_mode)) {
-					if (max_depth == -1 || current_depth < max_depth) {
-						list_files_recursively(path, head, max_depth, current_depth + 1);
-					}
-				} else if (S_ISREG(statbuf.st_mode)) {
-					add_file_path(head, path);
-				}
-			}
+#ifdef __linux__
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static void read_entries(Walker *walker, DirFrame *frame, DirEntryList *list) {
+	char buffer[32 * 1024] __attribute__((aligned(8)));
+	int dir_fd = frame->handle->fd;
+
+	while (1) {
+		long nread = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer));
+		if (nread == -1 && errno == EINTR) {
+			continue;
+		}
+		if (nread <= 0) {
+			break;
+		}
+
+		for (long offset = 0; offset < nread;) {
+			struct linux_dirent64 *entry = (struct linux_dirent64 *)(buffer + offset);
+			add_entry(walker, frame, list, entry->d_name, entry->d_type);
+			offset += entry->d_reclen;
 		}
 	}
+}
+#else
+static void read_entries(Walker *walker, DirFrame *frame, DirEntryList *list) {
+	int dup_fd = dup(frame->handle->fd);
+	DIR *dir = dup_fd == -1 ? NULL : fdopendir(dup_fd);
+	if (dir == NULL) {
+		if (dup_fd != -1) {
+			close(dup_fd);
+		}
+		return;
+	}
 
+	struct dirent *dp;
+	while ((dp = readdir(dir)) != NULL) {
+		add_entry(walker, frame, list, dp->d_name, dp->d_type);
+	}
 	closedir(dir);
 }
+#endif
+
+// Opens the directory of job and loads its ignore files. Returns 0, leaving
+// frame->handle NULL, if it cannot or need not be walked.
+static int enter_directory(Walker *walker, DirJob *job, DirFrame *frame) {
+	memset(frame, 0, sizeof(DirFrame));
+	frame->job = job;
+	frame->ignore = job->ignore;
+
+	// A cancelled walk stops descending; directories that were already
+	// queued still come through here and are dropped.
+	int dir_fd = -1;
+	if (!tp_cancelled(walker->pool)) {
+		if (job->parent != NULL) {
+			dir_fd = openat(job->parent->fd, job->path + job->name_offset, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		} else {
+			dir_fd = open(job->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+	}
+	dir_handle_release(job->parent);
+	job->parent = NULL;
+	if (dir_fd == -1) {
+		return 0;
+	}
+
+	struct stat statbuf;
+	if (fstat(dir_fd, &statbuf) != 0 || walker_seen_inode(walker, statbuf.st_dev, statbuf.st_ino)) {
+		close(dir_fd);
+		return 0;
+	}
+	frame->handle = dir_handle_create(dir_fd);
+
+	if (walker->use_ignore) {
+		size_t rel_len = job->path_len > walker->rel_offset ? job->path_len - walker->rel_offset : 0;
+		const char *rel = rel_len > 0 ? job->path + walker->rel_offset : "";
+		frame->ignore = ignore_load(job->ignore, dir_fd, rel, rel_len);
+	}
+	if (walker->visit_dir != NULL) {
+		walker->visit_dir(job->path, walker->ctx);
+	}
+	return 1;
+}
+
+static void leave_directory(Walker *walker, DirFrame *frame) {
+	if (frame->handle != NULL) {
+		if (walker->leave_dir != NULL) {
+			walker->leave_dir(frame->job->path, walker->ctx);
+		}
+		if (walker->use_ignore) {
+			ignore_release(frame->ignore);
+		}
+		dir_handle_release(frame->handle);
+	}
+	free(frame->list.entries);
+	dir_job_free(frame->job);
+}
+
+static void walk_one_directory(Walker *walker, DirJob *job) {
+	stats_push(STATS_WALK);
+	DirFrame frame;
+	if (enter_directory(walker, job, &frame)) {
+		read_entries(walker, &frame, NULL);
+	}
+	leave_directory(walker, &frame);
+	stats_pop();
+}
+
+static void walk_directory(void *arg) {
+	DirJob *job = (DirJob *)arg;
+	Walker *walker = job->walker;
+
+	DirJobList local = {0};
+	DirJobList *outer = overflow_jobs;
+	overflow_jobs = &local;
+	walk_one_directory(walker, job);
+	while (local.count > 0) {
+		walk_one_directory(walker, local.jobs[--local.count]);
+	}
+	overflow_jobs = outer;
+	free(local.jobs);
+}
+
+// Pushes a frame for job onto stack, or frees job if the directory cannot be
+// entered.
+static void push_sorted_frame(Walker *walker, DirJob *job, DirFrame **stack, size_t *depth, size_t *capacity) {
+	if (*depth == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 16;
+		*stack = realloc(*stack, sizeof(DirFrame) * *capacity);
+		if (*stack == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	stats_push(STATS_WALK);
+	DirFrame *frame = &(*stack)[*depth];
+	if (!enter_directory(walker, job, frame)) {
+		leave_directory(walker, frame);
+		stats_pop();
+		return;
+	}
+	read_entries(walker, frame, &frame->list);
+	qsort(frame->list.entries, frame->list.count, sizeof(DirEntry), compare_entries);
+	(*depth)++;
+}
 
-void free_file_list(Node *head) {
-	Node *tmp;
+// Walks depth first on the calling thread, with the open directories kept
+// on a heap allocated stack rather than in nested calls.
+static void walk_sorted(Walker *walker, DirJob *root) {
+	DirFrame *stack = NULL;
+	size_t depth = 0;
+	size_t capacity = 0;
 
-	while (head != NULL) {
-		tmp = head;
-		head = head->next;
-		free(tmp->file_path);
-		free(tmp);
+	push_sorted_frame(walker, root, &stack, &depth, &capacity);
+	while (depth > 0) {
+		DirFrame *frame = &stack[depth - 1];
+		if (frame->next == frame->list.count) {
+			leave_directory(walker, frame);
+			stats_pop();
+			depth--;
+			continue;
+		}
+
+		DirEntry *entry = &frame->list.entries[frame->next++];
+		DirJob *child = handle_entry(walker, frame, entry->name, entry->type);
+		free(entry->name);
+		if (child != NULL) {
+			push_sorted_frame(walker, child, &stack, &depth, &capacity);
+		}
 	}
+	free(stack);
 }
 
-int size_of_file_list(Node *head) {
-	int count = 0;
+Walker *walker_create(ThreadPool *pool, int max_depth, file_filter_t filter, file_visitor_t visit, void *ctx) {
+	Walker *walker = calloc(1, sizeof(Walker));
+	if (walker == NULL) {
+		return NULL;
+	}
+
+	walker->pool = pool;
+	walker->max_depth = max_depth;
+	walker->filter = filter;
+	walker->visit = visit;
+	walker->ctx = ctx;
+	walker->use_ignore = 1;
 
-	Node *current = head;
-	while (current != NULL) {
-		count++;
-		current = current->next;
+	// Every queued directory keeps its parent open, which with a full queue
+	// can take more descriptors than the usual soft limit.
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
 	}
 
-	return count;
+	pthread_mutex_init(&walker->seen_lock, NULL);
+	walker->seen_capacity = 1024;
+	walker->seen = calloc(walker->seen_capacity, sizeof(InodeKey));
+	if (walker->seen == NULL) {
+		free(walker);
+		return NULL;
+	}
+
+	return walker;
+}
+
+// Starts walking base_path. Directories are queued on the pool, so the walk
+// is complete once tp_wait returns.
+void walker_start(Walker *walker, const char *base_path) {
+	struct stat statbuf;
+	if (stat(base_path, &statbuf) == -1) {
+		perror("stat");
+		return;
+	}
+
+	size_t path_len = strlen(base_path);
+	char *path = malloc(path_len + 1);
+	if (path == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(path, base_path, path_len + 1);
+
+	if (S_ISREG(statbuf.st_mode)) {
+		const char *name = strrchr(path, '/');
+		void *tag = walker->filter(name != NULL ? name + 1 : path);
+		if (tag != NULL) {
+			walker->visit(path, tag, &statbuf, walker->ctx);
+		} else {
+			free(path);
+		}
+		return;
+	}
+
+	walker->rel_offset = path_len + (path[path_len - 1] == '/' ? 0 : 1);
+	DirJob *job = dir_job_create(walker, path, path_len, 0, 0, NULL, NULL);
+	if (walker->sorted) {
+		walk_sorted(walker, job);
+	} else {
+		queue_directory(walker, job);
+	}
+}
+
+// Controls whether .gitignore/.ignore files and the built-in list of skipped
+// directories are honoured. On by default.
+void walker_use_ignore_files(Walker *walker, int enabled) {
+	walker->use_ignore = enabled;
+}
+
+// Has the walker stat every file it hands to the visitor, relative to the
+// already open directory. Off by default, since most entries need no stat.
+void walker_stat_files(Walker *walker, int enabled) {
+	walker->stat_files = enabled;
+}
+
+// Walks one directory at a time on the calling thread and visits the entries
+// of each in name order, so files reach the visitor depth first in path
+// order. The files themselves can still be processed in parallel.
+void walker_sort_entries(Walker *walker, int enabled) {
+	walker->sorted = enabled;
+}
+
+void walker_on_directory(Walker *walker, dir_visitor_t visit_dir) {
+	walker->visit_dir = visit_dir;
+}
+
+// Runs on the thread that read the directory, once every file in it was
+// passed to the visitor. Subdirectories may still be queued.
+void walker_after_directory(Walker *walker, dir_visitor_t leave_dir) {
+	walker->leave_dir = leave_dir;
+}
+
+void walker_destroy(Walker *walker) {
+	pthread_mutex_destroy(&walker->seen_lock);
+	free(walker->seen);
+	free(walker);
 }
@@ -1,14 +1,33 @@
 #ifndef LIST_H
 #define LIST_H
 
-typedef struct node {
-	char *file_path;
-	struct node *next;
-} Node;
-
-void add_file_path(Node **head, char *file_path);
-void list_files_recursively(char *base_path, Node **head, int max_depth, int current_depth);
-void free_file_list(Node *head);
-int size_of_file_list(Node *head);
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "tpool.h"
+
+// Decides from the file name alone whether a file is interesting. Returns an
+// opaque tag handed to the visitor, or NULL to skip the file.
+typedef void *(*file_filter_t)(const char *file_name);
+
+// Receives ownership of file_path. statbuf is the result of stat() on the file
+// when the walker has one (see walker_stat_files), NULL otherwise.
+typedef void (*file_visitor_t)(char *file_path, void *tag, const struct stat *statbuf, void *ctx);
+
+// Called for every directory entered, before its entries are read, or after
+// all of them were handed out (see walker_after_directory).
+typedef void (*dir_visitor_t)(const char *dir_path, void *ctx);
+
+typedef struct Walker Walker;
+
+Walker *walker_create(ThreadPool *pool, int max_depth, file_filter_t filter, file_visitor_t visit, void *ctx);
+void walker_use_ignore_files(Walker *walker, int enabled);
+void walker_stat_files(Walker *walker, int enabled);
+void walker_sort_entries(Walker *walker, int enabled);
+void walker_on_directory(Walker *walker, dir_visitor_t visit_dir);
+void walker_after_directory(Walker *walker, dir_visitor_t visit_dir);
+void walker_start(Walker *walker, const char *base_path);
+int walker_seen_inode(Walker *walker, dev_t dev, ino_t ino);
+void walker_destroy(Walker *walker);
 
 #endif
@@ -3,252 +3,511 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <tree_sitter/api.h>
 
+#include "extract.h"
 #include "file.h"
+#include "ignore.h"
+#include "index.h"
+#include "lang.h"
 #include "list.h"
+#include "prefilter.h"
+#include "search.h"
+#include "server.h"
+#include "stats.h"
 #include "tpool.h"
-
-#include "queries/c.h"
-#include "queries/cpp.h"
-#include "queries/cuda.h"
-#include "queries/glsl.h"
-#include "queries/go.h"
-#include "queries/javascript.h"
-#include "queries/kotlin.h"
-#include "queries/lua.h"
-#include "queries/odin.h"
-#include "queries/php.h"
-#include "queries/python.h"
-#include "queries/rust.h"
-#include "queries/tcl.h"
-#include "queries/zig.h"
+#include "watch.h"
 
 int debug_enabled = 0;
 
-TSLanguage *tree_sitter_c(void);
-TSLanguage *tree_sitter_cpp(void);
-TSLanguage *tree_sitter_go(void);
-TSLanguage *tree_sitter_python(void);
-TSLanguage *tree_sitter_php(void);
-TSLanguage *tree_sitter_rust(void);
-TSLanguage *tree_sitter_javascript(void);
-TSLanguage *tree_sitter_lua(void);
-TSLanguage *tree_sitter_zig(void);
-TSLanguage *tree_sitter_kotlin(void);
-TSLanguage *tree_sitter_odin(void);
-TSLanguage *tree_sitter_tcl(void);
-TSLanguage *tree_sitter_glsl(void);
-TSLanguage *tree_sitter_cuda(void);
+struct ThreadArgs {
+	char *file_path;
+	Language *lang;
+	struct WalkContext *ctx;
+	struct ThreadArgs *next; // rest of the batch this file was queued in
+	uint64_t seq;            // position of the file's results in --sort mode
+	uint64_t cost;           // estimated parse cost, file size times the language factor; whole batch for its head
+	uint64_t queued_nsec;    // when it entered the file queue, for --stats
+	int has_stat;
+	struct stat statbuf; // as seen by the walker
+};
+
+// Files waiting to be parsed, most expensive first. Every queued file puts one
+// job on the pool and each job parses whichever file is the most expensive
+// when it runs, so a large file found late in the walk still starts ahead of
+// the small ones queued before it instead of setting the tail of the run.
+typedef struct {
+	pthread_mutex_t lock;
+	struct ThreadArgs **heap;
+	size_t count;
+	size_t capacity;
+} FileQueue;
+
+typedef struct WalkContext {
+	ThreadPool *pool;
+	const SearchOptions *options;
+	Walker *walker;
+	size_t rel_offset; // strips the walk root from paths
+
+	// Symbol index under the walk root, when there is one. Fresh files are
+	// answered from it; in --index mode new entries go to the builder.
+	Index *index;
+	IndexBuilder *builder;
+
+	FileQueue files;
+	size_t batch_bytes; // small files are grouped into jobs of about this size, 0 = never
+
+	// Per-file budgets, 0 = unlimited.
+	size_t max_filesize;
+	uint64_t parse_timeout_usec;
+	uint32_t match_limit;
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
+	// Results of a search; NULL when building an index.
+	Output *output;
+	int sorted;
+	uint64_t next_seq;
+	int files_with_matches; // print each matching file once instead of its functions
 
-int levenshtein_distance(const char *s1, const char *s2) {
-	unsigned int len1 = strlen(s1);
-	unsigned int len2 = strlen(s2);
-	unsigned int distances[len1 + 1][len2 + 1];
+	// --max-count: the run is cancelled once this many lines were printed.
+	// Unsorted results are counted as they are found, sorted ones by the
+	// writer, which is the only one that sees them in order.
+	uint64_t max_count;
+	uint64_t match_count;
+	int limit_reached;
 
-	for (unsigned int i = 0; i <= len1; i++) {
-		distances[i][0] = i;
+	int queued_files;
+	int parsed_files;
+	int skipped_files; // generated, minified or over a budget
+
+	// Collected in debug mode only.
+	int jobs;
+	int batched_jobs;
+	uint64_t job_nsec;
+	uint64_t max_job_nsec;
+} WalkContext;
+
+// Small files are parsed in batches so that the per-job overhead of a
+// queue operation and an allocation is paid once for many of them. A file is
+// small below a quarter of the batch size, and a batch is closed once it
+// reaches the batch size, BATCH_MAX_FILES files, or the end of a directory.
+#define BATCH_MAX_FILES 64
+
+// Unsorted results are handed to the writer once a worker has this much.
+#define OUTPUT_FLUSH_SIZE (64 * 1024)
+
+// Default for --match-limit: in-progress matches the query cursor keeps
+// before it starts dropping the oldest. Only trees full of ERROR nodes get
+// anywhere near it.
+#define QUERY_MATCH_LIMIT 1024
+
+// Caps the number of source bytes held in memory by workers at once. A file
+// larger than the whole budget is still admitted once nothing else is in
+// flight, so a single huge file cannot stall the run.
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t limit;
+	size_t in_flight;
+} ByteBudget;
+
+static ByteBudget byte_budget = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void byte_budget_acquire(ByteBudget *budget, size_t bytes) {
+	pthread_mutex_lock(&budget->lock);
+	while (budget->in_flight > 0 && budget->in_flight + bytes > budget->limit) {
+		pthread_cond_wait(&budget->cond, &budget->lock);
+	}
+	budget->in_flight += bytes;
+	pthread_mutex_unlock(&budget->lock);
+}
+
+static void byte_budget_release(ByteBudget *budget, size_t bytes) {
+	pthread_mutex_lock(&budget->lock);
+	budget->in_flight -= bytes;
+	pthread_cond_broadcast(&budget->cond);
+	pthread_mutex_unlock(&budget->lock);
+}
+
+// Parsers and the query cursor are kept per worker thread and reused across
+// jobs, so their internal stacks and buffers survive between files. They are
+// released by the key destructor when the worker exits.
+typedef struct {
+	TSParser *parsers[LANG_COUNT];
+	TSQueryCursor *query_cursor;
+
+	// Small files found by this thread's walk, not queued yet.
+	struct ThreadArgs *batch;
+	size_t batch_size;
+	int batch_files;
+
+	// Result lines not yet handed to the writer.
+	OutputBuffer output;
+
+	// Scratch memory of the file being parsed.
+	Arena arena;
+} WorkerState;
+
+static pthread_key_t worker_key;
+static pthread_once_t worker_key_once = PTHREAD_ONCE_INIT;
+
+static void worker_state_free(void *arg) {
+	WorkerState *state = (WorkerState *)arg;
+	for (int i = 0; i < LANG_COUNT; i++) {
+		if (state->parsers[i] != NULL) {
+			ts_parser_delete(state->parsers[i]);
+		}
 	}
-	for (unsigned int j = 0; j <= len2; j++) {
-		distances[0][j] = j;
+	if (state->query_cursor != NULL) {
+		ts_query_cursor_delete(state->query_cursor);
 	}
+	output_buffer_free(&state->output);
+	arena_free(&state->arena);
+	free(state);
+}
+
+static void worker_key_create(void) {
+	pthread_key_create(&worker_key, worker_state_free);
+}
 
-	for (unsigned int i = 1; i <= len1; i++) {
-		for (unsigned int j = 1; j <= len2; j++) {
-			int cost = (s1[i - 1] == s2[j - 1]) ? 0 : 1;
-			distances[i][j] = MIN(MIN(distances[i - 1][j] + 1, distances[i][j - 1] + 1), distances[i - 1][j - 1] + cost);
+static WorkerState *worker_state_get(void) {
+	pthread_once(&worker_key_once, worker_key_create);
+
+	WorkerState *state = pthread_getspecific(worker_key);
+	if (state == NULL) {
+		state = calloc(1, sizeof(WorkerState));
+		if (state == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
 		}
+		state->query_cursor = ts_query_cursor_new();
+		pthread_setspecific(worker_key, state);
 	}
+	return state;
+}
 
-	return distances[len1][len2];
+static TSParser *worker_parser_get(WorkerState *state, Language *lang) {
+	TSParser *parser = state->parsers[lang->id];
+	if (parser == NULL) {
+		parser = ts_parser_new();
+		ts_parser_set_language(parser, lang->language);
+		state->parsers[lang->id] = parser;
+	}
+	return parser;
 }
 
 typedef struct {
-	const char *fname;
-	const char *ftype;
-	const char *fparams;
-	size_t lineno;
-} Function;
-
-const char *extract_value(TSNode captured_node, const char *source_code) {
-	size_t start = ts_node_start_byte(captured_node);
-	size_t end = ts_node_end_byte(captured_node);
-	size_t length = end - start;
-	char *buffer = malloc(length + 1); // +1 for the null terminator
-
-	if (buffer != NULL) {
-		snprintf(buffer, length + 1, "%.*s", (int)length, &source_code[start]);
-		return buffer;
+	const char *file_path;
+	WalkContext *ctx;
+	OutputBuffer *out;
+} SearchVisit;
+
+static void stop_search(void *arg) {
+	WalkContext *ctx = (WalkContext *)arg;
+	__atomic_store_n(&ctx->limit_reached, 1, __ATOMIC_RELAXED);
+	tp_cancel(ctx->pool);
+}
+
+// Returns nonzero once the rest of the file is of no interest: the run was
+// cancelled, or only the first match of each file is printed.
+static int search_function(const Function *fn, void *arg) {
+	SearchVisit *visit = (SearchVisit *)arg;
+	WalkContext *ctx = visit->ctx;
+	SearchMatch match;
+
+	if (tp_cancelled(ctx->pool)) {
+		return 1;
+	}
+
+	stats_count(STATS_FUNCTIONS, 1);
+	stats_push(STATS_MATCH);
+	int matches = function_matches(ctx->options, fn->fname, &match);
+	stats_pop();
+	if (!matches) {
+		return 0;
+	}
+
+	uint64_t count = 0;
+	if (ctx->max_count > 0 && !ctx->sorted) {
+		count = __atomic_fetch_add(&ctx->match_count, 1, __ATOMIC_RELAXED) + 1;
+		if (count > ctx->max_count) {
+			return 1;
+		}
+	}
+
+	stats_count(STATS_MATCHES, 1);
+	stats_push(STATS_OUTPUT);
+	if (ctx->files_with_matches) {
+		output_buffer_append(visit->out, visit->file_path, strlen(visit->file_path));
+		output_buffer_append_char(visit->out, '\n');
 	} else {
-		perror("malloc");
-		exit(EXIT_FAILURE);
+		format_function(visit->out, "", visit->file_path, fn, ctx->options, &match);
 	}
+	stats_pop();
 
-	return NULL;
+	if (count == ctx->max_count && count > 0) {
+		stop_search(ctx);
+		return 1;
+	}
+	return ctx->files_with_matches;
+}
+
+static int index_function(const Function *fn, void *arg) {
+	stats_count(STATS_FUNCTIONS, 1);
+	index_entry_add_function((IndexEntry *)arg, fn);
+	return 0;
 }
 
-char *remove_newlines(const char *str) {
-	if (str == NULL)
-		return NULL;
-	size_t length = strlen(str);
-	char *result = (char *)malloc(length + 1); // +1 for the null terminator
-	if (result == NULL) {
-		fprintf(stderr, "Memory allocation failed\n");
-		exit(1);
+// Answers a file from the index instead of parsing it, or carries its entry
+// over into the index being built.
+static void use_indexed_file(WalkContext *ctx, const char *file_path, const IndexFile *file, const struct stat *statbuf) {
+	if (ctx->builder != NULL) {
+		IndexEntry *entry = index_entry_create(file_path + ctx->rel_offset, statbuf, file->hash);
+		index_entry_copy_functions(entry, ctx->index, file);
+		index_builder_add(ctx->builder, entry);
+		return;
 	}
 
-	size_t j = 0;
-	for (size_t i = 0; i < length; i++) {
-		if (str[i] != '\n') {
-			result[j++] = str[i];
+	SearchVisit visit = {file_path, ctx, &worker_state_get()->output};
+	for (uint32_t i = 0; i < file->symbol_count; i++) {
+		Function fn;
+		index_file_function(ctx->index, &ctx->index->symbols[file->first_symbol + i], &fn);
+		if (search_function(&fn, &visit) != 0) {
+			break;
 		}
 	}
-
-	result[j] = '\0';
-	return result;
 }
 
-struct ThreadArgs {
-	const char *file_path;
-	const char *source_code;
-	TSLanguage *language;
-	const char *query_string;
-	uint32_t query_len;
-	const char *cfname;
-	int case_sensitive;
-	int max_distance;
-};
+// Files left out by a budget or as generated are never dropped silently:
+// DEBUG and --stats list them, and a note at the end of the run counts them.
+static void report_skipped(WalkContext *ctx, const char *file_path, const char *reason) {
+	if (debug_enabled) {
+		fprintf(stderr, "Skipping %s: %s\n", file_path, reason);
+	}
+	__atomic_fetch_add(&ctx->skipped_files, 1, __ATOMIC_RELAXED);
+	stats_skip(file_path, reason);
+}
 
-// void parse_source_file(const char *file_path, const char *source_code,
-// TSLanguage *language, const char *cfname) {
 void parse_source_file(void *arg) {
 	struct ThreadArgs *args = (struct ThreadArgs *)arg;
+	WalkContext *ctx = args->ctx;
+	const SearchOptions *options = ctx->options;
 
 	const char *file_path = args->file_path;
-	const char *source_code = args->source_code;
-	TSLanguage *language = args->language;
-	const char *cfname = args->cfname;
-	int case_sensitive = args->case_sensitive;
-	int max_distance = args->max_distance;
-
-	TSParser *parser = ts_parser_new();
-	ts_parser_set_language(parser, language);
+	Language *lang = args->lang;
 
-	TSTree *tree = ts_parser_parse_string(parser, NULL, source_code, strlen(source_code));
-	if (tree == NULL) {
-		if (debug_enabled) {
-			fprintf(stderr, "Parsing failed for file: %s\n", file_path);
-		}
-		ts_parser_delete(parser);
-		free((void *)source_code);
+	// Once the run is cancelled the queue is only drained.
+	if (tp_cancelled(ctx->pool) || language_prepare(lang) != 0) {
+		free(args->file_path);
 		free(args);
 		return;
 	}
-	TSNode root_node = ts_tree_root_node(tree);
 
-	const char *query_string = args->query_string;
-	uint32_t query_len = args->query_len;
-
-	uint32_t error_offset;
-	TSQueryError error_type;
-	TSQuery *query = ts_query_new(language, query_string, query_len, &error_offset, &error_type);
+	// Files whose size and mtime still match the index are answered without
+	// even being opened.
+	const IndexFile *indexed = NULL;
+	struct stat statbuf;
+	if (ctx->index != NULL) {
+		stats_push(STATS_FILTER);
+		indexed = index_find_file(ctx->index, file_path + ctx->rel_offset);
+		if (args->has_stat) {
+			statbuf = args->statbuf;
+		}
+		if (indexed != NULL && (args->has_stat || stat(file_path, &statbuf) == 0) && index_file_is_fresh(indexed, &statbuf)) {
+			use_indexed_file(ctx, file_path, indexed, &statbuf);
+			stats_count(STATS_FILES_INDEXED, 1);
+			stats_pop();
+			free(args->file_path);
+			free(args);
+			return;
+		}
+		stats_pop();
+	}
 
-	if (query == NULL) {
+	uint64_t file_start = stats_now();
+	stats_push(STATS_READ);
+	int fd = open_path(file_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &statbuf) == -1) {
 		if (debug_enabled) {
-			printf("Query creation failed at offset %u with error type %d\n", error_offset, error_type);
+			fprintf(stderr, "Failed to open file: %s\n", file_path);
 		}
-		ts_tree_delete(tree);
-		ts_parser_delete(parser);
-		free((void *)source_code);
+		if (fd != -1) {
+			close(fd);
+		}
+		stats_pop();
+		free(args->file_path);
 		free(args);
 		return;
 	}
 
-	TSQueryCursor *query_cursor = ts_query_cursor_new();
-	ts_query_cursor_exec(query_cursor, query, root_node);
-
-	TSQueryMatch match;
-	while (ts_query_cursor_next_match(query_cursor, &match)) {
-		Function fn = {0};
-
-		for (unsigned i = 0; i < match.capture_count; i++) {
-			TSQueryCapture capture = match.captures[i];
-			TSNode captured_node = capture.node;
+	// Hard links are only detectable once the file is open; the first path to
+	// claim the inode wins.
+	if (statbuf.st_nlink > 1 && S_ISREG(statbuf.st_mode) && walker_seen_inode(ctx->walker, statbuf.st_dev, statbuf.st_ino)) {
+		close(fd);
+		stats_pop();
+		free(args->file_path);
+		free(args);
+		return;
+	}
 
-			uint32_t capture_name_length;
-			const char *capture_name = ts_query_capture_name_for_id(
-				query, capture.index, &capture_name_length);
+	if (ctx->max_filesize > 0 && (size_t)statbuf.st_size > ctx->max_filesize) {
+		close(fd);
+		stats_count(STATS_FILES_TOO_LARGE, 1);
+		report_skipped(ctx, file_path, "too large");
+		stats_pop();
+		free(args->file_path);
+		free(args);
+		return;
+	}
 
-			if (strcmp(capture_name, "fname") == 0) {
-				fn.fname = extract_value(captured_node, source_code);
+	size_t budget = (size_t)statbuf.st_size;
+	byte_budget_acquire(&byte_budget, budget);
 
-				TSPoint start_point = ts_node_start_point(captured_node);
-				fn.lineno = start_point.row + 1;
-			}
+	struct FileContent source_file = read_file_descriptor(fd, &statbuf);
+	close(fd);
+	if (source_file.content == NULL) {
+		if (debug_enabled) {
+			fprintf(stderr, "Failed to read file: %s\n", file_path);
+		}
+		stats_pop();
+		byte_budget_release(&byte_budget, budget);
+		free(args->file_path);
+		free(args);
+		return;
+	}
+	const char *source_code = source_file.content;
+	stats_pop();
+	stats_push(STATS_FILTER);
 
-			if (strcmp(capture_name, "ftype") == 0) {
-				fn.ftype = extract_value(captured_node, source_code);
-			}
+	// A touched file whose contents did not change is still answered from the
+	// index.
+	uint64_t hash = 0;
+	if (indexed != NULL || ctx->builder != NULL) {
+		hash = index_hash(source_code, source_file.count);
+		if (indexed != NULL && indexed->hash == hash) {
+			use_indexed_file(ctx, file_path, indexed, &statbuf);
+			stats_count(STATS_FILES_INDEXED, 1);
+			stats_pop();
+			stats_file(lang, file_path, source_file.count, file_start, 0);
+			free_file_content(&source_file);
+			byte_budget_release(&byte_budget, budget);
+			free(args->file_path);
+			free(args);
+			return;
+		}
+	}
 
-			if (strcmp(capture_name, "fparams") == 0) {
-				fn.fparams = extract_value(captured_node, source_code);
-			}
+	// Files that can not contain a match are not worth parsing, and neither
+	// are binary files that happen to carry a source extension or generated
+	// and minified code. The index needs every symbol, so it only skips the
+	// latter, which keeps searches with and without an index consistent.
+	// For the same reason it never stores generated files, whatever
+	// --include-generated says: searches that want them find them missing
+	// from the index and parse them, the others skip them as usual.
+	int may_match = ctx->builder != NULL || prefilter_may_match(&options->prefilter, source_code, source_file.count);
+	int binary = may_match && !options->no_ignore && ignore_is_binary(source_code, source_file.count);
+	int check_generated = ctx->builder != NULL || !options->include_generated;
+	int generated = may_match && !binary && check_generated ? ignore_is_generated(source_code, source_file.count) : GENERATED_NONE;
+	if (!may_match || binary || generated != GENERATED_NONE) {
+		if (generated == GENERATED_MARKER) {
+			stats_count(STATS_FILES_GENERATED, 1);
+			report_skipped(ctx, file_path, "generated");
+		} else if (generated == GENERATED_MINIFIED) {
+			stats_count(STATS_FILES_MINIFIED, 1);
+			report_skipped(ctx, file_path, "minified");
+		} else {
+			stats_count(binary ? STATS_FILES_BINARY : STATS_FILES_SKIPPED, 1);
 		}
+		stats_pop();
+		stats_file(lang, file_path, source_file.count, file_start, 0);
+		free_file_content(&source_file);
+		byte_budget_release(&byte_budget, budget);
+		free(args->file_path);
+		free(args);
+		return;
+	}
 
-		// Substring matching.
-		if (fn.fname != NULL) {
-			char *result = NULL;
-			int distance = -1;
+	stats_pop();
 
-			if (max_distance > 0) {
-				distance = levenshtein_distance(fn.fname, cfname);
-				if (distance <= max_distance) {
-					// We treat it as a match, but result pointer logic is different
-					// For printing purposes effectively a match.
-					// We'll just set result to non-null to trigger the print.
-					result = (char *)fn.fname;
-				}
-			} else {
-				if (case_sensitive) {
-					result = strstr(fn.fname, cfname);
-				} else {
-					result = strcasestr(fn.fname, cfname);
-				}
-			}
+	WorkerState *state = worker_state_get();
+	TSParser *parser = worker_parser_get(state, lang);
 
-			if (result != NULL) {
-				char *fparams_formatted = remove_newlines(fn.fparams);
-				if (max_distance > 0) {
-					printf("%s:%zu: %s %s %s (dist: %d)\n", file_path, fn.lineno, fn.ftype ? fn.ftype : "", fn.fname, fparams_formatted ? fparams_formatted : "", distance);
-				} else {
-					printf("%s:%zu: %s %s %s\n", file_path, fn.lineno, fn.ftype ? fn.ftype : "", fn.fname, fparams_formatted ? fparams_formatted : "");
-				}
-				free(fparams_formatted);
+	stats_push(STATS_PARSE);
+	uint64_t parse_start = stats_now();
+	ts_parser_set_timeout_micros(parser, ctx->parse_timeout_usec);
+	ts_parser_set_cancellation_flag(parser, tp_cancel_flag(ctx->pool));
+	TSTree *tree = ts_parser_parse_string(parser, NULL, source_code, source_file.count);
+	uint64_t parse_nsec = stats_now() - parse_start;
+	stats_pop();
+	if (tree == NULL) {
+		// The parser always has a language, so only cancellation or the
+		// deadline stops it.
+		int cancelled = tp_cancelled(ctx->pool);
+		if (!cancelled && ctx->parse_timeout_usec > 0) {
+			stats_count(STATS_PARSE_TIMEOUTS, 1);
+			report_skipped(ctx, file_path, "parse timeout");
+		} else if (!cancelled) {
+			if (debug_enabled) {
+				fprintf(stderr, "Parsing failed for file: %s\n", file_path);
 			}
+			stats_count(STATS_PARSE_FAILED, 1);
 		}
+		ts_parser_reset(parser);
+		stats_file(lang, file_path, source_file.count, file_start, parse_nsec);
+		free_file_content(&source_file);
+		byte_budget_release(&byte_budget, budget);
+		free(args->file_path);
+		free(args);
+		return;
+	}
+	__atomic_fetch_add(&ctx->parsed_files, 1, __ATOMIC_RELAXED);
+	stats_count(STATS_FILES_PARSED, 1);
 
-		// Free captured values
-		free((void *)fn.fname);
-		free((void *)fn.ftype);
-		free((void *)fn.fparams);
+	stats_push(STATS_QUERY);
+	ts_query_cursor_set_match_limit(state->query_cursor, ctx->match_limit > 0 ? ctx->match_limit : UINT32_MAX);
+	if (ctx->builder != NULL) {
+		// A symbol list cut short by the match limit is not indexed, or the
+		// file would be answered from it until it changes; later searches
+		// parse it again instead.
+		IndexEntry *entry = index_entry_create(file_path + ctx->rel_offset, &statbuf, hash);
+		extract_functions(lang, state->query_cursor, ts_tree_root_node(tree), source_code, &state->arena, index_function, entry);
+		if (ts_query_cursor_did_exceed_match_limit(state->query_cursor)) {
+			index_entry_free(entry);
+		} else {
+			index_builder_add(ctx->builder, entry);
+		}
+	} else {
+		SearchVisit visit = {file_path, ctx, &state->output};
+		extract_functions(lang, state->query_cursor, ts_tree_root_node(tree), source_code, &state->arena, search_function, &visit);
+	}
+	arena_reset(&state->arena);
+	if (ts_query_cursor_did_exceed_match_limit(state->query_cursor)) {
+		stats_count(STATS_MATCH_LIMIT, 1);
+		report_skipped(ctx, file_path, "match limit");
 	}
 
-	ts_query_cursor_delete(query_cursor);
-	ts_query_delete(query);
 	ts_tree_delete(tree);
-	ts_parser_delete(parser);
+	stats_pop();
+	stats_file(lang, file_path, source_file.count, file_start, parse_nsec);
 
 	// Cleanup thread arguments
-	free((void *)source_code);
+	free_file_content(&source_file);
+	byte_budget_release(&byte_budget, budget);
+	free(args->file_path);
 	free(args);
 }
 
@@ -260,19 +519,359 @@ const char *get_file_extension(const char *file_path) {
 	return NULL;
 }
 
+static void *language_filter(const char *file_name) {
+	return language_for_extension(get_file_extension(file_name));
+}
+
+static void file_queue_push(FileQueue *queue, struct ThreadArgs *args) {
+	pthread_mutex_lock(&queue->lock);
+	if (queue->count == queue->capacity) {
+		queue->capacity = queue->capacity ? queue->capacity * 2 : 256;
+		queue->heap = realloc(queue->heap, sizeof(struct ThreadArgs *) * queue->capacity);
+		if (queue->heap == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	size_t i = queue->count++;
+	while (i > 0 && queue->heap[(i - 1) / 2]->cost < args->cost) {
+		queue->heap[i] = queue->heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	queue->heap[i] = args;
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static struct ThreadArgs *file_queue_pop(FileQueue *queue) {
+	pthread_mutex_lock(&queue->lock);
+	struct ThreadArgs *top = queue->heap[0];
+	struct ThreadArgs *last = queue->heap[--queue->count];
+
+	size_t i = 0;
+	while (1) {
+		size_t child = 2 * i + 1;
+		if (child >= queue->count) {
+			break;
+		}
+		if (child + 1 < queue->count && queue->heap[child + 1]->cost > queue->heap[child]->cost) {
+			child++;
+		}
+		if (queue->heap[child]->cost <= last->cost) {
+			break;
+		}
+		queue->heap[i] = queue->heap[child];
+		i = child;
+	}
+	if (queue->count > 0) {
+		queue->heap[i] = last;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return top;
+}
+
+static uint64_t monotonic_nsec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void parse_next_file(void *arg) {
+	WalkContext *ctx = (WalkContext *)arg;
+	struct ThreadArgs *args = file_queue_pop(&ctx->files);
+	WorkerState *state = worker_state_get();
+	uint64_t start = debug_enabled ? monotonic_nsec() : 0;
+	stats_queue_wait(stats_now() - args->queued_nsec);
+	stats_count(STATS_JOBS, 1);
+
+	int files = 0;
+	while (args != NULL) {
+		struct ThreadArgs *next = args->next;
+		uint64_t seq = args->seq;
+		parse_source_file(args);
+		if (ctx->output != NULL && (ctx->sorted || state->output.len >= OUTPUT_FLUSH_SIZE)) {
+			stats_push(STATS_OUTPUT);
+			output_submit(ctx->output, &state->output, seq);
+			stats_pop();
+		}
+		args = next;
+		files++;
+	}
+	if (ctx->output != NULL && !ctx->sorted) {
+		stats_push(STATS_OUTPUT);
+		output_submit(ctx->output, &state->output, 0);
+		stats_pop();
+	}
+
+	if (debug_enabled) {
+		uint64_t elapsed = monotonic_nsec() - start;
+		__atomic_fetch_add(&ctx->jobs, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&ctx->job_nsec, elapsed, __ATOMIC_RELAXED);
+		if (files > 1) {
+			__atomic_fetch_add(&ctx->batched_jobs, 1, __ATOMIC_RELAXED);
+		}
+		uint64_t max = __atomic_load_n(&ctx->max_job_nsec, __ATOMIC_RELAXED);
+		while (elapsed > max && !__atomic_compare_exchange_n(&ctx->max_job_nsec, &max, elapsed, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		}
+	}
+}
+
+static void submit_files(WalkContext *ctx, struct ThreadArgs *args) {
+	args->queued_nsec = stats_now();
+	file_queue_push(&ctx->files, args);
+
+	// The walker runs on the pool threads, so a full queue means parsing a
+	// file here rather than waiting for room.
+	if (!tp_try_add_job(ctx->pool, parse_next_file, ctx)) {
+		parse_next_file(ctx);
+	}
+}
+
+static void flush_file_batch(WalkContext *ctx, WorkerState *state) {
+	struct ThreadArgs *batch = state->batch;
+	if (batch == NULL) {
+		return;
+	}
+	state->batch = NULL;
+	state->batch_size = 0;
+	state->batch_files = 0;
+
+	uint64_t cost = 0;
+	for (struct ThreadArgs *args = batch; args != NULL; args = args->next) {
+		cost += args->cost;
+	}
+	batch->cost = cost;
+	submit_files(ctx, batch);
+}
+
+static void leave_directory(const char *dir_path, void *arg) {
+	(void)dir_path;
+	flush_file_batch((WalkContext *)arg, worker_state_get());
+}
+
+// Called by the walker for every supported file it finds. The path is handed
+// to the pool right away and the worker reads the file itself, so parsing
+// starts while the walk is still running.
+static void queue_source_file(char *file_path, void *tag, const struct stat *statbuf, void *arg) {
+	WalkContext *ctx = (WalkContext *)arg;
+
+	struct ThreadArgs *thread_args = malloc(sizeof(struct ThreadArgs));
+	if (!thread_args) {
+		perror("Failed to allocate thread args");
+		free(file_path);
+		return;
+	}
+
+	thread_args->file_path = file_path;
+	thread_args->lang = (Language *)tag;
+	thread_args->ctx = ctx;
+	thread_args->next = NULL;
+	thread_args->seq = __atomic_fetch_add(&ctx->next_seq, 1, __ATOMIC_RELAXED);
+	thread_args->has_stat = statbuf != NULL;
+	thread_args->cost = 0;
+	if (statbuf != NULL) {
+		thread_args->statbuf = *statbuf;
+		thread_args->cost = (uint64_t)statbuf->st_size * (uint64_t)thread_args->lang->cost_factor;
+	}
+
+	__atomic_fetch_add(&ctx->queued_files, 1, __ATOMIC_RELAXED);
+
+	if (statbuf != NULL && (size_t)statbuf->st_size < ctx->batch_bytes / 4) {
+		WorkerState *state = worker_state_get();
+		thread_args->next = state->batch;
+		state->batch = thread_args;
+		state->batch_size += (size_t)statbuf->st_size;
+		state->batch_files++;
+		if (state->batch_size >= ctx->batch_bytes || state->batch_files >= BATCH_MAX_FILES) {
+			flush_file_batch(ctx, state);
+		}
+		return;
+	}
+
+	submit_files(ctx, thread_args);
+}
+
+typedef struct {
+	char **items;
+	int count;
+	int capacity;
+} PatternList;
+
+static void pattern_list_add(PatternList *list, const char *pattern, size_t len) {
+	// An empty pattern would match every name, and a repeated one would
+	// only be listed twice.
+	if (len == 0) {
+		return;
+	}
+	for (int i = 0; i < list->count; i++) {
+		if (strlen(list->items[i]) == len && memcmp(list->items[i], pattern, len) == 0) {
+			return;
+		}
+	}
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 16;
+		list->items = realloc(list->items, sizeof(char *) * (size_t)list->capacity);
+		if (list->items == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	list->items[list->count++] = strndup(pattern, len);
+}
+
+// One pattern per line, as with grep -f.
+static int pattern_list_read(PatternList *list, const char *path) {
+	FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (file == NULL) {
+		perror(path);
+		return -1;
+	}
+	char *line = NULL;
+	size_t capacity = 0;
+	ssize_t len;
+	while ((len = getline(&line, &capacity, file)) != -1) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+			len--;
+		}
+		pattern_list_add(list, line, (size_t)len);
+	}
+	free(line);
+	if (file != stdin) {
+		fclose(file);
+	}
+	return 0;
+}
+
+static void pattern_list_free(PatternList *list) {
+	for (int i = 0; i < list->count; i++) {
+		free(list->items[i]);
+	}
+	free(list->items);
+}
+
+// Parses sizes like 4096, 64K, 256M or 1G.
+static size_t parse_size(const char *str) {
+	char *end;
+	unsigned long long value = strtoull(str, &end, 10);
+	switch (*end) {
+	case 'k':
+	case 'K':
+		value <<= 10;
+		break;
+	case 'm':
+	case 'M':
+		value <<= 20;
+		break;
+	case 'g':
+	case 'G':
+		value <<= 30;
+		break;
+	default:
+		break;
+	}
+	return (size_t)value;
+}
+
+#define USAGE \
+	"Usage: %s [-e|--pattern <pattern>]... [-f|--pattern-file <file>] [-c|--case-sensitive] [-l|--levenshtein <dist>] [-d|--depth <level>] [-j|--threads <n>] [--max-jobs <n>] [--max-bytes <size>] [--batch-bytes <size>] [--max-filesize <size>] [--parse-timeout <ms>] [--match-limit <n>] [-m|--max-count <n>] [--files-with-matches] [--timeout <ms>] [--sort] [--no-ignore] [--include-generated] [--no-index] [--stats[=text|json]] [--trace <file>] <search term> [directory|file]\n" \
+	"       %s -e <pattern>... | -f <file> [options] [directory|file]\n" \
+	"       %s --index [-j|--threads <n>] [--match-limit <n>] [--stats[=text|json]] [--trace <file>] [directory]\n" \
+	"       %s --watch [-c|--case-sensitive] [-l|--levenshtein <dist>] [-d|--depth <level>] [-j|--threads <n>] [--no-ignore] [--include-generated] <search term> [directory]\n" \
+	"       %s --serve <socket> [-d|--depth <level>] [-j|--threads <n>] [--no-ignore] [directory]\n" \
+	"       %s --client <socket> [-c|--case-sensitive] [-l|--levenshtein <dist>] <search term>\n"
+
+static void print_usage(const char *program) {
+	fprintf(stderr, USAGE, program, program, program, program, program, program);
+}
+
+enum {
+	OPT_MAX_JOBS = 256,
+	OPT_MAX_BYTES,
+	OPT_BATCH_BYTES,
+	OPT_SORT,
+	OPT_NO_IGNORE,
+	OPT_INDEX,
+	OPT_NO_INDEX,
+	OPT_WATCH,
+	OPT_SERVE,
+	OPT_CLIENT,
+	OPT_STATS,
+	OPT_TRACE,
+	OPT_MAX_FILESIZE,
+	OPT_PARSE_TIMEOUT,
+	OPT_FILES_WITH_MATCHES,
+	OPT_TIMEOUT,
+	OPT_INCLUDE_GENERATED,
+	OPT_MATCH_LIMIT,
+};
+
 int main(int argc, char *argv[]) {
 	int case_sensitive = 0;
 	int max_distance = 0;
 	int max_depth = -1;
+	int threads = 0;
+	int max_jobs = 1024;
+	size_t max_bytes = 256 << 20;
+	size_t batch_bytes = 64 << 10;
+	size_t max_filesize = 0;
+	int parse_timeout_ms = 0;
+	int match_limit = QUERY_MATCH_LIMIT;
+	int max_count = 0;
+	int files_with_matches = 0;
+	int timeout_ms = 0;
+	int sort = 0;
+	int no_ignore = 0;
+	int include_generated = 0;
+	int build_index = 0;
+	int no_index = 0;
+	int watch = 0;
+	const char *serve_socket = NULL;
+	const char *client_socket = NULL;
+	int stats_format = -1;
+	const char *trace_path = NULL;
+	PatternList patterns = {0};
+	int pattern_args = 0;
 	int opt;
 	struct option long_options[] = {
+		{"pattern", required_argument, 0, 'e'},
+		{"pattern-file", required_argument, 0, 'f'},
 		{"case-sensitive", no_argument, 0, 'c'},
 		{"levenshtein", required_argument, 0, 'l'},
 		{"depth", required_argument, 0, 'd'},
+		{"threads", required_argument, 0, 'j'},
+		{"max-jobs", required_argument, 0, OPT_MAX_JOBS},
+		{"max-bytes", required_argument, 0, OPT_MAX_BYTES},
+		{"batch-bytes", required_argument, 0, OPT_BATCH_BYTES},
+		{"max-filesize", required_argument, 0, OPT_MAX_FILESIZE},
+		{"parse-timeout", required_argument, 0, OPT_PARSE_TIMEOUT},
+		{"match-limit", required_argument, 0, OPT_MATCH_LIMIT},
+		{"max-count", required_argument, 0, 'm'},
+		{"files-with-matches", no_argument, 0, OPT_FILES_WITH_MATCHES},
+		{"timeout", required_argument, 0, OPT_TIMEOUT},
+		{"sort", no_argument, 0, OPT_SORT},
+		{"no-ignore", no_argument, 0, OPT_NO_IGNORE},
+		{"include-generated", no_argument, 0, OPT_INCLUDE_GENERATED},
+		{"index", no_argument, 0, OPT_INDEX},
+		{"no-index", no_argument, 0, OPT_NO_INDEX},
+		{"watch", no_argument, 0, OPT_WATCH},
+		{"serve", required_argument, 0, OPT_SERVE},
+		{"client", required_argument, 0, OPT_CLIENT},
+		{"stats", optional_argument, 0, OPT_STATS},
+		{"trace", required_argument, 0, OPT_TRACE},
 		{0, 0, 0, 0}};
 
-	while ((opt = getopt_long(argc, argv, "cl:d:", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "e:f:cl:d:j:m:", long_options, NULL)) != -1) {
 		switch (opt) {
+		case 'e':
+			pattern_list_add(&patterns, optarg, strlen(optarg));
+			pattern_args = 1;
+			break;
+		case 'f':
+			if (pattern_list_read(&patterns, optarg) != 0) {
+				return 1;
+			}
+			pattern_args = 1;
+			break;
 		case 'c':
 			case_sensitive = 1;
 			break;
@@ -282,140 +881,273 @@ int main(int argc, char *argv[]) {
 		case 'd':
 			max_depth = atoi(optarg);
 			break;
+		case 'j':
+			threads = atoi(optarg);
+			break;
+		case OPT_MAX_JOBS:
+			max_jobs = atoi(optarg);
+			break;
+		case OPT_MAX_BYTES:
+			max_bytes = parse_size(optarg);
+			break;
+		case OPT_BATCH_BYTES:
+			batch_bytes = parse_size(optarg);
+			break;
+		case OPT_MAX_FILESIZE:
+			max_filesize = parse_size(optarg);
+			break;
+		case OPT_PARSE_TIMEOUT:
+			parse_timeout_ms = atoi(optarg);
+			break;
+		case OPT_MATCH_LIMIT:
+			match_limit = atoi(optarg);
+			break;
+		case 'm':
+			max_count = atoi(optarg);
+			break;
+		case OPT_FILES_WITH_MATCHES:
+			files_with_matches = 1;
+			break;
+		case OPT_TIMEOUT:
+			timeout_ms = atoi(optarg);
+			break;
+		case OPT_SORT:
+			sort = 1;
+			break;
+		case OPT_NO_IGNORE:
+			no_ignore = 1;
+			break;
+		case OPT_INCLUDE_GENERATED:
+			include_generated = 1;
+			break;
+		case OPT_INDEX:
+			build_index = 1;
+			break;
+		case OPT_NO_INDEX:
+			no_index = 1;
+			break;
+		case OPT_WATCH:
+			watch = 1;
+			break;
+		case OPT_SERVE:
+			serve_socket = optarg;
+			break;
+		case OPT_CLIENT:
+			client_socket = optarg;
+			break;
+		case OPT_STATS:
+			if (optarg == NULL || strcmp(optarg, "text") == 0) {
+				stats_format = STATS_FORMAT_TEXT;
+			} else if (strcmp(optarg, "json") == 0) {
+				stats_format = STATS_FORMAT_JSON;
+			} else {
+				print_usage(argv[0]);
+				return 1;
+			}
+			break;
+		case OPT_TRACE:
+			trace_path = optarg;
+			break;
 		default:
-			fprintf(stderr, "Usage: %s [-c|--case-sensitive] [-l|--levenshtein <dist>] [-d|--depth <level>] <search term> [directory|file]\n", argv[0]);
+			print_usage(argv[0]);
 			return 1;
 		}
 	}
 
-	if (optind >= argc) {
-		fprintf(stderr, "Usage: %s [-c|--case-sensitive] [-l|--levenshtein <dist>] [-d|--depth <level>] <search term> [directory|file]\n", argv[0]);
-		return 1;
+	const char *cfname = "";
+	const char *directory = ".";
+	if (build_index || serve_socket != NULL) {
+		if (optind < argc) {
+			directory = argv[optind];
+		}
+	} else if (pattern_args) {
+		// Like grep, -e and -f take the place of the search term.
+		if (patterns.count == 0) {
+			fprintf(stderr, "No patterns to search for\n");
+			return 1;
+		}
+		cfname = patterns.items[0];
+		if (optind < argc) {
+			directory = argv[optind];
+		}
+	} else {
+		if (optind >= argc) {
+			print_usage(argv[0]);
+			return 1;
+		}
+		cfname = argv[optind];
+		if (optind + 1 < argc) {
+			directory = argv[optind + 1];
+		}
 	}
 
-	const char *cfname = argv[optind];
-	char *directory = (optind + 1 < argc) ? argv[optind + 1] : ".";
+	// The client never touches the tree, the server has it all in memory.
+	if (client_socket != NULL) {
+		if (patterns.count > 1) {
+			fprintf(stderr, "The server answers one pattern at a time\n");
+			return 1;
+		}
+		return client_run(client_socket, cfname, case_sensitive, max_distance);
+	}
 
-	Node *head = NULL;
-	list_files_recursively(directory, &head, max_depth, 0);
-	int list_size = size_of_file_list(head);
+	// An empty path fails here too, so the root is never empty below.
+	struct stat root_stat;
+	if (stat(directory, &root_stat) == -1) {
+		fprintf(stderr, "Cannot access '%s': %s\n", directory, strerror(errno));
+		return 1;
+	}
+	int root_is_dir = S_ISDIR(root_stat.st_mode);
+	if ((build_index || serve_socket != NULL) && !root_is_dir) {
+		fprintf(stderr, "Index root is not a directory: %s\n", directory);
+		return 1;
+	}
 
 	const char *debug_env = getenv("DEBUG");
 	if (debug_env != NULL && (strcmp(debug_env, "1") == 0 || strcmp(debug_env, "true") == 0)) {
 		debug_enabled = 1;
 	}
 
-	if (debug_enabled) {
-		printf("Scanning %d files\n", list_size);
+	if (threads <= 0) {
+		threads = tp_default_threads();
 	}
-
-	ThreadPool *pool = tp_create(8);
+	if (stats_format != -1) {
+		stats_enable();
+	}
+	if (trace_path != NULL) {
+		stats_enable_trace();
+	}
+	ThreadPool *pool = tp_create(threads);
 	if (!pool) {
 		perror("Failed to create thread pool");
 		return 1;
 	}
+	tp_set_queue_limit(pool, max_jobs);
+	byte_budget.limit = max_bytes;
 
-	Node *current = head;
-	while (current != NULL) {
-		const char *file_path = current->file_path;
-		const char *extension = get_file_extension(file_path);
-
-		TSLanguage *lang = NULL;
-		const char *query_string = NULL;
-		uint32_t query_len = 0;
-
-		if (extension != NULL) {
-			if (strcmp(extension, "c") == 0 || strcmp(extension, "h") == 0) {
-				lang = tree_sitter_c();
-				query_string = (const char *)query_c;
-				query_len = query_c_len;
-			} else if (strcmp(extension, "cpp") == 0 || strcmp(extension, "hpp") == 0) {
-				lang = tree_sitter_cpp();
-				query_string = (const char *)query_cpp;
-				query_len = query_cpp_len;
-			} else if (strcmp(extension, "go") == 0) {
-				lang = tree_sitter_go();
-				query_string = (const char *)query_go;
-				query_len = query_go_len;
-			} else if (strcmp(extension, "py") == 0) {
-				lang = tree_sitter_python();
-				query_string = (const char *)query_python;
-				query_len = query_python_len;
-			} else if (strcmp(extension, "php") == 0) {
-				lang = tree_sitter_php();
-				query_string = (const char *)query_php;
-				query_len = query_php_len;
-			} else if (strcmp(extension, "rs") == 0) {
-				lang = tree_sitter_rust();
-				query_string = (const char *)query_rust;
-				query_len = query_rust_len;
-			} else if (strcmp(extension, "js") == 0) {
-				lang = tree_sitter_javascript();
-				query_string = (const char *)query_javascript;
-				query_len = query_javascript_len;
-			} else if (strcmp(extension, "lua") == 0) {
-				lang = tree_sitter_lua();
-				query_string = (const char *)query_lua;
-				query_len = query_lua_len;
-			} else if (strcmp(extension, "zig") == 0) {
-				lang = tree_sitter_zig();
-				query_string = (const char *)query_zig;
-				query_len = query_zig_len;
-			} else if (strcmp(extension, "kt") == 0) {
-				lang = tree_sitter_kotlin();
-				query_string = (const char *)query_kotlin;
-				query_len = query_kotlin_len;
-			} else if (strcmp(extension, "odin") == 0) {
-				lang = tree_sitter_odin();
-				query_string = (const char *)query_odin;
-				query_len = query_odin_len;
-			} else if (strcmp(extension, "tcl") == 0) {
-				lang = tree_sitter_tcl();
-				query_string = (const char *)query_tcl;
-				query_len = query_tcl_len;
-			} else if (strcmp(extension, "glsl") == 0) {
-				lang = tree_sitter_glsl();
-				query_string = (const char *)query_glsl;
-				query_len = query_glsl_len;
-			} else if (strcmp(extension, "cu") == 0 || strcmp(extension, "cuh") == 0) {
-				lang = tree_sitter_cuda();
-				query_string = (const char *)query_cuda;
-				query_len = query_cuda_len;
-			}
-		}
+	SearchOptions options = {
+		.case_sensitive = case_sensitive,
+		.max_distance = max_distance,
+		.no_ignore = no_ignore,
+		.include_generated = include_generated,
+	};
+	if (patterns.count > 1) {
+		search_options_init(&options, (const char *const *)patterns.items, patterns.count);
+	} else {
+		search_options_init(&options, &cfname, 1);
+	}
 
-		if (lang != NULL && query_string != NULL) {
-			struct FileContent source_file = read_entire_file(file_path);
-			if (source_file.content != NULL) {
-				struct ThreadArgs *thread_args = malloc(sizeof(struct ThreadArgs));
-				if (!thread_args) {
-					perror("Failed to allocate thread args");
-					free((void *)source_file.content);
-					continue;
-				}
-
-				thread_args->file_path = file_path;
-				thread_args->source_code = source_file.content;
-				thread_args->language = lang;
-				thread_args->query_string = query_string;
-				thread_args->query_len = query_len;
-				thread_args->cfname = cfname;
-				thread_args->case_sensitive = case_sensitive;
-				thread_args->max_distance = max_distance;
-
-				tp_add_job(pool, (thread_func_t)parse_source_file, thread_args);
-			} else {
-				if (debug_enabled) {
-					fprintf(stderr, "Failed to read file: %s\n", file_path);
-				}
-			}
+	// Watch mode keeps every file parsed, so neither the index nor the
+	// prefilter apply to it.
+	if (watch) {
+		int status = watch_run(pool, &options, directory, max_depth, language_filter);
+		tp_destroy(pool);
+		search_options_free(&options);
+		pattern_list_free(&patterns);
+		language_cleanup();
+		return status;
+	}
+
+	size_t directory_len = strlen(directory);
+	WalkContext walk = {
+		.pool = pool,
+		.options = &options,
+		.rel_offset = directory_len + (directory[directory_len - 1] == '/' ? 0 : 1),
+		.files = {.lock = PTHREAD_MUTEX_INITIALIZER},
+		.batch_bytes = batch_bytes,
+		.max_filesize = max_filesize,
+		.parse_timeout_usec = parse_timeout_ms > 0 ? (uint64_t)parse_timeout_ms * 1000 : 0,
+		.match_limit = match_limit > 0 ? (uint32_t)match_limit : 0,
+		.sorted = sort,
+		.files_with_matches = files_with_matches,
+		.max_count = max_count > 0 ? (uint64_t)max_count : 0,
+		.queued_files = 0,
+	};
+	if (root_is_dir && !no_index) {
+		walk.index = index_open(directory);
+	}
+	if (build_index || serve_socket != NULL) {
+		walk.builder = index_builder_create();
+		if (!walk.builder) {
+			perror("Failed to create index");
+			return 1;
+		}
+	} else {
+		walk.output = output_create(STDOUT_FILENO, sort);
+		if (!walk.output) {
+			perror("Failed to create output");
+			return 1;
+		}
+		if (walk.max_count > 0) {
+			output_set_line_limit(walk.output, walk.max_count, stop_search, &walk);
 		}
+		// A partial index would look complete, so only searches have a
+		// deadline.
+		tp_cancel_after(pool, timeout_ms);
+	}
 
-		current = current->next;
+	walk.walker = walker_create(pool, max_depth, language_filter, queue_source_file, &walk);
+	if (!walk.walker) {
+		perror("Failed to create walker");
+		return 1;
 	}
+	walker_use_ignore_files(walk.walker, !no_ignore);
+	walker_stat_files(walk.walker, 1);
+	walker_after_directory(walk.walker, leave_directory);
+	walker_sort_entries(walk.walker, sort);
 
+	walker_start(walk.walker, directory);
+	flush_file_batch(&walk, worker_state_get());
 	tp_wait(pool);
+	if (walk.output != NULL) {
+		output_finish(walk.output);
+		if (tp_cancelled(pool) && !walk.limit_reached) {
+			fprintf(stderr, "Timed out after %d ms, results are partial\n", timeout_ms);
+		}
+	}
+	if (walk.skipped_files > 0) {
+		fprintf(stderr, "%d file%s skipped or cut short as generated, minified or over a budget (listed by --stats)\n", walk.skipped_files, walk.skipped_files == 1 ? "" : "s");
+	}
+	if (stats_format != -1) {
+		stats_report(stats_format, threads);
+	}
+	if (trace_path != NULL && stats_write_trace(trace_path) != 0) {
+		perror(trace_path);
+	}
+
+	if (debug_enabled) {
+		printf("Scanned %d files with %d threads\n", walk.queued_files, threads);
+		if (walk.jobs > 0) {
+			printf("Ran %d jobs (%d batched), %.1f us per job, %.1f us per file, slowest job %.1f ms\n", walk.jobs, walk.batched_jobs, walk.job_nsec / 1e3 / walk.jobs,
+			       walk.queued_files > 0 ? walk.job_nsec / 1e3 / walk.queued_files : 0.0, walk.max_job_nsec / 1e6);
+		}
+	}
+
+	int status = 0;
+	if (serve_socket != NULL) {
+		// The symbol table is built exactly like an index, reusing the one on
+		// disk for unchanged files, but is only kept in memory.
+		Index *table = index_builder_finish(walk.builder);
+		index_builder_free(walk.builder);
+		walk.builder = NULL;
+		printf("Serving %u symbols from %u files on %s\n", table->header->symbol_count, table->header->file_count, serve_socket);
+		fflush(stdout);
+		status = serve_run(pool, serve_socket, directory, table);
+		index_close(table);
+	} else if (walk.builder != NULL) {
+		if (index_builder_write(walk.builder, directory) == 0) {
+			printf("Indexed %zu files (%d parsed), %zu symbols\n", index_builder_file_count(walk.builder), walk.parsed_files, index_builder_symbol_count(walk.builder));
+		} else {
+			status = 1;
+		}
+		index_builder_free(walk.builder);
+	}
+	index_close(walk.index);
+	free(walk.files.heap);
+
 	tp_destroy(pool);
-	free_file_list(head);
-	return 0;
+	walker_destroy(walk.walker);
+	search_options_free(&options);
+	pattern_list_free(&patterns);
+	language_cleanup();
+	return status;
 }
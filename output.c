@@ -0,0 +1,344 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "stats.h"
+
+// Submitted buffers are pushed onto a lock-free stack. The writer takes the
+// whole stack at once and reverses it, so the chunks of each worker stay in
+// the order they were submitted. The lock only parks the writer while there
+// is nothing to write; submitters take it just to wake a parked writer.
+
+#define WRITE_BUFFER_SIZE (256 * 1024)
+
+typedef struct OutputChunk {
+	struct OutputChunk *next;
+	uint64_t seq;
+	char *data;
+	size_t len;
+} OutputChunk;
+
+struct Output {
+	int fd;
+	int sorted;
+
+	OutputChunk *incoming;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int writer_waiting;
+	bool done;
+	pthread_t writer;
+
+	// Owned by the writer thread.
+	int failed; // a write failed, everything after it is dropped
+	char *write_buffer;
+	size_t write_len;
+
+	// Sorted mode: chunks that arrived ahead of next_seq, in slot
+	// seq & (window_capacity - 1).
+	OutputChunk **window;
+	size_t window_capacity; // power of two
+	uint64_t next_seq;
+	uint64_t max_seq;
+
+	// Line limit, 0 = none. Lines past it are dropped.
+	uint64_t max_lines;
+	uint64_t lines;
+	void (*limit_reached)(void *arg);
+	void *limit_arg;
+};
+
+void output_buffer_append(OutputBuffer *buffer, const char *data, size_t len) {
+	if (buffer->len + len > buffer->capacity) {
+		size_t capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+		while (capacity < buffer->len + len) {
+			capacity *= 2;
+		}
+		buffer->data = realloc(buffer->data, capacity);
+		if (buffer->data == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		buffer->capacity = capacity;
+	}
+	memcpy(buffer->data + buffer->len, data, len);
+	buffer->len += len;
+}
+
+void output_buffer_append_char(OutputBuffer *buffer, char c) {
+	output_buffer_append(buffer, &c, 1);
+}
+
+void output_buffer_append_uint(OutputBuffer *buffer, uint64_t value) {
+	char digits[20];
+	size_t i = sizeof(digits);
+	do {
+		digits[--i] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value > 0);
+	output_buffer_append(buffer, digits + i, sizeof(digits) - i);
+}
+
+void output_buffer_free(OutputBuffer *buffer) {
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->len = 0;
+	buffer->capacity = 0;
+}
+
+static void write_all(Output *output, const char *data, size_t len) {
+	stats_push(STATS_WRITE);
+	while (len > 0 && !output->failed) {
+		ssize_t written = write(output->fd, data, len);
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			output->failed = 1;
+			break;
+		}
+		data += written;
+		len -= (size_t)written;
+	}
+	stats_pop();
+}
+
+static void flush_write_buffer(Output *output) {
+	write_all(output, output->write_buffer, output->write_len);
+	output->write_len = 0;
+}
+
+// Counts the lines of a chunk against the line limit and returns how much of
+// it may still be written.
+static size_t limit_lines(Output *output, const char *data, size_t len) {
+	if (output->lines >= output->max_lines) {
+		return 0;
+	}
+	const char *end = data + len;
+	for (const char *p = data; p < end; p++) {
+		p = memchr(p, '\n', (size_t)(end - p));
+		if (p == NULL) {
+			break;
+		}
+		if (++output->lines == output->max_lines) {
+			if (output->limit_reached != NULL) {
+				output->limit_reached(output->limit_arg);
+			}
+			return (size_t)(p + 1 - data);
+		}
+	}
+	return len;
+}
+
+static void emit_chunk(Output *output, OutputChunk *chunk) {
+	size_t len = chunk->len;
+	if (output->max_lines > 0 && len > 0) {
+		len = limit_lines(output, chunk->data, len);
+	}
+
+	if (len > WRITE_BUFFER_SIZE - output->write_len) {
+		flush_write_buffer(output);
+	}
+	if (len >= WRITE_BUFFER_SIZE) {
+		write_all(output, chunk->data, len);
+	} else if (len > 0) {
+		memcpy(output->write_buffer + output->write_len, chunk->data, len);
+		output->write_len += len;
+	}
+	free(chunk->data);
+	free(chunk);
+}
+
+static void window_grow(Output *output) {
+	size_t capacity = output->window_capacity * 2;
+	OutputChunk **window = calloc(capacity, sizeof(OutputChunk *));
+	if (window == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < output->window_capacity; i++) {
+		OutputChunk *chunk = output->window[i];
+		if (chunk != NULL) {
+			window[chunk->seq & (capacity - 1)] = chunk;
+		}
+	}
+	free(output->window);
+	output->window = window;
+	output->window_capacity = capacity;
+}
+
+// Parks a chunk in the reorder window and writes out the run of chunks that
+// is now complete.
+static void reorder_chunk(Output *output, OutputChunk *chunk) {
+	while (chunk->seq - output->next_seq >= output->window_capacity) {
+		window_grow(output);
+	}
+	output->window[chunk->seq & (output->window_capacity - 1)] = chunk;
+	if (chunk->seq > output->max_seq) {
+		output->max_seq = chunk->seq;
+	}
+
+	while (1) {
+		size_t slot = output->next_seq & (output->window_capacity - 1);
+		OutputChunk *next = output->window[slot];
+		if (next == NULL) {
+			break;
+		}
+		output->window[slot] = NULL;
+		output->next_seq++;
+		emit_chunk(output, next);
+	}
+}
+
+static void *output_writer(void *arg) {
+	Output *output = (Output *)arg;
+	stats_thread_name("output writer");
+
+	while (1) {
+		OutputChunk *chunks = __atomic_exchange_n(&output->incoming, NULL, __ATOMIC_ACQUIRE);
+		if (chunks == NULL) {
+			// Caught up: hand what we have to the kernel before sleeping.
+			flush_write_buffer(output);
+
+			pthread_mutex_lock(&output->lock);
+			__atomic_store_n(&output->writer_waiting, 1, __ATOMIC_SEQ_CST);
+			while (__atomic_load_n(&output->incoming, __ATOMIC_SEQ_CST) == NULL && !output->done) {
+				pthread_cond_wait(&output->cond, &output->lock);
+			}
+			__atomic_store_n(&output->writer_waiting, 0, __ATOMIC_SEQ_CST);
+			bool finished = output->done && __atomic_load_n(&output->incoming, __ATOMIC_SEQ_CST) == NULL;
+			pthread_mutex_unlock(&output->lock);
+
+			if (finished) {
+				break;
+			}
+			continue;
+		}
+
+		OutputChunk *ordered = NULL;
+		while (chunks != NULL) {
+			OutputChunk *next = chunks->next;
+			chunks->next = ordered;
+			ordered = chunks;
+			chunks = next;
+		}
+
+		while (ordered != NULL) {
+			OutputChunk *next = ordered->next;
+			if (output->sorted) {
+				reorder_chunk(output, ordered);
+			} else {
+				emit_chunk(output, ordered);
+			}
+			ordered = next;
+		}
+	}
+
+	// Only reached with gaps in the sequence, which would be a bug in the
+	// caller (a cancelled run still submits every sequence number); whatever
+	// did arrive is still written, in order.
+	if (output->sorted) {
+		for (; output->next_seq <= output->max_seq; output->next_seq++) {
+			size_t slot = output->next_seq & (output->window_capacity - 1);
+			if (output->window[slot] != NULL) {
+				emit_chunk(output, output->window[slot]);
+				output->window[slot] = NULL;
+			}
+		}
+	}
+	flush_write_buffer(output);
+	return NULL;
+}
+
+Output *output_create(int fd, int sorted) {
+	Output *output = calloc(1, sizeof(Output));
+	if (output == NULL) {
+		return NULL;
+	}
+
+	output->fd = fd;
+	output->sorted = sorted;
+	pthread_mutex_init(&output->lock, NULL);
+	pthread_cond_init(&output->cond, NULL);
+
+	output->write_buffer = malloc(WRITE_BUFFER_SIZE);
+	output->window_capacity = 1024;
+	output->window = calloc(output->window_capacity, sizeof(OutputChunk *));
+	if (output->write_buffer == NULL || output->window == NULL) {
+		free(output->write_buffer);
+		free(output->window);
+		free(output);
+		return NULL;
+	}
+
+	if (pthread_create(&output->writer, NULL, output_writer, output) != 0) {
+		free(output->write_buffer);
+		free(output->window);
+		free(output);
+		return NULL;
+	}
+	return output;
+}
+
+// Stops writing after max_lines lines and calls reached, on the writer
+// thread, as soon as it gets to the last of them. Must be set before the
+// first submit.
+void output_set_line_limit(Output *output, uint64_t max_lines, void (*reached)(void *arg), void *arg) {
+	output->max_lines = max_lines;
+	output->limit_reached = reached;
+	output->limit_arg = arg;
+}
+
+// Hands the contents of buffer over to the writer and leaves it empty. Empty
+// buffers only matter in sorted mode, where they mark seq as done.
+void output_submit(Output *output, OutputBuffer *buffer, uint64_t seq) {
+	if (!output->sorted && buffer->len == 0) {
+		return;
+	}
+
+	OutputChunk *chunk = malloc(sizeof(OutputChunk));
+	if (chunk == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	chunk->seq = seq;
+	chunk->data = NULL;
+	chunk->len = buffer->len;
+	if (buffer->len > 0) {
+		chunk->data = buffer->data;
+		buffer->data = NULL;
+		buffer->len = 0;
+		buffer->capacity = 0;
+	}
+
+	chunk->next = __atomic_load_n(&output->incoming, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&output->incoming, &chunk->next, chunk, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+	}
+
+	if (__atomic_load_n(&output->writer_waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&output->lock);
+		pthread_cond_signal(&output->cond);
+		pthread_mutex_unlock(&output->lock);
+	}
+}
+
+// Writes out everything submitted so far and stops the writer.
+void output_finish(Output *output) {
+	pthread_mutex_lock(&output->lock);
+	output->done = true;
+	pthread_cond_signal(&output->cond);
+	pthread_mutex_unlock(&output->lock);
+	pthread_join(output->writer, NULL);
+
+	pthread_mutex_destroy(&output->lock);
+	pthread_cond_destroy(&output->cond);
+	free(output->write_buffer);
+	free(output->window);
+	free(output);
+}
@@ -0,0 +1,33 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Result lines are formatted by the workers into buffers of their own and
+// handed to a single writer thread, which copies them to the output file
+// descriptor with large write(2) calls. Workers never share a lock with each
+// other or with the writer.
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t capacity;
+} OutputBuffer;
+
+void output_buffer_append(OutputBuffer *buffer, const char *data, size_t len);
+void output_buffer_append_char(OutputBuffer *buffer, char c);
+void output_buffer_append_uint(OutputBuffer *buffer, uint64_t value);
+void output_buffer_free(OutputBuffer *buffer);
+
+typedef struct Output Output;
+
+// In sorted mode results are written in sequence order: every sequence number
+// from 0 up must be submitted exactly once, with or without content, and
+// results are held back only until the ones before them have arrived.
+Output *output_create(int fd, int sorted);
+void output_set_line_limit(Output *output, uint64_t max_lines, void (*reached)(void *arg), void *arg);
+void output_submit(Output *output, OutputBuffer *buffer, uint64_t seq);
+void output_finish(Output *output);
+
+#endif
@@ -0,0 +1,288 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PREFILTER_X86 1
+#endif
+
+#include "prefilter.h"
+
+#define QGRAM_MAX_COUNT 256
+
+static int is_ascii_alpha(unsigned char c) {
+	c |= 0x20;
+	return c >= 'a' && c <= 'z';
+}
+
+static unsigned char to_lower_ascii(unsigned char c) {
+	return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+static int verify_candidate(const Prefilter *pf, const unsigned char *candidate) {
+	if (!pf->case_insensitive) {
+		return memcmp(candidate, pf->needle, pf->needle_len) == 0;
+	}
+
+	for (size_t j = 0; j < pf->needle_len; j++) {
+		if (to_lower_ascii(candidate[j]) != pf->needle[j]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Candidate positions are those where both the first and the last byte of the
+// needle line up; only those get a full comparison. The SIMD variants test 16
+// or 32 positions at once and fall back to this loop for the tail.
+static int contains_scalar_from(const Prefilter *pf, const unsigned char *haystack, size_t len, size_t start) {
+	size_t needle_len = pf->needle_len;
+	unsigned char first = pf->needle[0];
+	unsigned char last = pf->needle[needle_len - 1];
+
+	for (size_t i = start; i + needle_len <= len; i++) {
+		if ((haystack[i] | pf->fold_mask[0]) == first && (haystack[i + needle_len - 1] | pf->fold_mask[1]) == last && verify_candidate(pf, haystack + i)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int contains_scalar(const Prefilter *pf, const unsigned char *haystack, size_t len) {
+	return contains_scalar_from(pf, haystack, len, 0);
+}
+
+#ifdef PREFILTER_X86
+__attribute__((target("sse2"))) static int contains_sse2(const Prefilter *pf, const unsigned char *haystack, size_t len) {
+	size_t needle_len = pf->needle_len;
+	if (len < needle_len) {
+		return 0;
+	}
+
+	const __m128i first = _mm_set1_epi8((char)pf->needle[0]);
+	const __m128i last = _mm_set1_epi8((char)pf->needle[needle_len - 1]);
+	const __m128i first_mask = _mm_set1_epi8((char)pf->fold_mask[0]);
+	const __m128i last_mask = _mm_set1_epi8((char)pf->fold_mask[1]);
+
+	size_t i = 0;
+	for (; i + needle_len - 1 + 16 <= len; i += 16) {
+		__m128i block_first = _mm_or_si128(_mm_loadu_si128((const __m128i *)(haystack + i)), first_mask);
+		__m128i block_last = _mm_or_si128(_mm_loadu_si128((const __m128i *)(haystack + i + needle_len - 1)), last_mask);
+		unsigned int bits = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+
+		while (bits != 0) {
+			if (verify_candidate(pf, haystack + i + __builtin_ctz(bits))) {
+				return 1;
+			}
+			bits &= bits - 1;
+		}
+	}
+
+	return contains_scalar_from(pf, haystack, len, i);
+}
+
+__attribute__((target("avx2"))) static int contains_avx2(const Prefilter *pf, const unsigned char *haystack, size_t len) {
+	size_t needle_len = pf->needle_len;
+	if (len < needle_len) {
+		return 0;
+	}
+
+	const __m256i first = _mm256_set1_epi8((char)pf->needle[0]);
+	const __m256i last = _mm256_set1_epi8((char)pf->needle[needle_len - 1]);
+	const __m256i first_mask = _mm256_set1_epi8((char)pf->fold_mask[0]);
+	const __m256i last_mask = _mm256_set1_epi8((char)pf->fold_mask[1]);
+
+	size_t i = 0;
+	for (; i + needle_len - 1 + 32 <= len; i += 32) {
+		__m256i block_first = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(haystack + i)), first_mask);
+		__m256i block_last = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(haystack + i + needle_len - 1)), last_mask);
+		unsigned int bits = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+
+		while (bits != 0) {
+			if (verify_candidate(pf, haystack + i + __builtin_ctz(bits))) {
+				return 1;
+			}
+			bits &= bits - 1;
+		}
+	}
+
+	return contains_scalar_from(pf, haystack, len, i);
+}
+#endif
+
+static uint32_t qgram_hash(uint32_t gram) {
+	return (gram * 2654435761u) >> 20; // 12 bits, one of 4096 bloom bits
+}
+
+static int compare_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Count filter: if an identifier is within edit distance k of a pattern of
+// length m, at least m - q + 1 - k * q of the pattern's q-grams survive the
+// edits and so occur somewhere in the file. Picks the largest q for which
+// that bound is still positive.
+static void qgram_init(Prefilter *pf, const unsigned char *pattern, int max_distance) {
+	int m = (int)strlen((const char *)pattern);
+
+	for (int q = 3; q >= 1; q--) {
+		int threshold = (m - q + 1) - max_distance * q;
+		if (threshold > 0) {
+			pf->qgram_q = q;
+			pf->qgram_threshold = threshold;
+			break;
+		}
+	}
+
+	int positions = m - pf->qgram_q + 1;
+	if (pf->qgram_threshold <= 0 || positions > QGRAM_MAX_COUNT) {
+		return;
+	}
+
+	uint32_t *grams = malloc(sizeof(uint32_t) * positions);
+	pf->qgrams = malloc(sizeof(uint32_t) * positions);
+	pf->qgram_positions = calloc(positions, sizeof(int));
+	if (grams == NULL || pf->qgrams == NULL || pf->qgram_positions == NULL) {
+		free(grams);
+		return;
+	}
+
+	for (int i = 0; i < positions; i++) {
+		uint32_t gram = 0;
+		for (int k = 0; k < pf->qgram_q; k++) {
+			gram = (gram << 8) | pattern[i + k];
+		}
+		grams[i] = gram;
+	}
+	qsort(grams, positions, sizeof(uint32_t), compare_u32);
+
+	for (int i = 0; i < positions; i++) {
+		if (pf->qgram_count == 0 || pf->qgrams[pf->qgram_count - 1] != grams[i]) {
+			pf->qgrams[pf->qgram_count++] = grams[i];
+			uint32_t bit = qgram_hash(grams[i]);
+			pf->qgram_bloom[bit >> 6] |= 1ULL << (bit & 63);
+		}
+		pf->qgram_positions[pf->qgram_count - 1]++;
+	}
+	free(grams);
+
+	pf->enabled = 1;
+}
+
+static int qgram_may_match(const Prefilter *pf, const unsigned char *content, size_t len) {
+	unsigned char found[QGRAM_MAX_COUNT] = {0};
+	int q = pf->qgram_q;
+	uint32_t mask = (1u << (8 * q)) - 1;
+	uint32_t gram = 0;
+	int matched = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		gram = ((gram << 8) | content[i]) & mask;
+		if (i + 1 < (size_t)q) {
+			continue;
+		}
+
+		uint32_t bit = qgram_hash(gram);
+		if ((pf->qgram_bloom[bit >> 6] & (1ULL << (bit & 63))) == 0) {
+			continue;
+		}
+
+		int lo = 0;
+		int hi = pf->qgram_count - 1;
+		while (lo <= hi) {
+			int mid = (lo + hi) / 2;
+			if (pf->qgrams[mid] < gram) {
+				lo = mid + 1;
+			} else if (pf->qgrams[mid] > gram) {
+				hi = mid - 1;
+			} else {
+				if (!found[mid]) {
+					found[mid] = 1;
+					matched += pf->qgram_positions[mid];
+					if (matched >= pf->qgram_threshold) {
+						return 1;
+					}
+				}
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void prefilter_init(Prefilter *pf, const char *pattern, int case_sensitive, int max_distance) {
+	memset(pf, 0, sizeof(Prefilter));
+
+	size_t len = strlen(pattern);
+	if (len == 0) {
+		return;
+	}
+
+	// Levenshtein distances are computed on the raw bytes, so the q-gram
+	// filter is always case sensitive.
+	if (max_distance > 0) {
+		qgram_init(pf, (const unsigned char *)pattern, max_distance);
+		return;
+	}
+
+	pf->needle = malloc(len);
+	if (pf->needle == NULL) {
+		return;
+	}
+
+	pf->needle_len = len;
+	pf->case_insensitive = !case_sensitive;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)pattern[i];
+		pf->needle[i] = pf->case_insensitive ? to_lower_ascii(c) : c;
+	}
+
+	if (pf->case_insensitive) {
+		pf->fold_mask[0] = is_ascii_alpha(pf->needle[0]) ? 0x20 : 0;
+		pf->fold_mask[1] = is_ascii_alpha(pf->needle[len - 1]) ? 0x20 : 0;
+	}
+
+	pf->contains = contains_scalar;
+#ifdef PREFILTER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		pf->contains = contains_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		pf->contains = contains_sse2;
+	}
+#endif
+
+	pf->enabled = 1;
+}
+
+void prefilter_init_automaton(Prefilter *pf, const AhoCorasick *automaton) {
+	memset(pf, 0, sizeof(Prefilter));
+	pf->automaton = automaton;
+	pf->enabled = 1;
+}
+
+int prefilter_may_match(const Prefilter *pf, const char *content, size_t len) {
+	if (!pf->enabled) {
+		return 1;
+	}
+
+	if (pf->automaton != NULL) {
+		return ac_contains(pf->automaton, (const unsigned char *)content, len);
+	}
+
+	if (pf->qgram_count > 0) {
+		return qgram_may_match(pf, (const unsigned char *)content, len);
+	}
+
+	return pf->contains(pf, (const unsigned char *)content, len);
+}
+
+void prefilter_free(Prefilter *pf) {
+	free(pf->needle);
+	free(pf->qgrams);
+	free(pf->qgram_positions);
+	memset(pf, 0, sizeof(Prefilter));
+}
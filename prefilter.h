@@ -0,0 +1,41 @@
+#ifndef PREFILTER_H
+#define PREFILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ahocorasick.h"
+
+// A cheap test run over the raw bytes of a file before it is parsed. It may
+// report false positives but never false negatives, so files it rejects can
+// be skipped without changing the results.
+typedef struct Prefilter Prefilter;
+
+struct Prefilter {
+	int enabled;
+
+	// Literal mode: every substring match has to appear verbatim in the file.
+	unsigned char *needle;
+	size_t needle_len;
+	int case_insensitive; // needle is stored lowercased
+	unsigned char fold_mask[2]; // applied to the first and last byte candidates
+	int (*contains)(const Prefilter *pf, const unsigned char *haystack, size_t len);
+
+	// Levenshtein mode: q-gram count filter.
+	int qgram_q;
+	int qgram_threshold;
+	int qgram_count;
+	uint32_t *qgrams; // distinct q-grams of the pattern, sorted
+	int *qgram_positions; // how many pattern positions share each q-gram
+	uint64_t qgram_bloom[64];
+
+	// Multi-pattern mode: some pattern has to appear in the file. Borrowed.
+	const AhoCorasick *automaton;
+};
+
+void prefilter_init(Prefilter *pf, const char *pattern, int case_sensitive, int max_distance);
+void prefilter_init_automaton(Prefilter *pf, const AhoCorasick *automaton);
+int prefilter_may_match(const Prefilter *pf, const char *content, size_t len);
+void prefilter_free(Prefilter *pf);
+
+#endif
@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "search.h"
+
+// Sets up matching for the given patterns; the rest of options must be
+// filled in already. The patterns are borrowed.
+void search_options_init(SearchOptions *options, const char *const *patterns, int pattern_count) {
+	options->cfname = patterns[0];
+	levenshtein_init(&options->levenshtein, options->cfname);
+	if (pattern_count <= 1) {
+		prefilter_init(&options->prefilter, options->cfname, options->case_sensitive, options->max_distance);
+		return;
+	}
+
+	options->patterns = patterns;
+	options->pattern_count = pattern_count;
+	memset(&options->prefilter, 0, sizeof(Prefilter));
+	if (options->max_distance > 0) {
+		options->levenshteins = malloc(sizeof(LevenshteinPattern) * (size_t)pattern_count);
+		if (options->levenshteins == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < pattern_count; i++) {
+			levenshtein_init(&options->levenshteins[i], patterns[i]);
+		}
+		return;
+	}
+
+	options->automaton = ac_create(patterns, pattern_count, !options->case_sensitive);
+	if (options->automaton == NULL) {
+		perror("ac_create");
+		exit(EXIT_FAILURE);
+	}
+	prefilter_init_automaton(&options->prefilter, options->automaton);
+}
+
+void search_options_free(SearchOptions *options) {
+	prefilter_free(&options->prefilter);
+	ac_free(options->automaton);
+	free(options->levenshteins);
+	options->automaton = NULL;
+	options->levenshteins = NULL;
+}
+
+static int multi_pattern_matches(const SearchOptions *options, const char *fname, SearchMatch *match) {
+	if (options->max_distance == 0) {
+		match->matched_count = ac_find_all(options->automaton, fname, match->patterns, SEARCH_MAX_MATCHED);
+		match->pattern_count = match->matched_count < SEARCH_MAX_MATCHED ? match->matched_count : SEARCH_MAX_MATCHED;
+		return match->matched_count > 0;
+	}
+
+	for (int i = 0; i < options->pattern_count; i++) {
+		int distance = levenshtein_bounded(&options->levenshteins[i], fname, options->max_distance);
+		if (distance > options->max_distance) {
+			continue;
+		}
+		if (match->distance == -1 || distance < match->distance) {
+			match->distance = distance;
+		}
+		if (match->pattern_count < SEARCH_MAX_MATCHED) {
+			match->patterns[match->pattern_count++] = i;
+		}
+		match->matched_count++;
+	}
+	return match->matched_count > 0;
+}
+
+int function_matches(const SearchOptions *options, const char *fname, SearchMatch *match) {
+	match->distance = -1;
+	match->pattern_count = 0;
+	match->matched_count = 0;
+	if (options->pattern_count > 1) {
+		return multi_pattern_matches(options, fname, match);
+	}
+
+	if (options->max_distance > 0) {
+		match->distance = levenshtein_bounded(&options->levenshtein, fname, options->max_distance);
+		return match->distance <= options->max_distance;
+	}
+
+	if (options->case_sensitive) {
+		return strstr(fname, options->cfname) != NULL;
+	}
+	return strcasestr(fname, options->cfname) != NULL;
+}
+
+static void append_string(OutputBuffer *out, const char *str) {
+	if (str != NULL) {
+		output_buffer_append(out, str, strlen(str));
+	}
+}
+
+static void append_view(OutputBuffer *out, TextView view, int drop_newlines) {
+	const char *data = view.data;
+	const char *end = data + view.len;
+	while (data < end) {
+		const char *newline = drop_newlines ? memchr(data, '\n', (size_t)(end - data)) : NULL;
+		const char *stop = newline != NULL ? newline : end;
+		output_buffer_append(out, data, (size_t)(stop - data));
+		data = newline != NULL ? newline + 1 : end;
+	}
+}
+
+// Formats one result line into out. prefix is empty for plain searches and
+// marks additions and removals in --watch mode. Newlines in the parameter
+// list are dropped so every result stays on one line.
+void format_function(OutputBuffer *out, const char *prefix, const char *file_path, const Function *fn, const SearchOptions *options, const SearchMatch *match) {
+	append_string(out, prefix);
+	append_string(out, file_path);
+	output_buffer_append_char(out, ':');
+	output_buffer_append_uint(out, fn->lineno);
+	output_buffer_append(out, ": ", 2);
+	append_view(out, fn->ftype, 0);
+	output_buffer_append_char(out, ' ');
+	append_string(out, fn->fname);
+	output_buffer_append_char(out, ' ');
+
+	append_view(out, fn->fparams, 1);
+
+	if (match->pattern_count > 0 && options->pattern_count > 1) {
+		output_buffer_append(out, " (match: ", 9);
+		for (int i = 0; i < match->pattern_count; i++) {
+			if (i > 0) {
+				output_buffer_append(out, ", ", 2);
+			}
+			append_string(out, options->patterns[match->patterns[i]]);
+		}
+		if (match->matched_count > match->pattern_count) {
+			output_buffer_append(out, ", +", 3);
+			output_buffer_append_uint(out, (uint64_t)(match->matched_count - match->pattern_count));
+			output_buffer_append(out, " more", 5);
+		}
+		output_buffer_append_char(out, ')');
+	}
+	if (options->max_distance > 0) {
+		output_buffer_append(out, " (dist: ", 8);
+		output_buffer_append_uint(out, (uint64_t)match->distance);
+		output_buffer_append_char(out, ')');
+	}
+	output_buffer_append_char(out, '\n');
+}
+
+void print_function(FILE *out, const char *prefix, const char *file_path, const Function *fn, const SearchOptions *options, const SearchMatch *match) {
+	OutputBuffer line = {0};
+	format_function(&line, prefix, file_path, fn, options, match);
+	fwrite(line.data, 1, line.len, out);
+	output_buffer_free(&line);
+}
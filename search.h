@@ -0,0 +1,51 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdio.h>
+
+#include "ahocorasick.h"
+#include "extract.h"
+#include "levenshtein.h"
+#include "output.h"
+#include "prefilter.h"
+
+typedef struct {
+	const char *cfname;
+	int case_sensitive;
+	int max_distance;
+	int no_ignore;
+	int include_generated; // do not skip generated and minified files
+	Prefilter prefilter;
+	LevenshteinPattern levenshtein;
+
+	// Searches for several patterns at once (-e, -f) have pattern_count > 1;
+	// cfname is then the first of them. Substring matches of all patterns
+	// are found in one pass by the automaton, which also drives the
+	// prefilter; in Levenshtein mode each pattern is checked on its own.
+	const char *const *patterns;
+	int pattern_count;
+	AhoCorasick *automaton;
+	LevenshteinPattern *levenshteins;
+} SearchOptions;
+
+// The most patterns listed by name for a single match.
+#define SEARCH_MAX_MATCHED 16
+
+// How a name matched: its edit distance in Levenshtein mode (the smallest
+// one over the patterns), or -1, and in a multi-pattern search which
+// patterns matched, as indexes into patterns. When more than
+// SEARCH_MAX_MATCHED did, the rest are only counted in matched_count.
+typedef struct {
+	int distance;
+	int pattern_count;
+	int matched_count;
+	int patterns[SEARCH_MAX_MATCHED];
+} SearchMatch;
+
+void search_options_init(SearchOptions *options, const char *const *patterns, int pattern_count);
+void search_options_free(SearchOptions *options);
+int function_matches(const SearchOptions *options, const char *fname, SearchMatch *match);
+void format_function(OutputBuffer *out, const char *prefix, const char *file_path, const Function *fn, const SearchOptions *options, const SearchMatch *match);
+void print_function(FILE *out, const char *prefix, const char *file_path, const Function *fn, const SearchOptions *options, const SearchMatch *match);
+
+#endif
@@ -0,0 +1,608 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "search.h"
+#include "server.h"
+#include "symtab.h"
+
+// The symbol table is built once and never changes, so any number of workers
+// can answer queries from it without locking. Connections waiting for a
+// request are polled by the accepting thread, which reads requests without
+// blocking and queues each complete one as a job on the pool; the worker
+// sends the reply and hands the connection back. An idle client therefore
+// costs a descriptor, never a worker.
+// Queries run over the deduplicated names of the symbol table and are then
+// expanded to their occurrences.
+
+typedef struct {
+	uint32_t symbol;
+	int distance;
+} Hit;
+
+typedef struct {
+	const Index *table;
+	SymbolTable *symbols;
+	const char *root;
+	size_t root_len;
+	int needs_slash;
+
+	// Open connections, shut down on exit so their workers return.
+	pthread_mutex_t lock;
+	int *connections;
+	size_t connection_count;
+	size_t connection_capacity;
+
+	// Connections whose reply was sent, waiting to be polled again. A byte
+	// on wake_fds[1] interrupts the poll.
+	struct Connection **returned;
+	size_t returned_count;
+	size_t returned_capacity;
+	int wake_fds[2];
+} Server;
+
+typedef struct Connection {
+	Server *server;
+	int fd;
+	uint64_t last_read; // CLOCK_MONOTONIC milliseconds
+
+	// The request being read: its header, then len bytes of body.
+	unsigned char header[4];
+	size_t header_read;
+	char *request;
+	uint32_t len;
+	size_t request_read;
+} Connection;
+
+typedef struct {
+	Connection **items;
+	size_t count;
+	size_t capacity;
+} ConnectionList;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop(int sig) {
+	(void)sig;
+	stop_requested = 1;
+}
+
+static int compare_hits(const void *a, const void *b) {
+	uint32_t x = ((const Hit *)a)->symbol;
+	uint32_t y = ((const Hit *)b)->symbol;
+	return x < y ? -1 : x > y;
+}
+
+typedef struct {
+	Hit *hits;
+	size_t count;
+	size_t capacity;
+} HitList;
+
+static void add_hits(const SymbolTable *symbols, uint32_t name, int distance, void *arg) {
+	HitList *list = (HitList *)arg;
+	for (uint32_t i = symbols->first_occurrence[name]; i < symbols->first_occurrence[name + 1]; i++) {
+		if (list->count == list->capacity) {
+			list->capacity = list->capacity ? list->capacity * 2 : 256;
+			list->hits = realloc(list->hits, sizeof(Hit) * list->capacity);
+			if (list->hits == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		list->hits[list->count].symbol = symbols->occurrences[i];
+		list->hits[list->count].distance = distance;
+		list->count++;
+	}
+}
+
+static int read_full(int fd, void *data, size_t len) {
+	char *p = (char *)data;
+	while (len > 0) {
+		ssize_t nread = read(fd, p, len);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread <= 0) {
+			return -1;
+		}
+		p += nread;
+		len -= (size_t)nread;
+	}
+	return 0;
+}
+
+static int send_full(int fd, const void *data, size_t len) {
+	const char *p = (const char *)data;
+	while (len > 0) {
+		ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent <= 0) {
+			return -1;
+		}
+		p += sent;
+		len -= (size_t)sent;
+	}
+	return 0;
+}
+
+static int send_frame(int fd, const char *data, size_t len) {
+	uint32_t header = htonl((uint32_t)len);
+	if (send_full(fd, &header, sizeof(header)) != 0) {
+		return -1;
+	}
+	return send_full(fd, data, len);
+}
+
+// Runs one query over the table, writing the results in the order and format
+// a search of the root directory would print them.
+static void run_query(const Server *server, const SearchOptions *options, FILE *out) {
+	const Index *table = server->table;
+	HitList list = {0};
+
+	if (options->max_distance > 0) {
+		symtab_find_fuzzy(server->symbols, &options->levenshtein, options->max_distance, add_hits, &list);
+	} else {
+		symtab_find_substring(server->symbols, options->cfname, options->case_sensitive, add_hits, &list);
+	}
+
+	Hit *hits = list.hits;
+	size_t hit_count = list.count;
+	qsort(hits, hit_count, sizeof(Hit), compare_hits);
+
+	char *path = NULL;
+	size_t path_capacity = 0;
+	uint32_t path_file = UINT32_MAX;
+	for (size_t i = 0; i < hit_count; i++) {
+		uint32_t file = server->symbols->symbol_files[hits[i].symbol];
+		if (file != path_file) {
+			const char *rel = table->strings + table->files[file].path;
+			size_t len = server->root_len + server->needs_slash + strlen(rel) + 1;
+			if (len > path_capacity) {
+				path_capacity = len * 2;
+				path = realloc(path, path_capacity);
+				if (path == NULL) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+			sprintf(path, "%s%s%s", server->root, server->needs_slash ? "/" : "", rel);
+			path_file = file;
+		}
+
+		Function fn;
+		index_file_function(table, &table->symbols[hits[i].symbol], &fn);
+		SearchMatch match = {.distance = hits[i].distance};
+		print_function(out, "", path, &fn, options, &match);
+	}
+
+	free(path);
+	free(hits);
+}
+
+static void track_connection(Server *server, int fd) {
+	pthread_mutex_lock(&server->lock);
+	if (server->connection_count == server->connection_capacity) {
+		server->connection_capacity = server->connection_capacity ? server->connection_capacity * 2 : 16;
+		server->connections = realloc(server->connections, sizeof(int) * server->connection_capacity);
+		if (server->connections == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	server->connections[server->connection_count++] = fd;
+	pthread_mutex_unlock(&server->lock);
+}
+
+static void untrack_connection(Server *server, int fd) {
+	pthread_mutex_lock(&server->lock);
+	for (size_t i = 0; i < server->connection_count; i++) {
+		if (server->connections[i] == fd) {
+			server->connections[i] = server->connections[--server->connection_count];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+}
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void connection_list_push(ConnectionList *list, Connection *connection) {
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 16;
+		list->items = realloc(list->items, sizeof(Connection *) * list->capacity);
+		if (list->items == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	list->items[list->count++] = connection;
+}
+
+static void close_connection(Connection *connection) {
+	untrack_connection(connection->server, connection->fd);
+	close(connection->fd);
+	free(connection->request);
+	free(connection);
+}
+
+// Reads whatever the client has sent of its next request without blocking.
+// Returns 1 once the request is complete, 0 if more is to come and -1 if the
+// connection is to be closed.
+static int read_request(Connection *connection) {
+	while (1) {
+		void *data;
+		size_t want;
+		if (connection->header_read < sizeof(connection->header)) {
+			data = connection->header + connection->header_read;
+			want = sizeof(connection->header) - connection->header_read;
+		} else {
+			data = connection->request + connection->request_read;
+			want = connection->len - connection->request_read;
+		}
+
+		// Never more than the current request, so a pipelined one stays in
+		// the socket and wakes the poll again.
+		ssize_t nread = recv(connection->fd, data, want, MSG_DONTWAIT);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		if (nread <= 0) {
+			return -1;
+		}
+		connection->last_read = now_ms();
+
+		if (connection->header_read < sizeof(connection->header)) {
+			connection->header_read += (size_t)nread;
+			if (connection->header_read < sizeof(connection->header)) {
+				continue;
+			}
+			uint32_t header;
+			memcpy(&header, connection->header, sizeof(header));
+			connection->len = ntohl(header);
+			if (connection->len < 2 || connection->len > SERVER_MAX_REQUEST) {
+				return -1;
+			}
+			connection->request = malloc(connection->len + 1);
+			if (connection->request == NULL) {
+				perror("malloc");
+				exit(EXIT_FAILURE);
+			}
+			connection->request_read = 0;
+		} else {
+			connection->request_read += (size_t)nread;
+			if (connection->request_read == connection->len) {
+				connection->request[connection->len] = '\0';
+				return 1;
+			}
+		}
+	}
+}
+
+static void return_connection(Server *server, Connection *connection) {
+	pthread_mutex_lock(&server->lock);
+	if (server->returned_count == server->returned_capacity) {
+		server->returned_capacity = server->returned_capacity ? server->returned_capacity * 2 : 16;
+		server->returned = realloc(server->returned, sizeof(Connection *) * server->returned_capacity);
+		if (server->returned == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	server->returned[server->returned_count++] = connection;
+	pthread_mutex_unlock(&server->lock);
+
+	// A full pipe is fine, the poll is due to wake up then anyway.
+	char byte = 0;
+	while (write(server->wake_fds[1], &byte, 1) == -1 && errno == EINTR) {
+	}
+}
+
+// Answers one complete request, then hands the connection back to the poll.
+static void serve_request(void *arg) {
+	Connection *connection = (Connection *)arg;
+	Server *server = connection->server;
+	char *request = connection->request;
+	connection->request = NULL;
+	connection->header_read = 0;
+
+	SearchOptions options = {
+		.cfname = request + 2,
+		.case_sensitive = (request[0] & SERVER_CASE_SENSITIVE) != 0,
+		.max_distance = (unsigned char)request[1],
+	};
+	levenshtein_init(&options.levenshtein, options.cfname);
+
+	char *reply = NULL;
+	size_t reply_len = 0;
+	FILE *out = open_memstream(&reply, &reply_len);
+	if (out == NULL) {
+		perror("open_memstream");
+		exit(EXIT_FAILURE);
+	}
+	run_query(server, &options, out);
+	fclose(out);
+	free(request);
+
+	int sent = send_frame(connection->fd, reply, reply_len);
+	free(reply);
+	if (sent != 0) {
+		close_connection(connection);
+		return;
+	}
+	connection->last_read = now_ms();
+	return_connection(server, connection);
+}
+
+static void accept_connection(Server *server, int listen_fd, ConnectionList *idle) {
+	int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd == -1) {
+		if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror("accept");
+		}
+		return;
+	}
+
+	// Replies are sent by blocking workers, which a client that stops
+	// reading must not hold forever.
+	struct timeval timeout = {SERVER_TIMEOUT_MS / 1000, (SERVER_TIMEOUT_MS % 1000) * 1000};
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	Connection *connection = calloc(1, sizeof(Connection));
+	if (connection == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	connection->server = server;
+	connection->fd = fd;
+	connection->last_read = now_ms();
+	track_connection(server, fd);
+	connection_list_push(idle, connection);
+}
+
+static int socket_address(const char *socket_path, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", socket_path);
+		return -1;
+	}
+	strcpy(addr->sun_path, socket_path);
+	return 0;
+}
+
+int serve_run(ThreadPool *pool, const char *socket_path, const char *root, const Index *table) {
+	struct sockaddr_un addr;
+	if (socket_address(socket_path, &addr) != 0) {
+		return 1;
+	}
+
+	// A socket left behind by an earlier server is replaced, anything else at
+	// that path is not touched.
+	struct stat statbuf;
+	if (lstat(socket_path, &statbuf) == 0) {
+		if (!S_ISSOCK(statbuf.st_mode)) {
+			fprintf(stderr, "Not a socket: %s\n", socket_path);
+			return 1;
+		}
+		unlink(socket_path);
+	}
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd == -1) {
+		perror("socket");
+		return 1;
+	}
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listen_fd, 64) == -1) {
+		perror("Error binding socket");
+		close(listen_fd);
+		return 1;
+	}
+
+	Server server = {
+		.table = table,
+		.root = root,
+		.root_len = strlen(root),
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	server.needs_slash = server.root_len > 0 && root[server.root_len - 1] != '/';
+	if (pipe2(server.wake_fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+		perror("pipe2");
+		close(listen_fd);
+		return 1;
+	}
+	server.symbols = symtab_build(table);
+
+	// No SA_RESTART, so a signal interrupts the poll below.
+	struct sigaction action = {0};
+	action.sa_handler = handle_stop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	ConnectionList idle = {0};
+	struct pollfd *pfds = NULL;
+	size_t pfds_capacity = 0;
+	while (!stop_requested) {
+		pthread_mutex_lock(&server.lock);
+		for (size_t i = 0; i < server.returned_count; i++) {
+			connection_list_push(&idle, server.returned[i]);
+		}
+		server.returned_count = 0;
+		int accepting = server.connection_count < SERVER_MAX_CONNECTIONS;
+		pthread_mutex_unlock(&server.lock);
+
+		// At the connection limit new clients wait in the listen backlog.
+		if (idle.count + 2 > pfds_capacity) {
+			pfds_capacity = (idle.count + 2) * 2;
+			pfds = realloc(pfds, sizeof(struct pollfd) * pfds_capacity);
+			if (pfds == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		pfds[0] = (struct pollfd){.fd = accepting ? listen_fd : -1, .events = POLLIN};
+		pfds[1] = (struct pollfd){.fd = server.wake_fds[0], .events = POLLIN};
+		uint64_t now = now_ms();
+		uint64_t deadline = UINT64_MAX;
+		for (size_t i = 0; i < idle.count; i++) {
+			pfds[i + 2] = (struct pollfd){.fd = idle.items[i]->fd, .events = POLLIN};
+			if (idle.items[i]->last_read + SERVER_TIMEOUT_MS < deadline) {
+				deadline = idle.items[i]->last_read + SERVER_TIMEOUT_MS;
+			}
+		}
+		int timeout = deadline == UINT64_MAX ? -1 : deadline <= now ? 0 : (int)(deadline - now);
+
+		if (poll(pfds, idle.count + 2, timeout) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("poll");
+			break;
+		}
+
+		if (pfds[1].revents & POLLIN) {
+			char drain[64];
+			while (read(server.wake_fds[0], drain, sizeof(drain)) > 0) {
+			}
+		}
+
+		// Connections with a complete request leave the list until their
+		// reply is sent; silent ones are closed after SERVER_TIMEOUT_MS.
+		now = now_ms();
+		size_t kept = 0;
+		for (size_t i = 0; i < idle.count; i++) {
+			Connection *connection = idle.items[i];
+			int status = 0;
+			if (pfds[i + 2].revents != 0) {
+				status = read_request(connection);
+			} else if (now >= connection->last_read + SERVER_TIMEOUT_MS) {
+				status = -1;
+			}
+
+			if (status == 1) {
+				tp_add_job(pool, serve_request, connection);
+			} else if (status == -1) {
+				close_connection(connection);
+			} else {
+				idle.items[kept++] = connection;
+			}
+		}
+		idle.count = kept;
+
+		if (pfds[0].revents & POLLIN) {
+			accept_connection(&server, listen_fd, &idle);
+		}
+	}
+	free(pfds);
+
+	close(listen_fd);
+	unlink(socket_path);
+
+	pthread_mutex_lock(&server.lock);
+	for (size_t i = 0; i < server.connection_count; i++) {
+		shutdown(server.connections[i], SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&server.lock);
+	tp_wait(pool);
+
+	for (size_t i = 0; i < server.returned_count; i++) {
+		connection_list_push(&idle, server.returned[i]);
+	}
+	for (size_t i = 0; i < idle.count; i++) {
+		close_connection(idle.items[i]);
+	}
+	free(idle.items);
+	free(server.returned);
+	close(server.wake_fds[0]);
+	close(server.wake_fds[1]);
+	free(server.connections);
+	symtab_free(server.symbols);
+	pthread_mutex_destroy(&server.lock);
+	return 0;
+}
+
+// Sends a single query to a running server and prints the reply as is.
+int client_run(const char *socket_path, const char *term, int case_sensitive, int max_distance) {
+	struct sockaddr_un addr;
+	if (socket_address(socket_path, &addr) != 0) {
+		return 1;
+	}
+
+	size_t term_len = strlen(term);
+	if (term_len + 2 > SERVER_MAX_REQUEST || max_distance < 0 || max_distance > 255) {
+		fprintf(stderr, "Query not supported by the server\n");
+		return 1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("socket");
+		return 1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("Error connecting to server");
+		close(fd);
+		return 1;
+	}
+
+	char *request = malloc(term_len + 2);
+	if (request == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	request[0] = case_sensitive ? SERVER_CASE_SENSITIVE : 0;
+	request[1] = (char)max_distance;
+	memcpy(request + 2, term, term_len);
+
+	int sent = send_frame(fd, request, term_len + 2);
+	free(request);
+
+	uint32_t header;
+	if (sent != 0 || read_full(fd, &header, sizeof(header)) != 0) {
+		fprintf(stderr, "Error talking to server\n");
+		close(fd);
+		return 1;
+	}
+
+	size_t len = ntohl(header);
+	char *reply = malloc(len ? len : 1);
+	if (reply == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	if (read_full(fd, reply, len) != 0) {
+		fprintf(stderr, "Error talking to server\n");
+		free(reply);
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	fwrite(reply, 1, len, stdout);
+	free(reply);
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "index.h"
+#include "tpool.h"
+
+// Wire protocol, integers in network byte order. A request is a u32 length
+// followed by that many bytes: a flags byte, the maximum Levenshtein distance
+// as a byte (0 for substring search) and the search term. The reply is a u32
+// length followed by the result lines in the usual output format. A
+// connection may carry any number of requests.
+#define SERVER_CASE_SENSITIVE 0x01
+#define SERVER_MAX_REQUEST (64 * 1024)
+
+// Clients beyond SERVER_MAX_CONNECTIONS wait to be accepted. A connection
+// whose client sends nothing for SERVER_TIMEOUT_MS, between requests or in
+// the middle of one, or does not take its reply for as long, is closed.
+#define SERVER_MAX_CONNECTIONS 256
+#define SERVER_TIMEOUT_MS 30000
+
+int serve_run(ThreadPool *pool, const char *socket_path, const char *root, const Index *table);
+int client_run(const char *socket_path, const char *term, int case_sensitive, int max_distance);
+
+#endif
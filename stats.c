@@ -0,0 +1,555 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+// Per-file latency histogram: bucket i counts files that took less than 2^i
+// microseconds, the last one everything slower.
+#define STATS_BUCKETS 24
+#define STATS_SLOW_FILES 10
+#define STATS_MAX_DEPTH 64
+#define STATS_SKIPPED_LISTED 20
+
+// Events kept per thread by --trace; older ones are overwritten.
+#define TRACE_EVENTS (1 << 16)
+
+static const char *stage_names[STATS_STAGE_COUNT] = {"walk", "read", "filter", "parse", "query", "match", "output", "write"};
+
+static const char *counter_names[STATS_COUNTER_COUNT] = {"files_indexed", "files_skipped", "files_binary", "files_too_large", "files_generated", "files_minified", "files_parsed", "parse_failed", "parse_timeouts", "match_limit", "functions", "matches", "jobs"};
+
+typedef struct {
+	const char *name;
+	uint64_t files;
+	uint64_t bytes;
+	uint64_t parse_nsec;
+	uint64_t max_nsec;
+	uint64_t histogram[STATS_BUCKETS];
+} LanguageStats;
+
+typedef struct {
+	char *path;
+	uint64_t nsec;
+	uint64_t parse_nsec;
+} SlowFile;
+
+typedef struct {
+	char *path;
+	const char *reason;
+} SkippedFile;
+
+enum {
+	TRACE_FILE = STATS_STAGE_COUNT,
+	TRACE_QUEUE,
+};
+
+typedef struct {
+	uint64_t start;
+	uint64_t nsec;
+	char *path; // TRACE_FILE only
+	int kind;   // a StatsStage, TRACE_FILE or TRACE_QUEUE
+} TraceEvent;
+
+typedef struct ThreadStats {
+	struct ThreadStats *next;
+	const char *name;
+	pid_t tid;
+
+	uint64_t stage_nsec[STATS_STAGE_COUNT];
+	StatsStage stack[STATS_MAX_DEPTH];
+	uint64_t begin[STATS_MAX_DEPTH]; // when each stage on the stack was entered
+	int depth;
+	uint64_t mark; // when time was last charged to the stage on top
+
+	uint64_t counters[STATS_COUNTER_COUNT];
+	uint64_t queue_waits;
+	uint64_t queue_wait_nsec;
+	uint64_t max_queue_wait_nsec;
+
+	LanguageStats languages[LANG_COUNT];
+
+	SlowFile slow[STATS_SLOW_FILES]; // slowest first
+	int slow_count;
+
+	SkippedFile skipped[STATS_SKIPPED_LISTED]; // the first ones only
+	int skipped_listed;
+	uint64_t skipped_count;
+
+	// Ring buffer of --trace events, written by this thread only.
+	TraceEvent *events;
+	uint64_t event_count;
+} ThreadStats;
+
+int stats_enabled = 0;
+static int trace_enabled = 0;
+
+static uint64_t start_nsec;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadStats *registry;
+static __thread ThreadStats *thread_stats;
+
+static uint64_t monotonic_nsec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Thread stats are never freed: threads are only created at startup and the
+// numbers are needed after the last job is done.
+static ThreadStats *thread_stats_get(void) {
+	ThreadStats *stats = thread_stats;
+	if (stats == NULL) {
+		stats = calloc(1, sizeof(ThreadStats));
+		if (stats == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		stats->name = "worker";
+		stats->tid = (pid_t)syscall(SYS_gettid);
+		pthread_mutex_lock(&registry_lock);
+		stats->next = registry;
+		registry = stats;
+		pthread_mutex_unlock(&registry_lock);
+		thread_stats = stats;
+	}
+	return stats;
+}
+
+static void trace_record(ThreadStats *stats, int kind, uint64_t start, uint64_t nsec, const char *path) {
+	if (stats->events == NULL) {
+		stats->events = calloc(TRACE_EVENTS, sizeof(TraceEvent));
+		if (stats->events == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	TraceEvent *event = &stats->events[stats->event_count & (TRACE_EVENTS - 1)];
+	free(event->path);
+	event->start = start;
+	event->nsec = nsec;
+	event->kind = kind;
+	event->path = NULL;
+	if (path != NULL) {
+		event->path = strdup(path);
+		if (event->path == NULL) {
+			perror("strdup");
+			exit(EXIT_FAILURE);
+		}
+	}
+	stats->event_count++;
+}
+
+// Called on the main thread before any work starts.
+void stats_enable(void) {
+	if (!stats_enabled) {
+		stats_enabled = 1;
+		start_nsec = monotonic_nsec();
+		thread_stats_get()->name = "main";
+	}
+}
+
+void stats_enable_trace(void) {
+	stats_enable();
+	trace_enabled = 1;
+}
+
+void stats_thread_name(const char *name) {
+	if (!stats_enabled) {
+		return;
+	}
+	thread_stats_get()->name = name;
+}
+
+uint64_t stats_now(void) {
+	return stats_enabled ? monotonic_nsec() : 0;
+}
+
+// Deeper nesting than the stack holds (the sorted walk recurses once per
+// directory level) is charged to the deepest recorded stage.
+void stats_push(StatsStage stage) {
+	if (!stats_enabled) {
+		return;
+	}
+	ThreadStats *stats = thread_stats_get();
+	uint64_t now = monotonic_nsec();
+	if (stats->depth > 0) {
+		int top = stats->depth < STATS_MAX_DEPTH ? stats->depth : STATS_MAX_DEPTH;
+		stats->stage_nsec[stats->stack[top - 1]] += now - stats->mark;
+	}
+	if (stats->depth < STATS_MAX_DEPTH) {
+		stats->stack[stats->depth] = stage;
+		stats->begin[stats->depth] = now;
+	}
+	stats->depth++;
+	stats->mark = now;
+}
+
+void stats_pop(void) {
+	if (!stats_enabled) {
+		return;
+	}
+	ThreadStats *stats = thread_stats_get();
+	uint64_t now = monotonic_nsec();
+	int top = stats->depth < STATS_MAX_DEPTH ? stats->depth : STATS_MAX_DEPTH;
+	StatsStage stage = stats->stack[top - 1];
+	stats->stage_nsec[stage] += now - stats->mark;
+	// Name comparisons are far too short and too many to be worth a span.
+	if (trace_enabled && stats->depth <= STATS_MAX_DEPTH && stage != STATS_MATCH) {
+		trace_record(stats, stage, stats->begin[top - 1], now - stats->begin[top - 1], NULL);
+	}
+	stats->depth--;
+	stats->mark = now;
+}
+
+void stats_count(StatsCounter counter, uint64_t n) {
+	if (!stats_enabled) {
+		return;
+	}
+	thread_stats_get()->counters[counter] += n;
+}
+
+void stats_queue_wait(uint64_t nsec) {
+	if (!stats_enabled) {
+		return;
+	}
+	ThreadStats *stats = thread_stats_get();
+	stats->queue_waits++;
+	stats->queue_wait_nsec += nsec;
+	if (nsec > stats->max_queue_wait_nsec) {
+		stats->max_queue_wait_nsec = nsec;
+	}
+	if (trace_enabled) {
+		trace_record(stats, TRACE_QUEUE, monotonic_nsec() - nsec, nsec, NULL);
+	}
+}
+
+static int histogram_bucket(uint64_t nsec) {
+	uint64_t usec = nsec / 1000;
+	int bucket = usec == 0 ? 0 : 64 - __builtin_clzll(usec);
+	return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+static void slow_file_insert(SlowFile *slow, int *count, const char *path, uint64_t nsec, uint64_t parse_nsec) {
+	if (*count == STATS_SLOW_FILES && nsec <= slow[*count - 1].nsec) {
+		return;
+	}
+	char *copy = strdup(path);
+	if (copy == NULL) {
+		perror("strdup");
+		exit(EXIT_FAILURE);
+	}
+	if (*count == STATS_SLOW_FILES) {
+		free(slow[--*count].path);
+	}
+	int i = (*count)++;
+	while (i > 0 && slow[i - 1].nsec < nsec) {
+		slow[i] = slow[i - 1];
+		i--;
+	}
+	slow[i] = (SlowFile){copy, nsec, parse_nsec};
+}
+
+void stats_skip(const char *path, const char *reason) {
+	if (!stats_enabled) {
+		return;
+	}
+	ThreadStats *stats = thread_stats_get();
+	stats->skipped_count++;
+	if (stats->skipped_listed < STATS_SKIPPED_LISTED) {
+		char *copy = strdup(path);
+		if (copy == NULL) {
+			perror("strdup");
+			exit(EXIT_FAILURE);
+		}
+		stats->skipped[stats->skipped_listed++] = (SkippedFile){copy, reason};
+	}
+}
+
+void stats_file(const Language *lang, const char *path, size_t bytes, uint64_t file_start, uint64_t parse_nsec) {
+	if (!stats_enabled) {
+		return;
+	}
+	ThreadStats *stats = thread_stats_get();
+	uint64_t total_nsec = monotonic_nsec() - file_start;
+	LanguageStats *language = &stats->languages[lang->id];
+	language->name = lang->name;
+	language->files++;
+	language->bytes += bytes;
+	language->parse_nsec += parse_nsec;
+	if (total_nsec > language->max_nsec) {
+		language->max_nsec = total_nsec;
+	}
+	language->histogram[histogram_bucket(total_nsec)]++;
+	slow_file_insert(stats->slow, &stats->slow_count, path, total_nsec, parse_nsec);
+	if (trace_enabled) {
+		trace_record(stats, TRACE_FILE, file_start, total_nsec, path);
+	}
+}
+
+// Upper bound of the histogram bucket holding the given fraction of files,
+// but never more than the slowest file.
+static uint64_t histogram_percentile_usec(const LanguageStats *language, double fraction) {
+	uint64_t rank = (uint64_t)(language->files * fraction);
+	uint64_t seen = 0;
+	uint64_t bound = 1ULL << (STATS_BUCKETS - 1);
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		seen += language->histogram[i];
+		if (seen > rank) {
+			bound = 1ULL << i;
+			break;
+		}
+	}
+	return bound < language->max_nsec / 1000 ? bound : language->max_nsec / 1000;
+}
+
+static void format_usec(char *buffer, size_t size, uint64_t usec) {
+	if (usec < 1000) {
+		snprintf(buffer, size, "%luus", (unsigned long)usec);
+	} else {
+		snprintf(buffer, size, "%.1fms", usec / 1e3);
+	}
+}
+
+static void json_string(FILE *out, const char *str) {
+	fputc('"', out);
+	for (const unsigned char *p = (const unsigned char *)str; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\') {
+			fprintf(out, "\\%c", *p);
+		} else if (*p < 0x20) {
+			fprintf(out, "\\u%04x", *p);
+		} else {
+			fputc(*p, out);
+		}
+	}
+	fputc('"', out);
+}
+
+void stats_report(StatsFormat format, int threads) {
+	if (!stats_enabled) {
+		return;
+	}
+	double wall_ms = (monotonic_nsec() - start_nsec) / 1e6;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	ThreadStats total = {0};
+	SlowFile slow[STATS_SLOW_FILES];
+	int slow_count = 0;
+	SkippedFile skipped[STATS_SKIPPED_LISTED];
+	int skipped_listed = 0;
+	uint64_t skipped_count = 0;
+
+	pthread_mutex_lock(&registry_lock);
+	for (ThreadStats *stats = registry; stats != NULL; stats = stats->next) {
+		for (int i = 0; i < STATS_STAGE_COUNT; i++) {
+			total.stage_nsec[i] += stats->stage_nsec[i];
+		}
+		for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+			total.counters[i] += stats->counters[i];
+		}
+		total.queue_waits += stats->queue_waits;
+		total.queue_wait_nsec += stats->queue_wait_nsec;
+		if (stats->max_queue_wait_nsec > total.max_queue_wait_nsec) {
+			total.max_queue_wait_nsec = stats->max_queue_wait_nsec;
+		}
+		for (int i = 0; i < LANG_COUNT; i++) {
+			LanguageStats *from = &stats->languages[i];
+			LanguageStats *to = &total.languages[i];
+			if (from->files == 0) {
+				continue;
+			}
+			to->name = from->name;
+			to->files += from->files;
+			to->bytes += from->bytes;
+			to->parse_nsec += from->parse_nsec;
+			if (from->max_nsec > to->max_nsec) {
+				to->max_nsec = from->max_nsec;
+			}
+			for (int b = 0; b < STATS_BUCKETS; b++) {
+				to->histogram[b] += from->histogram[b];
+			}
+		}
+		for (int i = 0; i < stats->slow_count; i++) {
+			slow_file_insert(slow, &slow_count, stats->slow[i].path, stats->slow[i].nsec, stats->slow[i].parse_nsec);
+		}
+		skipped_count += stats->skipped_count;
+		for (int i = 0; i < stats->skipped_listed && skipped_listed < STATS_SKIPPED_LISTED; i++) {
+			skipped[skipped_listed++] = stats->skipped[i];
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	uint64_t files = 0;
+	uint64_t bytes = 0;
+	for (int i = 0; i < LANG_COUNT; i++) {
+		files += total.languages[i].files;
+		bytes += total.languages[i].bytes;
+	}
+	uint64_t busy_nsec = 0;
+	for (int i = 0; i < STATS_STAGE_COUNT; i++) {
+		busy_nsec += total.stage_nsec[i];
+	}
+
+	FILE *out = stderr;
+	if (format == STATS_FORMAT_JSON) {
+		fprintf(out, "{\"wall_ms\": %.3f, \"threads\": %d, \"peak_rss_kb\": %ld, \"files\": %lu, \"bytes\": %lu,\n", wall_ms, threads, usage.ru_maxrss, (unsigned long)files, (unsigned long)bytes);
+		fprintf(out, " \"stages_ms\": {");
+		for (int i = 0; i < STATS_STAGE_COUNT; i++) {
+			fprintf(out, "%s\"%s\": %.3f", i > 0 ? ", " : "", stage_names[i], total.stage_nsec[i] / 1e6);
+		}
+		fprintf(out, "},\n \"queue_wait\": {\"jobs\": %lu, \"total_ms\": %.3f, \"max_ms\": %.3f},\n", (unsigned long)total.queue_waits, total.queue_wait_nsec / 1e6, total.max_queue_wait_nsec / 1e6);
+		fprintf(out, " \"counters\": {");
+		for (int i = 0; i < STATS_COUNTER_COUNT; i++) {
+			fprintf(out, "%s\"%s\": %lu", i > 0 ? ", " : "", counter_names[i], (unsigned long)total.counters[i]);
+		}
+		fprintf(out, "},\n \"languages\": [");
+		int first = 1;
+		for (int i = 0; i < LANG_COUNT; i++) {
+			LanguageStats *language = &total.languages[i];
+			if (language->files == 0) {
+				continue;
+			}
+			fprintf(out, "%s\n  {\"name\": \"%s\", \"files\": %lu, \"bytes\": %lu, \"parse_ms\": %.3f, \"max_ms\": %.3f, \"histogram_us\": {", first ? "" : ",", language->name, (unsigned long)language->files, (unsigned long)language->bytes,
+			        language->parse_nsec / 1e6, language->max_nsec / 1e6);
+			int first_bucket = 1;
+			for (int b = 0; b < STATS_BUCKETS; b++) {
+				if (language->histogram[b] > 0) {
+					fprintf(out, "%s\"%s%llu\": %lu", first_bucket ? "" : ", ", b == STATS_BUCKETS - 1 ? ">=" : "<", b == STATS_BUCKETS - 1 ? 1ULL << (b - 1) : 1ULL << b, (unsigned long)language->histogram[b]);
+					first_bucket = 0;
+				}
+			}
+			fprintf(out, "}}");
+			first = 0;
+		}
+		fprintf(out, "],\n \"slowest\": [");
+		for (int i = 0; i < slow_count; i++) {
+			fprintf(out, "%s\n  {\"path\": ", i > 0 ? "," : "");
+			json_string(out, slow[i].path);
+			fprintf(out, ", \"ms\": %.3f, \"parse_ms\": %.3f}", slow[i].nsec / 1e6, slow[i].parse_nsec / 1e6);
+		}
+		fprintf(out, "],\n \"skipped_count\": %lu, \"skipped\": [", (unsigned long)skipped_count);
+		for (int i = 0; i < skipped_listed; i++) {
+			fprintf(out, "%s\n  {\"path\": ", i > 0 ? "," : "");
+			json_string(out, skipped[i].path);
+			fprintf(out, ", \"reason\": \"%s\"}", skipped[i].reason);
+		}
+		fprintf(out, "]}\n");
+	} else {
+		fprintf(out, "%lu files, %.1f MB in %.1f ms with %d threads, peak RSS %.1f MB\n", (unsigned long)files, bytes / 1e6, wall_ms, threads, usage.ru_maxrss / 1024.0);
+		fprintf(out, "\n%-8s %10s %6s\n", "stage", "thread ms", "share");
+		for (int i = 0; i < STATS_STAGE_COUNT; i++) {
+			fprintf(out, "%-8s %10.1f %5.1f%%\n", stage_names[i], total.stage_nsec[i] / 1e6, busy_nsec > 0 ? total.stage_nsec[i] * 100.0 / busy_nsec : 0.0);
+		}
+		fprintf(out, "%-8s %10.1f of %.1f ms wall times %d threads\n", "busy", busy_nsec / 1e6, wall_ms, threads);
+		fprintf(out, "\nQueue wait: %lu jobs, %.1f ms total, %.3f ms mean, %.1f ms max\n", (unsigned long)total.queue_waits, total.queue_wait_nsec / 1e6, total.queue_waits > 0 ? total.queue_wait_nsec / 1e6 / total.queue_waits : 0.0,
+		        total.max_queue_wait_nsec / 1e6);
+		fprintf(out, "Files: %lu parsed (%lu failed), %lu skipped by the prefilter, %lu binary, %lu from the index\n", (unsigned long)total.counters[STATS_FILES_PARSED], (unsigned long)total.counters[STATS_PARSE_FAILED],
+		        (unsigned long)total.counters[STATS_FILES_SKIPPED], (unsigned long)total.counters[STATS_FILES_BINARY], (unsigned long)total.counters[STATS_FILES_INDEXED]);
+		fprintf(out, "Budgets: %lu too large, %lu generated, %lu minified, %lu parse timeouts, %lu hit the match limit\n", (unsigned long)total.counters[STATS_FILES_TOO_LARGE], (unsigned long)total.counters[STATS_FILES_GENERATED],
+		        (unsigned long)total.counters[STATS_FILES_MINIFIED], (unsigned long)total.counters[STATS_PARSE_TIMEOUTS], (unsigned long)total.counters[STATS_MATCH_LIMIT]);
+		fprintf(out, "Functions: %lu extracted, %lu matched\n", (unsigned long)total.counters[STATS_FUNCTIONS], (unsigned long)total.counters[STATS_MATCHES]);
+
+		fprintf(out, "\n%-10s %7s %8s %9s %8s %8s %8s %8s\n", "language", "files", "MB", "parse ms", "p50", "p90", "p99", "max");
+		for (int i = 0; i < LANG_COUNT; i++) {
+			LanguageStats *language = &total.languages[i];
+			if (language->files == 0) {
+				continue;
+			}
+			char p50[16], p90[16], p99[16], max[16];
+			format_usec(p50, sizeof(p50), histogram_percentile_usec(language, 0.5));
+			format_usec(p90, sizeof(p90), histogram_percentile_usec(language, 0.9));
+			format_usec(p99, sizeof(p99), histogram_percentile_usec(language, 0.99));
+			format_usec(max, sizeof(max), language->max_nsec / 1000);
+			fprintf(out, "%-10s %7lu %8.2f %9.1f %8s %8s %8s %8s\n", language->name, (unsigned long)language->files, language->bytes / 1e6, language->parse_nsec / 1e6, p50, p90, p99, max);
+		}
+		fprintf(out, "(percentiles are histogram bucket bounds)\n");
+
+		if (slow_count > 0) {
+			fprintf(out, "\nSlowest files:\n");
+			for (int i = 0; i < slow_count; i++) {
+				fprintf(out, "%9.1f ms (parse %.1f ms) %s\n", slow[i].nsec / 1e6, slow[i].parse_nsec / 1e6, slow[i].path);
+			}
+		}
+
+		if (skipped_count > 0) {
+			fprintf(out, "\nSkipped files:\n");
+			for (int i = 0; i < skipped_listed; i++) {
+				fprintf(out, "%14s  %s\n", skipped[i].reason, skipped[i].path);
+			}
+			if (skipped_count > (uint64_t)skipped_listed) {
+				fprintf(out, "%14s  and %lu more\n", "", (unsigned long)(skipped_count - skipped_listed));
+			}
+		}
+	}
+
+	for (int i = 0; i < slow_count; i++) {
+		free(slow[i].path);
+	}
+}
+
+static double trace_usec(uint64_t nsec) {
+	return nsec > start_nsec ? (nsec - start_nsec) / 1e3 : 0.0;
+}
+
+// Stages and files become complete ("X") events on their thread's track, time
+// in the queue an async pair on a track of its own, since it starts before
+// the worker that ends it picked the file up. Gaps on a worker's track are
+// time it spent idle or stealing.
+int stats_write_trace(const char *path) {
+	if (!trace_enabled) {
+		return 0;
+	}
+	FILE *out = fopen(path, "w");
+	if (out == NULL) {
+		return -1;
+	}
+
+	int pid = (int)getpid();
+	uint64_t dropped = 0;
+	uint64_t queue_id = 0;
+	fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"crep\"}}", pid);
+
+	pthread_mutex_lock(&registry_lock);
+	for (ThreadStats *stats = registry; stats != NULL; stats = stats->next) {
+		int tid = (int)stats->tid;
+		fprintf(out, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}", pid, tid, stats->name);
+
+		uint64_t first = 0;
+		if (stats->event_count > TRACE_EVENTS) {
+			first = stats->event_count - TRACE_EVENTS;
+			dropped += first;
+		}
+		for (uint64_t i = first; i < stats->event_count; i++) {
+			TraceEvent *event = &stats->events[i & (TRACE_EVENTS - 1)];
+			double ts = trace_usec(event->start);
+			if (event->kind == TRACE_QUEUE) {
+				queue_id++;
+				fprintf(out, ",\n{\"name\": \"queued\", \"cat\": \"queue\", \"ph\": \"b\", \"id\": %lu, \"ts\": %.3f, \"pid\": %d, \"tid\": %d}", (unsigned long)queue_id, ts, pid, tid);
+				fprintf(out, ",\n{\"name\": \"queued\", \"cat\": \"queue\", \"ph\": \"e\", \"id\": %lu, \"ts\": %.3f, \"pid\": %d, \"tid\": %d}", (unsigned long)queue_id, ts + event->nsec / 1e3, pid, tid);
+			} else if (event->kind == TRACE_FILE) {
+				const char *base = strrchr(event->path, '/');
+				fprintf(out, ",\n{\"name\": ");
+				json_string(out, base != NULL ? base + 1 : event->path);
+				fprintf(out, ", \"cat\": \"file\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d, \"args\": {\"path\": ", ts, event->nsec / 1e3, pid, tid);
+				json_string(out, event->path);
+				fprintf(out, "}}");
+			} else {
+				fprintf(out, ",\n{\"name\": \"%s\", \"cat\": \"stage\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d}", stage_names[event->kind], ts, event->nsec / 1e3, pid, tid);
+			}
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	fprintf(out, "\n], \"otherData\": {\"dropped_events\": %lu}}\n", (unsigned long)dropped);
+	if (dropped > 0) {
+		fprintf(stderr, "Trace buffers overflowed, the oldest %lu events were dropped\n", (unsigned long)dropped);
+	}
+	return fclose(out) == 0 ? 0 : -1;
+}
@@ -0,0 +1,79 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lang.h"
+
+// Run statistics for --stats. Every thread keeps its own counters, so
+// recording never takes a lock or shares a cache line; they are merged once
+// at the end. All entry points return right away while stats are off.
+//
+// Time is charged to the innermost stage the thread is in: a file parsed
+// inline by the walker counts as read/parse/query time, not as walk time.
+//
+// With --trace the same hooks also record every stage as a span, plus one
+// span per file and the time each file spent queued, into a ring buffer per
+// thread that keeps the most recent events. It is written out at the end in
+// the Chrome trace event format, which Perfetto and chrome://tracing load.
+
+typedef enum {
+	STATS_WALK,   // reading directories, ignore rules, stat
+	STATS_READ,   // opening and reading source files
+	STATS_FILTER, // index lookup, prefilter and binary check
+	STATS_PARSE,  // ts_parser_parse_string
+	STATS_QUERY,  // running the query and walking its matches
+	STATS_MATCH,  // comparing names against the search term
+	STATS_OUTPUT, // formatting results and handing them to the writer
+	STATS_WRITE,  // write(2) on the writer thread
+	STATS_STAGE_COUNT,
+} StatsStage;
+
+typedef enum {
+	STATS_FILES_INDEXED, // answered from the index
+	STATS_FILES_SKIPPED, // rejected by the prefilter
+	STATS_FILES_BINARY,
+	STATS_FILES_TOO_LARGE,
+	STATS_FILES_GENERATED,
+	STATS_FILES_MINIFIED,
+	STATS_FILES_PARSED,
+	STATS_PARSE_FAILED,
+	STATS_PARSE_TIMEOUTS,
+	STATS_MATCH_LIMIT, // files whose query hit the cursor's match limit
+	STATS_FUNCTIONS,
+	STATS_MATCHES,
+	STATS_JOBS,
+	STATS_COUNTER_COUNT,
+} StatsCounter;
+
+typedef enum {
+	STATS_FORMAT_TEXT,
+	STATS_FORMAT_JSON,
+} StatsFormat;
+
+extern int stats_enabled;
+
+void stats_enable(void);
+void stats_enable_trace(void);
+void stats_thread_name(const char *name);
+uint64_t stats_now(void); // 0 while stats are off
+
+void stats_push(StatsStage stage);
+void stats_pop(void);
+void stats_count(StatsCounter counter, uint64_t n);
+void stats_queue_wait(uint64_t nsec);
+
+// Called when done with a source file that was read, with the stats_now()
+// from before it was opened and the time spent in the parser.
+void stats_file(const Language *lang, const char *path, size_t bytes, uint64_t file_start, uint64_t parse_nsec);
+
+// A file that was left out, or only partly searched, because of a budget.
+void stats_skip(const char *path, const char *reason);
+
+// Writes the merged statistics to stderr. Only call it once the workers are
+// idle and the writer has finished.
+void stats_report(StatsFormat format, int threads);
+int stats_write_trace(const char *path);
+
+#endif
@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "symtab.h"
+
+#define BK_NONE UINT32_MAX
+
+static void *xmalloc(size_t size) {
+	void *ptr = malloc(size ? size : 1);
+	if (ptr == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	return ptr;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static const char *name_string(const SymbolTable *table, uint32_t name) {
+	return table->names + table->name_offsets[name];
+}
+
+// Groups the symbols by name. Names are interned in the string pool of the
+// index, so equal names share an offset and sorting by it brings them
+// together.
+static void build_names(SymbolTable *table) {
+	const Index *index = table->index;
+	uint32_t symbol_count = index->header->symbol_count;
+
+	table->symbol_files = xmalloc(sizeof(uint32_t) * symbol_count);
+	for (uint32_t i = 0; i < index->header->file_count; i++) {
+		for (uint32_t j = 0; j < index->files[i].symbol_count; j++) {
+			table->symbol_files[index->files[i].first_symbol + j] = i;
+		}
+	}
+
+	uint64_t *keys = xmalloc(sizeof(uint64_t) * symbol_count);
+	for (uint32_t i = 0; i < symbol_count; i++) {
+		keys[i] = ((uint64_t)index->symbols[i].name << 32) | i;
+	}
+	qsort(keys, symbol_count, sizeof(uint64_t), compare_u64);
+
+	table->name_offsets = xmalloc(sizeof(uint32_t) * (symbol_count + 1));
+	table->first_occurrence = xmalloc(sizeof(uint32_t) * (symbol_count + 1));
+	table->occurrences = xmalloc(sizeof(uint32_t) * symbol_count);
+
+	size_t names_capacity = 4096;
+	table->names = xmalloc(names_capacity);
+
+	for (uint32_t i = 0; i < symbol_count; i++) {
+		uint32_t name = (uint32_t)(keys[i] >> 32);
+		if (i == 0 || name != (uint32_t)(keys[i - 1] >> 32)) {
+			const char *str = index->strings + name;
+			size_t len = strlen(str) + 1;
+			while (table->names_size + len > names_capacity) {
+				names_capacity *= 2;
+				table->names = realloc(table->names, names_capacity);
+				if (table->names == NULL) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+			table->name_offsets[table->name_count] = (uint32_t)table->names_size;
+			table->first_occurrence[table->name_count] = i;
+			table->name_count++;
+			memcpy(table->names + table->names_size, str, len);
+			table->names_size += len;
+		}
+		table->occurrences[i] = (uint32_t)keys[i];
+	}
+	table->name_offsets[table->name_count] = (uint32_t)table->names_size;
+	table->first_occurrence[table->name_count] = symbol_count;
+	free(keys);
+
+	table->names_lower = xmalloc(table->names_size);
+	for (size_t i = 0; i < table->names_size; i++) {
+		table->names_lower[i] = (char)tolower((unsigned char)table->names[i]);
+	}
+}
+
+static uint32_t trigram_at(const char *s) {
+	return ((uint32_t)(unsigned char)s[0] << 16) | ((uint32_t)(unsigned char)s[1] << 8) | (uint32_t)(unsigned char)s[2];
+}
+
+static void put_varint(uint8_t *out, size_t *size, uint32_t value) {
+	while (value >= 0x80) {
+		out[(*size)++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	out[(*size)++] = (uint8_t)value;
+}
+
+static uint32_t get_varint(const uint8_t **in) {
+	const uint8_t *p = *in;
+	uint32_t value = 0;
+	int shift = 0;
+	while (*p & 0x80) {
+		value |= (uint32_t)(*p++ & 0x7F) << shift;
+		shift += 7;
+	}
+	value |= (uint32_t)*p++ << shift;
+	*in = p;
+	return value;
+}
+
+// Collects every (trigram, name) pair, sorts them and writes one posting list
+// per trigram. Names are visited in order, so the lists come out ascending and
+// only the gaps need storing.
+static void build_trigrams(SymbolTable *table) {
+	size_t pair_capacity = 1024;
+	size_t pair_count = 0;
+	uint64_t *pairs = xmalloc(sizeof(uint64_t) * pair_capacity);
+
+	for (uint32_t name = 0; name < table->name_count; name++) {
+		const char *str = table->names_lower + table->name_offsets[name];
+		size_t len = table->name_offsets[name + 1] - table->name_offsets[name] - 1;
+		for (size_t i = 0; i + 3 <= len; i++) {
+			if (pair_count == pair_capacity) {
+				pair_capacity *= 2;
+				pairs = realloc(pairs, sizeof(uint64_t) * pair_capacity);
+				if (pairs == NULL) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+			pairs[pair_count++] = ((uint64_t)trigram_at(str + i) << 32) | name;
+		}
+	}
+	qsort(pairs, pair_count, sizeof(uint64_t), compare_u64);
+
+	table->trigrams = xmalloc(sizeof(uint32_t) * (pair_count ? pair_count : 1));
+	table->trigram_counts = xmalloc(sizeof(uint32_t) * (pair_count ? pair_count : 1));
+	table->trigram_offsets = xmalloc(sizeof(size_t) * (pair_count ? pair_count : 1));
+	table->postings = xmalloc(pair_count * 5 + 1);
+
+	uint32_t previous = 0;
+	for (size_t i = 0; i < pair_count; i++) {
+		if (i > 0 && pairs[i] == pairs[i - 1]) {
+			continue; // the trigram repeats within the name
+		}
+		uint32_t trigram = (uint32_t)(pairs[i] >> 32);
+		uint32_t name = (uint32_t)pairs[i];
+		if (table->trigram_count == 0 || table->trigrams[table->trigram_count - 1] != trigram) {
+			table->trigrams[table->trigram_count] = trigram;
+			table->trigram_counts[table->trigram_count] = 0;
+			table->trigram_offsets[table->trigram_count] = table->postings_size;
+			table->trigram_count++;
+			previous = 0;
+		}
+		put_varint(table->postings, &table->postings_size, name - previous);
+		table->trigram_counts[table->trigram_count - 1]++;
+		previous = name;
+	}
+	free(pairs);
+
+	table->postings = realloc(table->postings, table->postings_size + 1);
+	if (table->postings == NULL) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static int find_trigram(const SymbolTable *table, uint32_t trigram) {
+	uint32_t lo = 0;
+	uint32_t hi = table->trigram_count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (table->trigrams[mid] == trigram) {
+			return (int)mid;
+		}
+		if (table->trigrams[mid] < trigram) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return -1;
+}
+
+// Exact distance, needed to pick the children worth visiting.
+static int exact_distance(const LevenshteinPattern *pattern, const char *text) {
+	size_t len = strlen(text);
+	int bound = (int)(pattern->len > len ? pattern->len : len);
+	return levenshtein_bounded(pattern, text, bound);
+}
+
+static void build_bk_tree(SymbolTable *table) {
+	table->bk_first_child = xmalloc(sizeof(uint32_t) * (table->name_count ? table->name_count : 1));
+	table->bk_next_sibling = xmalloc(sizeof(uint32_t) * (table->name_count ? table->name_count : 1));
+	table->bk_distance = xmalloc(sizeof(uint16_t) * (table->name_count ? table->name_count : 1));
+
+	for (uint32_t i = 0; i < table->name_count; i++) {
+		table->bk_first_child[i] = BK_NONE;
+		table->bk_next_sibling[i] = BK_NONE;
+		table->bk_distance[i] = 0;
+	}
+
+	LevenshteinPattern pattern;
+	for (uint32_t name = 1; name < table->name_count; name++) {
+		levenshtein_init(&pattern, name_string(table, name));
+
+		uint32_t node = 0;
+		while (1) {
+			int distance = exact_distance(&pattern, name_string(table, node));
+			if (distance > UINT16_MAX) {
+				distance = UINT16_MAX;
+			}
+
+			uint32_t child = table->bk_first_child[node];
+			while (child != BK_NONE && table->bk_distance[child] != distance) {
+				child = table->bk_next_sibling[child];
+			}
+			if (child == BK_NONE) {
+				table->bk_distance[name] = (uint16_t)distance;
+				table->bk_next_sibling[name] = table->bk_first_child[node];
+				table->bk_first_child[node] = name;
+				break;
+			}
+			node = child;
+		}
+	}
+}
+
+SymbolTable *symtab_build(const Index *index) {
+	SymbolTable *table = calloc(1, sizeof(SymbolTable));
+	if (table == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	table->index = index;
+	build_names(table);
+	build_trigrams(table);
+	build_bk_tree(table);
+	return table;
+}
+
+// Maps a byte offset in the names buffer back to the name containing it.
+static uint32_t name_at(const SymbolTable *table, size_t offset) {
+	uint32_t lo = 0;
+	uint32_t hi = table->name_count;
+	while (hi - lo > 1) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (table->name_offsets[mid] <= offset) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// Scans the packed names with memmem, which never matches across the NUL
+// separators. Used for terms too short to have a trigram.
+static void scan_names(const SymbolTable *table, const char *needle, size_t needle_len, int case_sensitive, symtab_visitor_t visit, void *ctx) {
+	const char *names = case_sensitive ? table->names : table->names_lower;
+	size_t offset = 0;
+	while (offset < table->names_size) {
+		const char *found = memmem(names + offset, table->names_size - offset, needle, needle_len);
+		if (found == NULL) {
+			break;
+		}
+		uint32_t name = name_at(table, (size_t)(found - names));
+		visit(table, name, -1, ctx);
+		offset = table->name_offsets[name + 1];
+	}
+}
+
+// Shortest lists first; repeated trigrams end up next to each other.
+static int compare_lists(const void *a, const void *b) {
+	const uint32_t *x = (const uint32_t *)a;
+	const uint32_t *y = (const uint32_t *)b;
+	if (x[1] != y[1]) {
+		return x[1] < y[1] ? -1 : 1;
+	}
+	return x[0] < y[0] ? -1 : x[0] > y[0];
+}
+
+// Names holding every trigram of the term are candidates. The lists are
+// intersected shortest first, and each candidate is verified since the
+// trigrams may appear in a different arrangement.
+void symtab_find_substring(const SymbolTable *table, const char *term, int case_sensitive, symtab_visitor_t visit, void *ctx) {
+	size_t term_len = strlen(term);
+	char *needle = xmalloc(term_len + 1);
+	for (size_t i = 0; i <= term_len; i++) {
+		needle[i] = case_sensitive ? term[i] : (char)tolower((unsigned char)term[i]);
+	}
+
+	if (term_len < 3) {
+		scan_names(table, needle, term_len, case_sensitive, visit, ctx);
+		free(needle);
+		return;
+	}
+
+	// (trigram index, posting count) per trigram of the lowercased term.
+	char *lower = xmalloc(term_len + 1);
+	for (size_t i = 0; i <= term_len; i++) {
+		lower[i] = (char)tolower((unsigned char)term[i]);
+	}
+	size_t list_count = 0;
+	uint32_t (*lists)[2] = xmalloc(sizeof(uint32_t[2]) * (term_len - 2));
+	for (size_t i = 0; i + 3 <= term_len; i++) {
+		int found = find_trigram(table, trigram_at(lower + i));
+		if (found < 0) {
+			list_count = 0;
+			break;
+		}
+		lists[list_count][0] = (uint32_t)found;
+		lists[list_count][1] = table->trigram_counts[found];
+		list_count++;
+	}
+	free(lower);
+
+	if (list_count == 0) {
+		free(lists);
+		free(needle);
+		return;
+	}
+	qsort(lists, list_count, sizeof(uint32_t[2]), compare_lists);
+
+	uint32_t candidate_count = lists[0][1];
+	uint32_t *candidates = xmalloc(sizeof(uint32_t) * candidate_count);
+	const uint8_t *p = table->postings + table->trigram_offsets[lists[0][0]];
+	uint32_t name = 0;
+	for (uint32_t i = 0; i < candidate_count; i++) {
+		name += get_varint(&p);
+		candidates[i] = name;
+	}
+
+	for (size_t l = 1; l < list_count && candidate_count > 0; l++) {
+		if (lists[l][0] == lists[l - 1][0]) {
+			continue; // the trigram repeats within the term
+		}
+		const uint8_t *q = table->postings + table->trigram_offsets[lists[l][0]];
+		uint32_t remaining = lists[l][1];
+		uint32_t current = remaining > 0 ? get_varint(&q) : 0;
+		uint32_t kept = 0;
+		for (uint32_t i = 0; i < candidate_count && remaining > 0; i++) {
+			while (remaining > 0 && current < candidates[i]) {
+				if (--remaining > 0) {
+					current += get_varint(&q);
+				}
+			}
+			if (remaining > 0 && current == candidates[i]) {
+				candidates[kept++] = candidates[i];
+			}
+		}
+		candidate_count = kept;
+	}
+
+	const char *names = case_sensitive ? table->names : table->names_lower;
+	for (uint32_t i = 0; i < candidate_count; i++) {
+		if (strstr(names + table->name_offsets[candidates[i]], needle) != NULL) {
+			visit(table, candidates[i], -1, ctx);
+		}
+	}
+
+	free(candidates);
+	free(lists);
+	free(needle);
+}
+
+// By the triangle inequality only children at a distance within d - k and
+// d + k of a node can hold names within k of the term.
+void symtab_find_fuzzy(const SymbolTable *table, const LevenshteinPattern *pattern, int max_distance, symtab_visitor_t visit, void *ctx) {
+	if (table->name_count == 0) {
+		return;
+	}
+
+	size_t stack_capacity = 256;
+	size_t stack_count = 0;
+	uint32_t *stack = xmalloc(sizeof(uint32_t) * stack_capacity);
+	stack[stack_count++] = 0;
+
+	while (stack_count > 0) {
+		uint32_t node = stack[--stack_count];
+		int distance = exact_distance(pattern, name_string(table, node));
+		if (distance <= max_distance) {
+			visit(table, node, distance, ctx);
+		}
+
+		for (uint32_t child = table->bk_first_child[node]; child != BK_NONE; child = table->bk_next_sibling[child]) {
+			int edge = table->bk_distance[child];
+			if (edge < distance - max_distance || edge > distance + max_distance) {
+				continue;
+			}
+			if (stack_count == stack_capacity) {
+				stack_capacity *= 2;
+				stack = realloc(stack, sizeof(uint32_t) * stack_capacity);
+				if (stack == NULL) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+			stack[stack_count++] = child;
+		}
+	}
+
+	free(stack);
+}
+
+void symtab_free(SymbolTable *table) {
+	if (table == NULL) {
+		return;
+	}
+	free(table->names);
+	free(table->names_lower);
+	free(table->name_offsets);
+	free(table->first_occurrence);
+	free(table->occurrences);
+	free(table->symbol_files);
+	free(table->trigrams);
+	free(table->trigram_counts);
+	free(table->trigram_offsets);
+	free(table->postings);
+	free(table->bk_first_child);
+	free(table->bk_next_sibling);
+	free(table->bk_distance);
+	free(table);
+}
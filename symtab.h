@@ -0,0 +1,53 @@
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "index.h"
+#include "levenshtein.h"
+
+// Deduplicated dictionary of the symbol names in an index, with the
+// occurrences of every name. Queries run over the distinct names only and are
+// expanded to occurrences afterwards, so their cost follows the number of
+// distinct names, or for fuzzy queries mostly the number of results.
+typedef struct {
+	const Index *index;
+
+	char *names; // distinct names, NUL separated
+	char *names_lower;
+	size_t names_size;
+	uint32_t *name_offsets; // start of every name in names, plus the end
+	uint32_t name_count;
+
+	// Symbols of name i are occurrences[first_occurrence[i]..first_occurrence[i + 1]].
+	uint32_t *first_occurrence;
+	uint32_t *occurrences;
+	uint32_t *symbol_files; // symbol -> file
+
+	// Trigram index over the lowercased names. The names holding trigram i
+	// are trigram_counts[i] ascending name ids, delta and varint coded in
+	// postings starting at trigram_offsets[i].
+	uint32_t *trigrams; // sorted
+	uint32_t *trigram_counts;
+	size_t *trigram_offsets;
+	uint32_t trigram_count;
+	uint8_t *postings;
+	size_t postings_size;
+
+	// BK-tree over the names, rooted at name 0. Children of a node sit at
+	// distinct edit distances from it.
+	uint32_t *bk_first_child;
+	uint32_t *bk_next_sibling;
+	uint16_t *bk_distance; // distance to the parent
+} SymbolTable;
+
+// Called once per matching name; distance is -1 for substring queries.
+typedef void (*symtab_visitor_t)(const SymbolTable *table, uint32_t name, int distance, void *ctx);
+
+SymbolTable *symtab_build(const Index *index);
+void symtab_find_substring(const SymbolTable *table, const char *term, int case_sensitive, symtab_visitor_t visit, void *ctx);
+void symtab_find_fuzzy(const SymbolTable *table, const LevenshteinPattern *pattern, int max_distance, symtab_visitor_t visit, void *ctx);
+void symtab_free(SymbolTable *table);
+
+#endif
@@ -49,6 +49,42 @@ run_test_with_flags() {
     fi
 }
 
+run_test_absent() {
+    local label=$1
+    local flags=$2
+    local search_term=$3
+    local file=$4
+    local unexpected_pattern=$5
+
+    printf "Testing %-50s " "$label ($flags $search_term)"
+    output=$($CREP $flags "$search_term" "$file")
+
+    if echo "$output" | grep -q "$unexpected_pattern"; then
+        echo "FAILED"
+        echo "  Unexpected pattern: $unexpected_pattern"
+        echo "  Actual output: $output"
+        failed=$((failed + 1))
+    else
+        echo "PASSED"
+    fi
+}
+
+check_output() {
+    local label=$1
+    local output_file=$2
+    local expected_pattern=$3
+
+    printf "Testing %-50s " "$label"
+    if grep -q "$expected_pattern" "$output_file"; then
+        echo "PASSED"
+    else
+        echo "FAILED"
+        echo "  Expected pattern: $expected_pattern"
+        echo "  Actual output: $(cat "$output_file")"
+        failed=$((failed + 1))
+    fi
+}
+
 echo "Starting tests..."
 echo "----------------"
 
@@ -145,11 +181,119 @@ run_test "CUDA Class" "Dim3" "$TEST_DIR/test.cuh" "class Dim3"
 # Case Sensitivity Tests
 run_test "Default Case Insensitive" "foo" "tests/test.c" "void FooBar"
 run_test_with_flags "Case Sensitive -c" "-c" "foobar" "tests/test.c" "void foobar"
+run_test "Prefilter Case Folding" "FOOBAR" "tests/test.c" "void foobar"
 
 # Depth Tests
 run_test_with_flags "Depth 0 (root)" "-d 0" "level" "tests/depth_test" "void level0"
 run_test_with_flags "Depth 1 (recursive)" "-d 1" "level" "tests/depth_test" "void level1"
 
+# Pipeline Budget Tests
+run_test_with_flags "Tiny job and byte budget" "--max-jobs 1 --max-bytes 1" "level" "tests/depth_test" "void level1"
+run_test_with_flags "Single thread" "-j 1" "level" "tests/depth_test" "void level1"
+run_test_with_flags "Batched small files" "--batch-bytes 1M" "level" "tests/depth_test" "void level1"
+
+# Sorted Output Tests
+SORT_OUT=$(mktemp)
+$CREP --sort level "$TEST_DIR" > "$SORT_OUT"
+sed -n 1p "$SORT_OUT" > "$SORT_OUT.first"
+check_output "Sorted output first line" "$SORT_OUT.first" "depth_test/level0.c:1: void level0"
+rm -f "$SORT_OUT" "$SORT_OUT.first"
+
+# Ignore File Tests
+run_test "Ignore file keeps others" "ignore_" "tests/ignore_test" "void ignore_kept"
+run_test_absent "Ignore file skips listed" "" "ignore_" "tests/ignore_test" "ignore_skipped"
+run_test_with_flags "No ignore" "--no-ignore" "ignore_" "tests/ignore_test" "void ignore_skipped"
+SKIP_DIR=$(mktemp -d)
+mkdir -p "$SKIP_DIR/build" "$SKIP_DIR/.git" "$SKIP_DIR/node_modules"
+echo "void skip_build(void) {}" > "$SKIP_DIR/build/b.c"
+echo "void skip_git(void) {}" > "$SKIP_DIR/.git/g.c"
+echo "void skip_module(void) {}" > "$SKIP_DIR/node_modules/m.c"
+run_test "Build directory searched" "skip_" "$SKIP_DIR" "void skip_build"
+run_test_absent "VCS directory skipped" "" "skip_" "$SKIP_DIR" "skip_git"
+run_test_absent "Dependency directory skipped" "" "skip_" "$SKIP_DIR" "skip_module"
+rm -rf "$SKIP_DIR"
+
+# Parse Budget Tests
+BUDGET_DIR=$(mktemp -d)
+printf '// Code generated by hand for the tests. DO NOT EDIT.\nvoid budget_generated(void) {}\n' > "$BUDGET_DIR/generated.c"
+echo "void budget_kept(void) {}" > "$BUDGET_DIR/kept.c"
+run_test "Generated file skip keeps others" "budget_" "$BUDGET_DIR" "void budget_kept"
+run_test_absent "Generated file skipped" "" "budget_" "$BUDGET_DIR" "budget_generated"
+run_test_with_flags "Generated file included" "--include-generated" "budget_" "$BUDGET_DIR" "void budget_generated"
+printf '// Returns an auto-generated id for the session.\nvoid budget_prose(void) {}\n' > "$BUDGET_DIR/prose.c"
+run_test "Generated word in a comment" "budget_" "$BUDGET_DIR" "void budget_prose"
+run_test_absent "Max file size" "--max-filesize 10" "budget_" "$BUDGET_DIR" "budget_kept"
+$CREP --index --include-generated "$BUDGET_DIR" > /dev/null 2>&1
+run_test_absent "Generated file kept out of the index" "" "budget_" "$BUDGET_DIR" "budget_generated"
+run_test_with_flags "Generated file included with an index" "--include-generated" "budget_" "$BUDGET_DIR" "void budget_generated"
+rm -rf "$BUDGET_DIR"
+
+# Early Exit Tests
+run_test_absent "Max count" "--sort -m 1" "level" "$TEST_DIR/depth_test" "level1"
+run_test_with_flags "Files with matches" "--files-with-matches" "hello" "$TEST_DIR/test.c" "^$TEST_DIR/test.c$"
+EARLY_OUT=$(mktemp)
+$CREP -m 1 level "$TEST_DIR/depth_test" | wc -l > "$EARLY_OUT"
+check_output "Max count unsorted" "$EARLY_OUT" "^ *1$"
+$CREP --timeout 60000 level "$TEST_DIR/depth_test" > "$EARLY_OUT" 2>&1
+check_output "Timeout not reached" "$EARLY_OUT" "void level1"
+rm -f "$EARLY_OUT"
+
+# Multi-pattern Tests
+run_test_with_flags "Multiple patterns, first" "-e hello -e" "pointer" "$TEST_DIR/test.c" "void hello () (match: hello)"
+run_test_with_flags "Multiple patterns, second" "-e hello -e" "pointer" "$TEST_DIR/test.c" "int get_pointer (int\\* x) (match: pointer)"
+PATTERN_FILE=$(mktemp)
+printf 'foo\nBAR\n' > "$PATTERN_FILE"
+run_test_with_flags "Pattern file, both match" "-f $PATTERN_FILE -e" "foo" "$TEST_DIR/test.c" "void foobar () (match: foo, BAR)"
+run_test_absent "Pattern file, case sensitive" "-c -f $PATTERN_FILE -e" "foo" "$TEST_DIR/test.c" "void FooBar"
+printf 'f\no\nb\na\nr\nfo\noo\nob\nba\nar\noob\noba\nbar\nfoob\nooba\nobar\nfooba\noobar\nfoobar\n' > "$PATTERN_FILE"
+run_test_with_flags "Pattern file, long match list" "-c -f $PATTERN_FILE -e" "foo" "$TEST_DIR/test.c" "void foobar () (match: .*, +4 more)"
+rm -f "$PATTERN_FILE"
+
+# Index Tests
+INDEX_DIR=$(mktemp -d)
+cp -r "$TEST_DIR/depth_test/." "$INDEX_DIR"
+$CREP --index "$INDEX_DIR" > /dev/null
+run_test "Indexed search" "level" "$INDEX_DIR" "void level1"
+echo "void level_changed(void) {}" >> "$INDEX_DIR/level0.c"
+run_test "Indexed search, changed file" "level_changed" "$INDEX_DIR" "void level_changed"
+printf '\377\377\377\177' | dd of="$INDEX_DIR/.crep/index" bs=1 seek=36 conv=notrunc 2> /dev/null
+run_test "Damaged index is ignored" "level1" "$INDEX_DIR" "void level1"
+rm -rf "$INDEX_DIR"
+STATUS_OUT=$(mktemp)
+$CREP level "" > /dev/null 2>&1
+echo "status $?" > "$STATUS_OUT"
+check_output "Empty path fails" "$STATUS_OUT" "^status 1$"
+rm -f "$STATUS_OUT"
+
+# Watch Tests
+WATCH_DIR=$(mktemp -d)
+WATCH_OUT=$(mktemp)
+cp -r "$TEST_DIR/depth_test/." "$WATCH_DIR"
+$CREP --watch level "$WATCH_DIR" > "$WATCH_OUT" &
+WATCH_PID=$!
+sleep 1
+echo "void level_added(void) {}" >> "$WATCH_DIR/level0.c"
+sleep 1
+sed -i 's/level_added/level_renamed/' "$WATCH_DIR/level0.c"
+sleep 1
+kill -INT $WATCH_PID
+wait $WATCH_PID
+check_output "Watch initial scan" "$WATCH_OUT" "^+.*void level1"
+check_output "Watch added symbol" "$WATCH_OUT" "^+.*void level_added"
+check_output "Watch removed symbol" "$WATCH_OUT" "^-.*void level_added"
+check_output "Watch renamed symbol" "$WATCH_OUT" "^+.*void level_renamed"
+rm -rf "$WATCH_DIR" "$WATCH_OUT"
+
+# Server Tests
+SERVER_SOCK=$(mktemp -u)
+$CREP --serve "$SERVER_SOCK" "$TEST_DIR/depth_test" > /dev/null &
+SERVER_PID=$!
+sleep 1
+run_test_with_flags "Client query" "--client $SERVER_SOCK" "level" "" "void level1"
+run_test_with_flags "Client Levenshtein query" "--client $SERVER_SOCK -l 1" "levelx" "" "level1"
+kill -INT $SERVER_PID
+wait $SERVER_PID
+
 # Levenshtein Distance Tests
 run_test_with_flags "Levenshtein -l 1 match" "-l 1" "heelo" "$TEST_DIR/test.c" "void hello ()"
 run_test_with_flags "Levenshtein -l 2 match" "-l 2" "heloo" "$TEST_DIR/test.c" "void hello ()"
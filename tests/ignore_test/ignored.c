@@ -0,0 +1 @@
+void ignore_skipped(void) {}
@@ -0,0 +1 @@
+void ignore_kept(void) {}
@@ -0,0 +1,269 @@
+// Thread pool microbenchmark. Runs the same workloads on the work-stealing
+// pool from tpool.c and on the single-queue FIFO pool it replaced, from one
+// thread up to the number of online CPUs (or argv[1]). Built and run by
+// `make tpbench`.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tpool.h"
+
+// The previous pool, one mutex around a linked list, kept as the baseline.
+
+typedef struct FifoNode {
+	ThreadPoolJob job;
+	struct FifoNode *next;
+} FifoNode;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t notify;
+	pthread_cond_t working_cond;
+	pthread_t *threads;
+	int num_threads;
+	FifoNode *head;
+	FifoNode *tail;
+	int active_jobs;
+	bool stop;
+} FifoPool;
+
+static void *fifo_worker(void *arg) {
+	FifoPool *pool = arg;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->head == NULL && !pool->stop) {
+			pthread_cond_wait(&pool->notify, &pool->lock);
+		}
+		if (pool->stop && pool->head == NULL) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		FifoNode *node = pool->head;
+		pool->head = node->next;
+		if (pool->head == NULL) {
+			pool->tail = NULL;
+		}
+		pool->active_jobs++;
+		pthread_mutex_unlock(&pool->lock);
+
+		node->job.function(node->job.arg);
+		free(node);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->active_jobs--;
+		if (pool->active_jobs == 0 && pool->head == NULL) {
+			pthread_cond_signal(&pool->working_cond);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+static void *fifo_create(int num_threads) {
+	FifoPool *pool = calloc(1, sizeof(FifoPool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->notify, NULL);
+	pthread_cond_init(&pool->working_cond, NULL);
+	pool->num_threads = num_threads;
+	pool->threads = malloc(sizeof(pthread_t) * num_threads);
+	for (int i = 0; i < num_threads; i++) {
+		pthread_create(&pool->threads[i], NULL, fifo_worker, pool);
+	}
+	return pool;
+}
+
+static bool fifo_add(void *p, thread_func_t function, void *arg) {
+	FifoPool *pool = p;
+	FifoNode *node = malloc(sizeof(FifoNode));
+	node->job.function = function;
+	node->job.arg = arg;
+	node->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail) {
+		pool->tail->next = node;
+	} else {
+		pool->head = node;
+	}
+	pool->tail = node;
+	pthread_cond_signal(&pool->notify);
+	pthread_mutex_unlock(&pool->lock);
+	return true;
+}
+
+static void fifo_add_batch(void *p, thread_func_t function, void **args, int count) {
+	for (int i = 0; i < count; i++) {
+		fifo_add(p, function, args[i]);
+	}
+}
+
+static void fifo_wait(void *p) {
+	FifoPool *pool = p;
+	pthread_mutex_lock(&pool->lock);
+	while (pool->active_jobs > 0 || pool->head != NULL) {
+		pthread_cond_wait(&pool->working_cond, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void fifo_destroy(void *p) {
+	FifoPool *pool = p;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->notify);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->num_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	free(pool->threads);
+	free(pool);
+}
+
+static void *steal_create(int num_threads) {
+	return tp_create(num_threads);
+}
+
+static bool steal_add(void *pool, thread_func_t function, void *arg) {
+	return tp_try_add_job(pool, function, arg);
+}
+
+static void steal_add_batch(void *pool, thread_func_t function, void **args, int count) {
+	tp_add_jobs(pool, function, args, count);
+}
+
+static void steal_wait(void *pool) {
+	tp_wait(pool);
+}
+
+static void steal_destroy(void *pool) {
+	tp_destroy(pool);
+}
+
+typedef struct {
+	const char *name;
+	void *(*create)(int num_threads);
+	bool (*add)(void *pool, thread_func_t function, void *arg);
+	void (*add_batch)(void *pool, thread_func_t function, void **args, int count);
+	void (*wait)(void *pool);
+	void (*destroy)(void *pool);
+} PoolOps;
+
+static const PoolOps pools[] = {
+	{"fifo", fifo_create, fifo_add, fifo_add_batch, fifo_wait, fifo_destroy},
+	{"steal", steal_create, steal_add, steal_add_batch, steal_wait, steal_destroy},
+};
+
+// Workloads. Each job spins for a fixed amount of work so the numbers measure
+// scheduling overhead rather than memory bandwidth.
+
+#define FLAT_JOBS 200000
+#define TREE_DEPTH 7
+#define TREE_FANOUT 6
+#define JOB_WORK 200
+
+static const PoolOps *current_ops;
+static void *current_pool;
+static volatile unsigned long sink;
+
+static void spin(int rounds) {
+	unsigned long x = (unsigned long)rounds;
+	for (int i = 0; i < rounds; i++) {
+		x = x * 6364136223846793005UL + 1442695040888963407UL;
+	}
+	__atomic_add_fetch(&sink, x & 1, __ATOMIC_RELAXED);
+}
+
+static void leaf_job(void *arg) {
+	(void)arg;
+	spin(JOB_WORK);
+}
+
+// Mirrors the directory walker: every node submits its children from inside
+// the pool and runs them itself when the queue refuses them.
+static void tree_job(void *arg) {
+	long depth = (long)arg;
+	spin(JOB_WORK);
+	if (depth == 0) {
+		return;
+	}
+	for (int i = 0; i < TREE_FANOUT; i++) {
+		if (!current_ops->add(current_pool, tree_job, (void *)(depth - 1))) {
+			tree_job((void *)(depth - 1));
+		}
+	}
+}
+
+static void run_flat(void) {
+	for (int i = 0; i < FLAT_JOBS; i++) {
+		current_ops->add(current_pool, leaf_job, NULL);
+	}
+}
+
+static void run_batch(void) {
+	static void *args[1024];
+	for (int i = 0; i < FLAT_JOBS; i += 1024) {
+		current_ops->add_batch(current_pool, leaf_job, args, 1024);
+	}
+}
+
+static void run_tree(void) {
+	current_ops->add(current_pool, tree_job, (void *)(long)TREE_DEPTH);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double measure(const PoolOps *ops, int threads, void (*workload)(void)) {
+	double best = 0;
+	for (int round = 0; round < 3; round++) {
+		current_ops = ops;
+		current_pool = ops->create(threads);
+		double start = now();
+		workload();
+		ops->wait(current_pool);
+		double elapsed = now() - start;
+		ops->destroy(current_pool);
+		if (round == 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+	return best;
+}
+
+int main(int argc, char *argv[]) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (max_threads < 1) {
+		max_threads = 1;
+	}
+
+	static const struct {
+		const char *name;
+		void (*run)(void);
+	} workloads[] = {
+	    {"flat", run_flat},
+	    {"batch", run_batch},
+	    {"tree", run_tree},
+	};
+
+	printf("%-6s %7s %10s %10s %8s\n", "load", "threads", "fifo ms", "steal ms", "speedup");
+	for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+		for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+			double fifo = measure(&pools[0], threads, workloads[w].run);
+			double steal = measure(&pools[1], threads, workloads[w].run);
+			printf("%-6s %7d %10.1f %10.1f %7.2fx\n", workloads[w].name, threads, fifo * 1000, steal * 1000, fifo / steal);
+			if (threads == max_threads) {
+				break;
+			}
+		}
+	}
+	return 0;
+}
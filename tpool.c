@@ -1,141 +1,627 @@
+#define _GNU_SOURCE
 #include "tpool.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Every worker owns a Chase-Lev deque: it pushes and pops its own jobs at the
+// bottom without locking, and idle workers steal from the top of a randomly
+// chosen victim. Jobs submitted from outside the pool go through a shared
+// injection queue whose nodes are recycled. The lock below is only taken on
+// the slow paths: putting a worker to sleep, waking one, waiting for queue
+// space and waiting for the pool to go idle.
+
+#define DEQUE_INITIAL_CAPACITY 256
 
 typedef struct ThreadPoolJobNode {
 	ThreadPoolJob job;
 	struct ThreadPoolJobNode *next;
 } ThreadPoolJobNode;
 
-struct ThreadPool {
-	pthread_mutex_t lock;
-	pthread_cond_t notify;
-	pthread_cond_t working_cond;
+typedef struct DequeBuffer {
+	long capacity; // power of two
+	ThreadPoolJob *jobs;
+	struct DequeBuffer *retired; // smaller predecessors, thieves may still read them
+} DequeBuffer;
+
+typedef struct {
+	long top;
+	long bottom;
+	DequeBuffer *buffer;
+} Deque;
+
+typedef struct {
+	ThreadPool *pool;
+	int index;
+	uint64_t rng;
+	Deque deque;
+} __attribute__((aligned(64))) Worker;
 
+struct ThreadPool {
+	Worker *workers;
 	pthread_t *threads;
 	int num_threads;
 
-	ThreadPoolJobNode *queue_head;
-	ThreadPoolJobNode *queue_tail;
+	pthread_mutex_t inject_lock;
+	ThreadPoolJobNode *inject_head;
+	ThreadPoolJobNode *inject_tail;
+	ThreadPoolJobNode *free_nodes;
+	int injected; // nodes in the injection queue
+
+	int queued;     // submitted, not yet picked up
+	int pending;    // submitted, not yet finished
+	int max_queued; // Producers block above this many queued jobs, 0 = unbounded
 
-	int active_jobs; // Jobs currently running
-	int queued_jobs; // Jobs waiting in queue
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t space_cond;
+	pthread_cond_t idle_cond;
+	int sleepers;
+	int space_waiters;
 	bool stop;
+
+	// Nonzero once the run was cancelled. A size_t so that tree-sitter
+	// parsers can poll it directly as their cancellation flag.
+	size_t cancelled;
+	pthread_t timer;
+	pthread_cond_t timer_cond;
+	struct timespec deadline; // CLOCK_MONOTONIC
+	bool has_timer;
 };
 
-static void *tp_worker(void *arg) {
-	ThreadPool *pool = (ThreadPool *)arg;
+static __thread Worker *current_worker = NULL;
 
-	while (1) {
-		pthread_mutex_lock(&pool->lock);
+static DequeBuffer *deque_buffer_new(long capacity) {
+	DequeBuffer *buffer = malloc(sizeof(DequeBuffer));
+	if (buffer == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	buffer->capacity = capacity;
+	buffer->jobs = malloc(sizeof(ThreadPoolJob) * capacity);
+	if (buffer->jobs == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	buffer->retired = NULL;
+	return buffer;
+}
 
-		while (pool->queue_head == NULL && !pool->stop) {
-			pthread_cond_wait(&pool->notify, &pool->lock);
-		}
+// Slots are read by thieves while the owner may write them, so both sides use
+// relaxed atomics; a thief only keeps what it read if its CAS on top wins.
+static void slot_store(DequeBuffer *buffer, long i, ThreadPoolJob job) {
+	ThreadPoolJob *slot = &buffer->jobs[i & (buffer->capacity - 1)];
+	__atomic_store_n(&slot->function, job.function, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->arg, job.arg, __ATOMIC_RELAXED);
+}
 
-		if (pool->stop && pool->queue_head == NULL) {
-			pthread_mutex_unlock(&pool->lock);
-			break;
+static ThreadPoolJob slot_load(DequeBuffer *buffer, long i) {
+	ThreadPoolJob *slot = &buffer->jobs[i & (buffer->capacity - 1)];
+	ThreadPoolJob job;
+	job.function = __atomic_load_n(&slot->function, __ATOMIC_RELAXED);
+	job.arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+	return job;
+}
+
+static DequeBuffer *deque_grow(Deque *deque, DequeBuffer *old, long bottom, long top) {
+	DequeBuffer *buffer = deque_buffer_new(old->capacity * 2);
+	for (long i = top; i < bottom; i++) {
+		slot_store(buffer, i, slot_load(old, i));
+	}
+	buffer->retired = old;
+	__atomic_store_n(&deque->buffer, buffer, __ATOMIC_RELEASE);
+	return buffer;
+}
+
+// Owner only.
+static void deque_push(Deque *deque, ThreadPoolJob job) {
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	DequeBuffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_RELAXED);
+
+	if (bottom - top > buffer->capacity - 1) {
+		buffer = deque_grow(deque, buffer, bottom, top);
+	}
+	slot_store(buffer, bottom, job);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+// Owner only. Takes the most recently pushed job.
+static bool deque_pop(Deque *deque, ThreadPoolJob *job) {
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	DequeBuffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_RELAXED);
+	__atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+	if (top > bottom) {
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	*job = slot_load(buffer, bottom);
+	if (top == bottom) {
+		// Last job: race the thieves for it.
+		bool won = __atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+		return won;
+	}
+	return true;
+}
+
+// Any thread. Takes the oldest job.
+static bool deque_steal(Deque *deque, ThreadPoolJob *job) {
+	long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+	if (top >= bottom) {
+		return false;
+	}
+
+	DequeBuffer *buffer = __atomic_load_n(&deque->buffer, __ATOMIC_ACQUIRE);
+	*job = slot_load(buffer, top);
+	return __atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static void deque_free(Deque *deque) {
+	DequeBuffer *buffer = deque->buffer;
+	while (buffer != NULL) {
+		DequeBuffer *retired = buffer->retired;
+		free(buffer->jobs);
+		free(buffer);
+		buffer = retired;
+	}
+}
+
+static uint64_t next_random(uint64_t *state) {
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+static bool take_injected(ThreadPool *pool, ThreadPoolJob *job) {
+	if (__atomic_load_n(&pool->injected, __ATOMIC_ACQUIRE) == 0) {
+		return false;
+	}
+
+	pthread_mutex_lock(&pool->inject_lock);
+	ThreadPoolJobNode *node = pool->inject_head;
+	if (node != NULL) {
+		pool->inject_head = node->next;
+		if (pool->inject_head == NULL) {
+			pool->inject_tail = NULL;
 		}
+		__atomic_sub_fetch(&pool->injected, 1, __ATOMIC_RELEASE);
+		*job = node->job;
+		node->next = pool->free_nodes;
+		pool->free_nodes = node;
+	}
+	pthread_mutex_unlock(&pool->inject_lock);
+	return node != NULL;
+}
+
+static bool find_job(Worker *self, ThreadPoolJob *job) {
+	ThreadPool *pool = self->pool;
 
-		ThreadPoolJobNode *node = pool->queue_head;
-		pool->queue_head = node->next;
-		if (pool->queue_head == NULL) {
-			pool->queue_tail = NULL;
+	if (deque_pop(&self->deque, job) || take_injected(pool, job)) {
+		return true;
+	}
+
+	int start = (int)(next_random(&self->rng) % (uint64_t)pool->num_threads);
+	for (int i = 0; i < pool->num_threads; i++) {
+		Worker *victim = &pool->workers[(start + i) % pool->num_threads];
+		if (victim != self && deque_steal(&victim->deque, job)) {
+			return true;
 		}
+	}
+	return false;
+}
 
-		pool->queued_jobs--;
-		pool->active_jobs++;
+static void job_started(ThreadPool *pool) {
+	int queued = __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	int max_queued = __atomic_load_n(&pool->max_queued, __ATOMIC_RELAXED);
+	if (max_queued > 0 && queued < max_queued && __atomic_load_n(&pool->space_waiters, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->space_cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
 
+static void job_finished(ThreadPool *pool) {
+	if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->idle_cond);
 		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static void *tp_worker(void *arg) {
+	Worker *self = (Worker *)arg;
+	ThreadPool *pool = self->pool;
+	current_worker = self;
 
-		// Execute job
-		if (node->job.function) {
-			node->job.function(node->job.arg);
+	while (1) {
+		ThreadPoolJob job;
+		if (find_job(self, &job)) {
+			job_started(pool);
+			if (job.function) {
+				job.function(job.arg);
+			}
+			job_finished(pool);
+			continue;
+		}
+
+		// A job is on its way into some queue, or a steal lost a race.
+		if (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) > 0) {
+			sched_yield();
+			continue;
 		}
-		free(node);
 
 		pthread_mutex_lock(&pool->lock);
-		pool->active_jobs--;
-		if (pool->active_jobs == 0 && pool->queue_head == NULL) {
-			pthread_cond_signal(&pool->working_cond);
+		__atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) <= 0 && !pool->stop) {
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
 		}
+		__atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+		bool done = pool->stop && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) <= 0;
 		pthread_mutex_unlock(&pool->lock);
+
+		if (done) {
+			break;
+		}
 	}
 
 	return NULL;
 }
 
+// Reads a cgroup CPU limit as a number of CPUs, rounded up. cgroup v2 keeps
+// "<quota|max> <period>" in cpu.max, v1 splits them over two files.
+static int cgroup_cpu_limit(void) {
+	long long quota = -1;
+	long long period = 0;
+
+	char cgroup_path[512] = "";
+	FILE *file = fopen("/proc/self/cgroup", "r");
+	if (file != NULL) {
+		char line[512];
+		while (fgets(line, sizeof(line), file) != NULL) {
+			if (strncmp(line, "0::", 3) == 0) {
+				line[strcspn(line, "\n")] = '\0';
+				snprintf(cgroup_path, sizeof(cgroup_path), "%s", line + 3);
+				break;
+			}
+		}
+		fclose(file);
+	}
+
+	// Inside a container the process' own cgroup is usually mounted as the
+	// root, so the path from /proc/self/cgroup may not exist.
+	char path[600];
+	const char *v2_paths[] = {path, "/sys/fs/cgroup/cpu.max"};
+	snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", cgroup_path);
+	for (int i = 0; i < 2 && quota < 0; i++) {
+		file = fopen(v2_paths[i], "r");
+		if (file == NULL) {
+			continue;
+		}
+		char max[32];
+		if (fscanf(file, "%31s %lld", max, &period) == 2 && strcmp(max, "max") != 0) {
+			quota = atoll(max);
+		} else {
+			period = 0;
+		}
+		fclose(file);
+	}
+
+	if (quota < 0) {
+		file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+		if (file != NULL) {
+			if (fscanf(file, "%lld", &quota) != 1) {
+				quota = -1;
+			}
+			fclose(file);
+		}
+		file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+		if (file != NULL) {
+			if (fscanf(file, "%lld", &period) != 1) {
+				period = 0;
+			}
+			fclose(file);
+		}
+	}
+
+	if (quota <= 0 || period <= 0) {
+		return 0;
+	}
+	return (int)((quota + period - 1) / period);
+}
+
+// Number of CPUs the process may actually run on: its affinity mask, capped
+// by the cgroup CPU quota when there is one.
+int tp_default_threads(void) {
+	int cpus = 0;
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		cpus = CPU_COUNT(&set);
+	}
+	if (cpus <= 0) {
+		cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	int limit = cgroup_cpu_limit();
+	if (limit > 0 && limit < cpus) {
+		cpus = limit;
+	}
+	return cpus > 0 ? cpus : 1;
+}
+
 ThreadPool *tp_create(int num_threads) {
-	ThreadPool *pool = (ThreadPool *)malloc(sizeof(ThreadPool));
+	ThreadPool *pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
 	if (pool == NULL)
 		return NULL;
 
 	pool->num_threads = num_threads;
-	pool->queue_head = NULL;
-	pool->queue_tail = NULL;
-	pool->active_jobs = 0;
-	pool->queued_jobs = 0;
 	pool->stop = false;
 
+	pthread_mutex_init(&pool->inject_lock, NULL);
 	pthread_mutex_init(&pool->lock, NULL);
-	pthread_cond_init(&pool->notify, NULL);
-	pthread_cond_init(&pool->working_cond, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->space_cond, NULL);
+	pthread_cond_init(&pool->idle_cond, NULL);
+	pthread_condattr_t timer_attr;
+	pthread_condattr_init(&timer_attr);
+	pthread_condattr_setclock(&timer_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&pool->timer_cond, &timer_attr);
+	pthread_condattr_destroy(&timer_attr);
+
+	if (posix_memalign((void **)&pool->workers, 64, sizeof(Worker) * num_threads) != 0) {
+		free(pool);
+		return NULL;
+	}
+	uint64_t seed = (uint64_t)time(NULL) ^ (uint64_t)(uintptr_t)pool;
+	for (int i = 0; i < num_threads; i++) {
+		Worker *worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->index = i;
+		worker->rng = (seed + (uint64_t)i * 0x9E3779B97F4A7C15ULL) | 1;
+		worker->deque.top = 0;
+		worker->deque.bottom = 0;
+		worker->deque.buffer = deque_buffer_new(DEQUE_INITIAL_CAPACITY);
+	}
 
 	pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
 	for (int i = 0; i < num_threads; i++) {
-		pthread_create(&pool->threads[i], NULL, tp_worker, pool);
+		pthread_create(&pool->threads[i], NULL, tp_worker, &pool->workers[i]);
 	}
 
 	return pool;
 }
 
-void tp_add_job(ThreadPool *pool, thread_func_t function, void *arg) {
-	ThreadPoolJobNode *node = (ThreadPoolJobNode *)malloc(sizeof(ThreadPoolJobNode));
-	if (node == NULL) {
-		perror("malloc");
-		exit(EXIT_FAILURE);
+static void wake_workers(ThreadPool *pool, int count) {
+	if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) == 0) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	if (count > 1) {
+		pthread_cond_broadcast(&pool->work_cond);
+	} else {
+		pthread_cond_signal(&pool->work_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static ThreadPoolJobNode *tp_job_node_get(ThreadPool *pool, thread_func_t function, void *arg) {
+	ThreadPoolJobNode *node = pool->free_nodes;
+	if (node != NULL) {
+		pool->free_nodes = node->next;
+	} else {
+		node = (ThreadPoolJobNode *)malloc(sizeof(ThreadPoolJobNode));
+		if (node == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
 	}
 	node->job.function = function;
 	node->job.arg = arg;
 	node->next = NULL;
+	return node;
+}
 
-	pthread_mutex_lock(&pool->lock);
+// Queues jobs whose queue slots were already reserved. Workers push onto
+// their own deque, everybody else goes through the injection queue.
+static void tp_enqueue(ThreadPool *pool, thread_func_t function, void **args, int count) {
+	__atomic_add_fetch(&pool->pending, count, __ATOMIC_SEQ_CST);
 
-	if (pool->queue_tail) {
-		pool->queue_tail->next = node;
+	Worker *self = current_worker;
+	if (self != NULL && self->pool == pool) {
+		for (int i = 0; i < count; i++) {
+			ThreadPoolJob job = {function, args[i]};
+			deque_push(&self->deque, job);
+		}
 	} else {
-		pool->queue_head = node;
+		pthread_mutex_lock(&pool->inject_lock);
+		for (int i = 0; i < count; i++) {
+			ThreadPoolJobNode *node = tp_job_node_get(pool, function, args[i]);
+			if (pool->inject_tail) {
+				pool->inject_tail->next = node;
+			} else {
+				pool->inject_head = node;
+			}
+			pool->inject_tail = node;
+		}
+		__atomic_add_fetch(&pool->injected, count, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&pool->inject_lock);
 	}
-	pool->queue_tail = node;
 
-	pool->queued_jobs++;
-	pthread_cond_signal(&pool->notify);
+	wake_workers(pool, count);
+}
 
+static void wait_for_space(ThreadPool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->space_waiters, 1, __ATOMIC_SEQ_CST);
+	while (1) {
+		int max_queued = __atomic_load_n(&pool->max_queued, __ATOMIC_RELAXED);
+		if (max_queued <= 0 || __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) < max_queued) {
+			break;
+		}
+		pthread_cond_wait(&pool->space_cond, &pool->lock);
+	}
+	__atomic_sub_fetch(&pool->space_waiters, 1, __ATOMIC_SEQ_CST);
 	pthread_mutex_unlock(&pool->lock);
 }
 
+// Claims count queue slots once the queue is below its limit. A batch is
+// admitted as a whole, so it may overshoot the limit.
+static bool tp_reserve(ThreadPool *pool, int count, bool block) {
+	while (1) {
+		int max_queued = __atomic_load_n(&pool->max_queued, __ATOMIC_RELAXED);
+		int queued = __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST);
+		if (max_queued > 0 && queued >= max_queued) {
+			if (!block) {
+				return false;
+			}
+			wait_for_space(pool);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&pool->queued, &queued, queued + count, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			return true;
+		}
+	}
+}
+
+void tp_add_job(ThreadPool *pool, thread_func_t function, void *arg) {
+	tp_reserve(pool, 1, true);
+	tp_enqueue(pool, function, &arg, 1);
+}
+
+// Submits count jobs running function on each of args, at the cost of a
+// single queue operation.
+void tp_add_jobs(ThreadPool *pool, thread_func_t function, void **args, int count) {
+	if (count <= 0) {
+		return;
+	}
+	tp_reserve(pool, count, true);
+	tp_enqueue(pool, function, args, count);
+}
+
+// Like tp_add_job but never blocks: returns false when the queue is full so
+// the caller can run the job itself. Jobs that submit more jobs from inside
+// the pool must use this to avoid waiting on themselves.
+bool tp_try_add_job(ThreadPool *pool, thread_func_t function, void *arg) {
+	if (!tp_reserve(pool, 1, false)) {
+		return false;
+	}
+	tp_enqueue(pool, function, &arg, 1);
+	return true;
+}
+
+// Bounds the number of queued jobs. Once the limit is reached tp_add_job
+// blocks until a worker picks up a job, which keeps producers from running
+// arbitrarily far ahead of the workers.
+void tp_set_queue_limit(ThreadPool *pool, int max_queued) {
+	pthread_mutex_lock(&pool->lock);
+	__atomic_store_n(&pool->max_queued, max_queued, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&pool->space_cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Returns once every submitted job has finished, including the jobs those
+// jobs submitted.
 void tp_wait(ThreadPool *pool) {
 	pthread_mutex_lock(&pool->lock);
-	while (pool->active_jobs > 0 || pool->queue_head != NULL) {
-		pthread_cond_wait(&pool->working_cond, &pool->lock);
+	while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0) {
+		pthread_cond_wait(&pool->idle_cond, &pool->lock);
 	}
 	pthread_mutex_unlock(&pool->lock);
 }
 
+// Cancellation is cooperative. Jobs own their arguments, so queued jobs are
+// not thrown away: they still run, but are expected to check tp_cancelled()
+// first and return after releasing what they were given, which drains the
+// queue in no time. Long-running work polls tp_cancel_flag().
+void tp_cancel(ThreadPool *pool) {
+	__atomic_store_n(&pool->cancelled, 1, __ATOMIC_SEQ_CST);
+}
+
+bool tp_cancelled(ThreadPool *pool) {
+	return __atomic_load_n(&pool->cancelled, __ATOMIC_RELAXED) != 0;
+}
+
+const size_t *tp_cancel_flag(ThreadPool *pool) {
+	return &pool->cancelled;
+}
+
+static void *tp_timer(void *arg) {
+	ThreadPool *pool = (ThreadPool *)arg;
+	pthread_mutex_lock(&pool->lock);
+	int rc = 0;
+	while (!pool->stop && rc != ETIMEDOUT) {
+		rc = pthread_cond_timedwait(&pool->timer_cond, &pool->lock, &pool->deadline);
+	}
+	if (!pool->stop) {
+		tp_cancel(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+// Cancels the pool msec milliseconds from now, unless it is destroyed first.
+// Only one deadline can be set.
+void tp_cancel_after(ThreadPool *pool, int msec) {
+	if (pool->has_timer || msec <= 0) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &pool->deadline);
+	pool->deadline.tv_sec += msec / 1000;
+	pool->deadline.tv_nsec += (long)(msec % 1000) * 1000000L;
+	if (pool->deadline.tv_nsec >= 1000000000L) {
+		pool->deadline.tv_sec++;
+		pool->deadline.tv_nsec -= 1000000000L;
+	}
+	pool->has_timer = pthread_create(&pool->timer, NULL, tp_timer, pool) == 0;
+}
+
 void tp_destroy(ThreadPool *pool) {
 	pthread_mutex_lock(&pool->lock);
 	pool->stop = true;
-	pthread_cond_broadcast(&pool->notify);
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_cond_signal(&pool->timer_cond);
 	pthread_mutex_unlock(&pool->lock);
 
+	if (pool->has_timer) {
+		pthread_join(pool->timer, NULL);
+	}
+
 	for (int i = 0; i < pool->num_threads; i++) {
 		pthread_join(pool->threads[i], NULL);
 	}
 
+	for (int i = 0; i < pool->num_threads; i++) {
+		deque_free(&pool->workers[i].deque);
+	}
+	while (pool->free_nodes != NULL) {
+		ThreadPoolJobNode *next = pool->free_nodes->next;
+		free(pool->free_nodes);
+		pool->free_nodes = next;
+	}
+
 	free(pool->threads);
+	free(pool->workers);
+	pthread_mutex_destroy(&pool->inject_lock);
 	pthread_mutex_destroy(&pool->lock);
-	pthread_cond_destroy(&pool->notify);
-	pthread_cond_destroy(&pool->working_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->space_cond);
+	pthread_cond_destroy(&pool->idle_cond);
+	pthread_cond_destroy(&pool->timer_cond);
 	free(pool);
 }
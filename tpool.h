@@ -3,6 +3,7 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef void (*thread_func_t)(void *arg);
 
@@ -13,9 +14,17 @@ typedef struct {
 
 typedef struct ThreadPool ThreadPool;
 
+int tp_default_threads(void);
 ThreadPool *tp_create(int num_threads);
 void tp_add_job(ThreadPool *pool, thread_func_t function, void *arg);
+void tp_add_jobs(ThreadPool *pool, thread_func_t function, void **args, int count);
+bool tp_try_add_job(ThreadPool *pool, thread_func_t function, void *arg);
+void tp_set_queue_limit(ThreadPool *pool, int max_queued);
 void tp_wait(ThreadPool *pool);
+void tp_cancel(ThreadPool *pool);
+void tp_cancel_after(ThreadPool *pool, int msec);
+bool tp_cancelled(ThreadPool *pool);
+const size_t *tp_cancel_flag(ThreadPool *pool);
 void tp_destroy(ThreadPool *pool);
 
 #endif
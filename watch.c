@@ -0,0 +1,908 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tree_sitter/api.h>
+
+#include "extract.h"
+#include "file.h"
+#include "ignore.h"
+#include "index.h"
+#include "lang.h"
+#include "watch.h"
+
+extern int debug_enabled;
+
+// A change is turned into a single edit covering the bytes between the common
+// prefix and suffix of the old and new contents. The edited old tree is handed
+// back to the parser, so only the damaged part of the file is re-parsed, and
+// the query only runs over the edit and the ranges whose syntax changed.
+// Symbols outside of those are carried over, shifted by the edit.
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR)
+
+typedef struct {
+	char *fname;
+	char *ftype;
+	char *fparams;
+	const char *kind; // owned by the language
+	size_t lineno;
+	uint32_t start_byte;
+	uint32_t end_byte;
+	int dirty; // overlaps a changed range, dropped unless found again
+} Symbol;
+
+typedef struct {
+	Symbol *items;
+	size_t count;
+	size_t capacity;
+} SymbolList;
+
+typedef struct WatchedFile {
+	struct WatchedFile *next; // hash chain
+	char *path;
+	Language *lang;
+	char *source; // private copy, editors may rewrite the file in place
+	size_t len;
+	TSTree *tree;
+	SymbolList symbols;
+} WatchedFile;
+
+typedef struct {
+	int wd;
+	char *path;
+} WatchedDir;
+
+typedef struct {
+	ThreadPool *pool;
+	const SearchOptions *options;
+	file_filter_t filter;
+	int max_depth;
+	size_t root_len;
+	int inotify_fd;
+
+	// Directory scans run on the pool, so the tables are locked.
+	pthread_mutex_t lock;
+	WatchedFile **buckets;
+	size_t bucket_count; // power of two
+	size_t file_count;
+	WatchedDir *dirs;
+	size_t dir_count;
+	size_t dir_capacity;
+
+	// Used by the event loop only.
+	TSParser *parsers[LANG_COUNT];
+	TSQueryCursor *cursor;
+	Arena arena;
+} Watcher;
+
+typedef struct {
+	Watcher *watcher;
+	WatchedFile *file;
+} LoadJob;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop(int sig) {
+	(void)sig;
+	stop_requested = 1;
+}
+
+static char *copy_string(const char *str) {
+	if (str == NULL) {
+		return NULL;
+	}
+	char *copy = strdup(str);
+	if (copy == NULL) {
+		perror("strdup");
+		exit(EXIT_FAILURE);
+	}
+	return copy;
+}
+
+static int same_string(const char *a, const char *b) {
+	if (a == NULL || b == NULL) {
+		return a == b;
+	}
+	return strcmp(a, b) == 0;
+}
+
+static void symbol_free(Symbol *sym) {
+	free(sym->fname);
+	free(sym->ftype);
+	free(sym->fparams);
+}
+
+static int symbol_equal(const Symbol *a, const Symbol *b) {
+	return a->start_byte == b->start_byte && same_string(a->fname, b->fname) && same_string(a->ftype, b->ftype) && same_string(a->fparams, b->fparams) && same_string(a->kind, b->kind);
+}
+
+static void symbol_list_push(SymbolList *list, const Symbol *sym) {
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 16;
+		list->items = realloc(list->items, sizeof(Symbol) * list->capacity);
+		if (list->items == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	list->items[list->count++] = *sym;
+}
+
+static void symbol_list_free(SymbolList *list) {
+	for (size_t i = 0; i < list->count; i++) {
+		symbol_free(&list->items[i]);
+	}
+	free(list->items);
+	list->items = NULL;
+	list->count = list->capacity = 0;
+}
+
+static int collect_function(const Function *fn, void *arg) {
+	Symbol sym = {
+		.fname = copy_string(fn->fname),
+		.ftype = text_view_dup(fn->ftype, 0),
+		.fparams = text_view_dup(fn->fparams, 0),
+		.kind = fn->kind,
+		.lineno = fn->lineno,
+		.start_byte = fn->start_byte,
+		.end_byte = fn->end_byte,
+	};
+	symbol_list_push((SymbolList *)arg, &sym);
+	return 0;
+}
+
+static void print_symbol(const Watcher *watcher, const char *prefix, const char *path, const Symbol *sym) {
+	SearchMatch match;
+	if (!function_matches(watcher->options, sym->fname, &match)) {
+		return;
+	}
+
+	Function fn = {
+		.fname = sym->fname,
+		.ftype = text_view(sym->ftype),
+		.fparams = text_view(sym->fparams),
+		.kind = sym->kind,
+		.lineno = sym->lineno,
+	};
+	print_function(stdout, prefix, path, &fn, watcher->options, &match);
+}
+
+static char *join_path(const char *dir, const char *name) {
+	size_t dir_len = strlen(dir);
+	size_t name_len = strlen(name);
+	int needs_slash = dir_len > 0 && dir[dir_len - 1] != '/';
+
+	char *path = malloc(dir_len + needs_slash + name_len + 1);
+	if (path == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(path, dir, dir_len);
+	if (needs_slash) {
+		path[dir_len] = '/';
+	}
+	memcpy(path + dir_len + needs_slash, name, name_len + 1);
+	return path;
+}
+
+// Reads the whole file into a private heap buffer. Returns NULL if it can not
+// be read, looks binary, or is generated or minified code.
+static char *read_source(const Watcher *watcher, const char *path, size_t *len) {
+	int fd = open_path(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == -1 || !S_ISREG(statbuf.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+
+	struct FileContent file = read_file_descriptor(fd, &statbuf);
+	close(fd);
+	if (file.content == NULL) {
+		return NULL;
+	}
+
+	if (!watcher->options->no_ignore && ignore_is_binary(file.content, file.count)) {
+		free_file_content(&file);
+		return NULL;
+	}
+	if (!watcher->options->include_generated && ignore_is_generated(file.content, file.count) != GENERATED_NONE) {
+		free_file_content(&file);
+		return NULL;
+	}
+
+	char *source = malloc(file.count + 1);
+	if (source == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(source, file.content, file.count);
+	source[file.count] = '\0';
+	*len = file.count;
+	free_file_content(&file);
+	return source;
+}
+
+static WatchedFile *watched_file_new(const char *path, Language *lang) {
+	WatchedFile *file = calloc(1, sizeof(WatchedFile));
+	if (file == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	file->path = copy_string(path);
+	file->lang = lang;
+	return file;
+}
+
+static void watched_file_free(WatchedFile *file) {
+	if (file->tree != NULL) {
+		ts_tree_delete(file->tree);
+	}
+	symbol_list_free(&file->symbols);
+	free(file->source);
+	free(file->path);
+	free(file);
+}
+
+// Reads and fully parses a file that is not tracked yet.
+static int load_file(const Watcher *watcher, WatchedFile *file, TSParser *parser, TSQueryCursor *cursor, Arena *arena) {
+	if (language_prepare(file->lang) != 0) {
+		return -1;
+	}
+
+	file->source = read_source(watcher, file->path, &file->len);
+	if (file->source == NULL) {
+		return -1;
+	}
+
+	ts_parser_set_language(parser, file->lang->language);
+	file->tree = ts_parser_parse_string(parser, NULL, file->source, file->len);
+	if (file->tree == NULL) {
+		ts_parser_reset(parser);
+		return -1;
+	}
+
+	extract_functions(file->lang, cursor, ts_tree_root_node(file->tree), file->source, arena, collect_function, &file->symbols);
+	arena_reset(arena);
+	return 0;
+}
+
+static WatchedFile **file_slot(Watcher *watcher, const char *path) {
+	uint64_t hash = index_hash(path, strlen(path));
+	WatchedFile **slot = &watcher->buckets[hash & (watcher->bucket_count - 1)];
+	while (*slot != NULL && strcmp((*slot)->path, path) != 0) {
+		slot = &(*slot)->next;
+	}
+	return slot;
+}
+
+static void grow_buckets(Watcher *watcher) {
+	WatchedFile **old = watcher->buckets;
+	size_t old_count = watcher->bucket_count;
+
+	watcher->bucket_count *= 2;
+	watcher->buckets = calloc(watcher->bucket_count, sizeof(WatchedFile *));
+	if (watcher->buckets == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < old_count; i++) {
+		WatchedFile *file = old[i];
+		while (file != NULL) {
+			WatchedFile *next = file->next;
+			WatchedFile **slot = file_slot(watcher, file->path);
+			file->next = NULL;
+			*slot = file;
+			file = next;
+		}
+	}
+	free(old);
+}
+
+static WatchedFile *find_file(Watcher *watcher, const char *path) {
+	pthread_mutex_lock(&watcher->lock);
+	WatchedFile *file = *file_slot(watcher, path);
+	pthread_mutex_unlock(&watcher->lock);
+	return file;
+}
+
+// Returns 0 if the path is already tracked, in which case file is not taken.
+static int insert_file(Watcher *watcher, WatchedFile *file) {
+	pthread_mutex_lock(&watcher->lock);
+	WatchedFile **slot = file_slot(watcher, file->path);
+	if (*slot != NULL) {
+		pthread_mutex_unlock(&watcher->lock);
+		return 0;
+	}
+	file->next = NULL;
+	*slot = file;
+	if (++watcher->file_count > watcher->bucket_count) {
+		grow_buckets(watcher);
+	}
+	pthread_mutex_unlock(&watcher->lock);
+	return 1;
+}
+
+static WatchedFile *unlink_file(Watcher *watcher, const char *path) {
+	pthread_mutex_lock(&watcher->lock);
+	WatchedFile **slot = file_slot(watcher, path);
+	WatchedFile *file = *slot;
+	if (file != NULL) {
+		*slot = file->next;
+		watcher->file_count--;
+	}
+	pthread_mutex_unlock(&watcher->lock);
+	return file;
+}
+
+// Parsers and the query cursor of the initial scan are kept per pool thread
+// and reused across files, like the search workers in main.c do. They are
+// released by the key destructor when the thread exits.
+typedef struct {
+	TSParser *parsers[LANG_COUNT];
+	TSQueryCursor *cursor;
+	Arena arena;
+} LoadState;
+
+static pthread_key_t load_key;
+static pthread_once_t load_key_once = PTHREAD_ONCE_INIT;
+
+static void load_state_free(void *arg) {
+	LoadState *state = (LoadState *)arg;
+	for (int i = 0; i < LANG_COUNT; i++) {
+		if (state->parsers[i] != NULL) {
+			ts_parser_delete(state->parsers[i]);
+		}
+	}
+	ts_query_cursor_delete(state->cursor);
+	arena_free(&state->arena);
+	free(state);
+}
+
+static void load_key_create(void) {
+	pthread_key_create(&load_key, load_state_free);
+}
+
+static LoadState *load_state_get(void) {
+	pthread_once(&load_key_once, load_key_create);
+
+	LoadState *state = pthread_getspecific(load_key);
+	if (state == NULL) {
+		state = calloc(1, sizeof(LoadState));
+		if (state == NULL) {
+			perror("calloc");
+			exit(EXIT_FAILURE);
+		}
+		state->cursor = ts_query_cursor_new();
+		pthread_setspecific(load_key, state);
+	}
+	return state;
+}
+
+static void load_job(void *arg) {
+	LoadJob *job = (LoadJob *)arg;
+	Watcher *watcher = job->watcher;
+	WatchedFile *file = job->file;
+	free(job);
+
+	LoadState *state = load_state_get();
+	TSParser *parser = state->parsers[file->lang->id];
+	if (parser == NULL) {
+		parser = ts_parser_new();
+		state->parsers[file->lang->id] = parser;
+	}
+	int loaded = load_file(watcher, file, parser, state->cursor, &state->arena);
+
+	if (loaded != 0 || !insert_file(watcher, file)) {
+		watched_file_free(file);
+		return;
+	}
+
+	for (size_t i = 0; i < file->symbols.count; i++) {
+		print_symbol(watcher, "+", file->path, &file->symbols.items[i]);
+	}
+}
+
+static void scan_file(char *path, void *tag, const struct stat *statbuf, void *ctx) {
+	Watcher *watcher = (Watcher *)ctx;
+	(void)statbuf;
+
+	LoadJob *job = malloc(sizeof(LoadJob));
+	if (job == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	job->watcher = watcher;
+	job->file = watched_file_new(path, (Language *)tag);
+	free(path);
+
+	if (!tp_try_add_job(watcher->pool, load_job, job)) {
+		load_job(job);
+	}
+}
+
+static void watch_directory(const char *path, void *ctx) {
+	Watcher *watcher = (Watcher *)ctx;
+
+	int wd = inotify_add_watch(watcher->inotify_fd, path, WATCH_EVENTS);
+	if (wd == -1) {
+		if (errno == ENOSPC) {
+			fprintf(stderr, "Out of inotify watches, not watching %s (see fs.inotify.max_user_watches)\n", path);
+		} else if (debug_enabled) {
+			fprintf(stderr, "Failed to watch directory: %s\n", path);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&watcher->lock);
+	for (size_t i = 0; i < watcher->dir_count; i++) {
+		if (watcher->dirs[i].wd == wd) {
+			free(watcher->dirs[i].path);
+			watcher->dirs[i].path = copy_string(path);
+			pthread_mutex_unlock(&watcher->lock);
+			return;
+		}
+	}
+	if (watcher->dir_count == watcher->dir_capacity) {
+		watcher->dir_capacity = watcher->dir_capacity ? watcher->dir_capacity * 2 : 64;
+		watcher->dirs = realloc(watcher->dirs, sizeof(WatchedDir) * watcher->dir_capacity);
+		if (watcher->dirs == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	watcher->dirs[watcher->dir_count].wd = wd;
+	watcher->dirs[watcher->dir_count].path = copy_string(path);
+	watcher->dir_count++;
+	pthread_mutex_unlock(&watcher->lock);
+}
+
+static const char *directory_for_wd(Watcher *watcher, int wd) {
+	for (size_t i = 0; i < watcher->dir_count; i++) {
+		if (watcher->dirs[i].wd == wd) {
+			return watcher->dirs[i].path;
+		}
+	}
+	return NULL;
+}
+
+// Walks path on the pool, watching its directories and loading its files.
+static void scan_directory(Watcher *watcher, const char *path, int max_depth) {
+	Walker *walker = walker_create(watcher->pool, max_depth, watcher->filter, scan_file, watcher);
+	if (walker == NULL) {
+		perror("Failed to create walker");
+		exit(EXIT_FAILURE);
+	}
+	walker_use_ignore_files(walker, !watcher->options->no_ignore);
+	walker_on_directory(walker, watch_directory);
+	walker_start(walker, path);
+	tp_wait(watcher->pool);
+	walker_destroy(walker);
+}
+
+static void forget_file(Watcher *watcher, const char *path) {
+	WatchedFile *file = unlink_file(watcher, path);
+	if (file == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < file->symbols.count; i++) {
+		print_symbol(watcher, "-", file->path, &file->symbols.items[i]);
+	}
+	watched_file_free(file);
+}
+
+// Drops everything below a directory that was deleted or moved away.
+static void forget_directory(Watcher *watcher, const char *path) {
+	size_t len = strlen(path);
+
+	for (size_t i = 0; i < watcher->dir_count;) {
+		const char *dir = watcher->dirs[i].path;
+		if (strncmp(dir, path, len) == 0 && (dir[len] == '\0' || dir[len] == '/')) {
+			inotify_rm_watch(watcher->inotify_fd, watcher->dirs[i].wd);
+			free(watcher->dirs[i].path);
+			watcher->dirs[i] = watcher->dirs[--watcher->dir_count];
+		} else {
+			i++;
+		}
+	}
+
+	for (size_t i = 0; i < watcher->bucket_count; i++) {
+		WatchedFile *file = watcher->buckets[i];
+		while (file != NULL) {
+			WatchedFile *next = file->next;
+			if (strncmp(file->path, path, len) == 0 && file->path[len] == '/') {
+				forget_file(watcher, file->path);
+			}
+			file = next;
+		}
+	}
+}
+
+static TSPoint point_at(const char *source, size_t offset) {
+	TSPoint point = {0, 0};
+	const char *line = source;
+	const char *end = source + offset;
+	const char *newline;
+	while ((newline = memchr(line, '\n', (size_t)(end - line))) != NULL) {
+		point.row++;
+		line = newline + 1;
+	}
+	point.column = (uint32_t)(end - line);
+	return point;
+}
+
+static TSParser *watcher_parser(Watcher *watcher, const Language *lang) {
+	TSParser *parser = watcher->parsers[lang->id];
+	if (parser == NULL) {
+		parser = ts_parser_new();
+		watcher->parsers[lang->id] = parser;
+	}
+	return parser;
+}
+
+static int touches(const Symbol *sym, uint32_t start, uint32_t end) {
+	return sym->start_byte <= end && sym->end_byte >= start;
+}
+
+static double elapsed_us(const struct timespec *since) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1e6 + (now.tv_nsec - since->tv_nsec) / 1e3;
+}
+
+// Applies new contents to a tracked file and prints the symbol deltas. Takes
+// ownership of source.
+static void update_file(Watcher *watcher, WatchedFile *file, char *source, size_t len) {
+	struct timespec started;
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	size_t old_len = file->len;
+	size_t common = old_len < len ? old_len : len;
+	size_t prefix = 0;
+	while (prefix < common && file->source[prefix] == source[prefix]) {
+		prefix++;
+	}
+	if (prefix == old_len && prefix == len) {
+		free(source);
+		return;
+	}
+	size_t suffix = 0;
+	while (suffix < common - prefix && file->source[old_len - 1 - suffix] == source[len - 1 - suffix]) {
+		suffix++;
+	}
+
+	TSInputEdit edit = {
+		.start_byte = (uint32_t)prefix,
+		.old_end_byte = (uint32_t)(old_len - suffix),
+		.new_end_byte = (uint32_t)(len - suffix),
+		.start_point = point_at(file->source, prefix),
+		.old_end_point = point_at(file->source, old_len - suffix),
+		.new_end_point = point_at(source, len - suffix),
+	};
+
+	TSParser *parser = watcher_parser(watcher, file->lang);
+	ts_parser_set_language(parser, file->lang->language);
+	ts_tree_edit(file->tree, &edit);
+	TSTree *tree = ts_parser_parse_string(parser, file->tree, source, len);
+	if (tree == NULL) {
+		ts_parser_reset(parser);
+		free(source);
+		forget_file(watcher, file->path);
+		return;
+	}
+
+	// The edit itself goes first: renaming an identifier changes no syntax
+	// and would not show up among the changed ranges.
+	uint32_t changed_count = 0;
+	TSRange *changed = ts_tree_get_changed_ranges(file->tree, tree, &changed_count);
+	uint32_t range_count = changed_count + 1;
+	TSRange *ranges = malloc(sizeof(TSRange) * range_count);
+	if (ranges == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	ranges[0].start_byte = edit.start_byte;
+	ranges[0].end_byte = edit.new_end_byte;
+	if (changed_count > 0) {
+		memcpy(ranges + 1, changed, sizeof(TSRange) * changed_count);
+	}
+	free(changed);
+
+	// Shift the symbols behind the edit and mark everything the edit or a
+	// changed range touches. Symbols overlapping the replaced bytes have no
+	// position in the new text and are always marked.
+	int64_t byte_delta = (int64_t)edit.new_end_byte - (int64_t)edit.old_end_byte;
+	int64_t row_delta = (int64_t)edit.new_end_point.row - (int64_t)edit.old_end_point.row;
+	for (size_t i = 0; i < file->symbols.count; i++) {
+		Symbol *sym = &file->symbols.items[i];
+		sym->dirty = 0;
+		if (sym->end_byte < edit.start_byte) {
+			// before the edit, unchanged
+		} else if (sym->start_byte >= edit.old_end_byte) {
+			sym->start_byte = (uint32_t)(sym->start_byte + byte_delta);
+			sym->end_byte = (uint32_t)(sym->end_byte + byte_delta);
+			sym->lineno = (size_t)((int64_t)sym->lineno + row_delta);
+		} else {
+			sym->dirty = 1;
+			continue;
+		}
+		for (uint32_t r = 0; r < range_count && !sym->dirty; r++) {
+			sym->dirty = touches(sym, ranges[r].start_byte, ranges[r].end_byte);
+		}
+	}
+
+	// Re-run the query over the affected ranges only. Ranges are widened by a
+	// byte so that nodes merely touching an edit are visited too.
+	SymbolList found = {0};
+	TSNode root = ts_tree_root_node(tree);
+	for (uint32_t r = 0; r < range_count; r++) {
+		uint32_t start = ranges[r].start_byte > 0 ? ranges[r].start_byte - 1 : 0;
+		ts_query_cursor_set_byte_range(watcher->cursor, start, ranges[r].end_byte + 1);
+		extract_functions(file->lang, watcher->cursor, root, source, &watcher->arena, collect_function, &found);
+	}
+	ts_query_cursor_set_byte_range(watcher->cursor, 0, UINT32_MAX);
+	arena_reset(&watcher->arena);
+	free(ranges);
+
+	// Symbols found again are kept as they are; whatever is left dirty is gone
+	// and whatever is not known yet is new.
+	SymbolList added = {0};
+	for (size_t i = 0; i < found.count; i++) {
+		Symbol *sym = &found.items[i];
+		int known = 0;
+		for (size_t j = 0; j < file->symbols.count && !known; j++) {
+			if (symbol_equal(sym, &file->symbols.items[j])) {
+				file->symbols.items[j].dirty = 0;
+				known = 1;
+			}
+		}
+		for (size_t j = 0; j < added.count && !known; j++) {
+			known = symbol_equal(sym, &added.items[j]);
+		}
+		if (known) {
+			symbol_free(sym);
+		} else {
+			symbol_list_push(&added, sym);
+		}
+	}
+	free(found.items);
+
+	size_t kept = 0;
+	for (size_t i = 0; i < file->symbols.count; i++) {
+		Symbol *sym = &file->symbols.items[i];
+		if (sym->dirty) {
+			print_symbol(watcher, "-", file->path, sym);
+			symbol_free(sym);
+		} else {
+			file->symbols.items[kept++] = *sym;
+		}
+	}
+	file->symbols.count = kept;
+
+	for (size_t i = 0; i < added.count; i++) {
+		print_symbol(watcher, "+", file->path, &added.items[i]);
+		symbol_list_push(&file->symbols, &added.items[i]);
+	}
+	free(added.items);
+
+	ts_tree_delete(file->tree);
+	file->tree = tree;
+	free(file->source);
+	file->source = source;
+	file->len = len;
+
+	if (debug_enabled) {
+		fprintf(stderr, "Updated %s in %.0f us (%u changed ranges)\n", file->path, elapsed_us(&started), changed_count);
+	}
+}
+
+static void refresh_file(Watcher *watcher, const char *path) {
+	WatchedFile *file = find_file(watcher, path);
+	if (file == NULL) {
+		const char *name = strrchr(path, '/');
+		Language *lang = watcher->filter(name != NULL ? name + 1 : path);
+		if (lang == NULL) {
+			return;
+		}
+		file = watched_file_new(path, lang);
+		if (load_file(watcher, file, watcher_parser(watcher, lang), watcher->cursor, &watcher->arena) != 0 || !insert_file(watcher, file)) {
+			watched_file_free(file);
+			return;
+		}
+		for (size_t i = 0; i < file->symbols.count; i++) {
+			print_symbol(watcher, "+", file->path, &file->symbols.items[i]);
+		}
+		return;
+	}
+
+	size_t len = 0;
+	char *source = read_source(watcher, path, &len);
+	if (source == NULL) {
+		forget_file(watcher, path);
+		return;
+	}
+	update_file(watcher, file, source, len);
+}
+
+// Directories created or moved in after the initial scan are walked like the
+// root, with whatever depth is left below it.
+static void add_directory(Watcher *watcher, const char *path) {
+	const char *name = strrchr(path, '/');
+	if (!watcher->options->no_ignore && ignore_default_skip(name != NULL ? name + 1 : path)) {
+		return;
+	}
+
+	int max_depth = watcher->max_depth;
+	if (max_depth != -1) {
+		int depth = 1;
+		for (const char *p = path + watcher->root_len; *p; p++) {
+			depth += *p == '/';
+		}
+		if (depth > max_depth) {
+			return;
+		}
+		max_depth -= depth;
+	}
+	scan_directory(watcher, path, max_depth);
+}
+
+static void refresh_all(Watcher *watcher) {
+	size_t count = 0;
+	char **paths = malloc(sizeof(char *) * (watcher->file_count + 1));
+	if (paths == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < watcher->bucket_count; i++) {
+		for (WatchedFile *file = watcher->buckets[i]; file != NULL; file = file->next) {
+			paths[count++] = copy_string(file->path);
+		}
+	}
+	for (size_t i = 0; i < count; i++) {
+		refresh_file(watcher, paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+}
+
+static void handle_event(Watcher *watcher, const struct inotify_event *event) {
+	if (event->mask & IN_Q_OVERFLOW) {
+		if (debug_enabled) {
+			fprintf(stderr, "inotify queue overflowed, refreshing all files\n");
+		}
+		refresh_all(watcher);
+		return;
+	}
+
+	if (event->mask & IN_IGNORED) {
+		for (size_t i = 0; i < watcher->dir_count; i++) {
+			if (watcher->dirs[i].wd == event->wd) {
+				free(watcher->dirs[i].path);
+				watcher->dirs[i] = watcher->dirs[--watcher->dir_count];
+				break;
+			}
+		}
+		return;
+	}
+
+	const char *dir = directory_for_wd(watcher, event->wd);
+	if (dir == NULL || event->len == 0) {
+		return;
+	}
+
+	char *path = join_path(dir, event->name);
+	if (event->mask & IN_ISDIR) {
+		if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+			add_directory(watcher, path);
+		} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			forget_directory(watcher, path);
+		}
+	} else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+		refresh_file(watcher, path);
+	} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		forget_file(watcher, path);
+	}
+	free(path);
+}
+
+int watch_run(ThreadPool *pool, const SearchOptions *options, const char *root, int max_depth, file_filter_t filter) {
+	struct stat statbuf;
+	if (stat(root, &statbuf) == -1 || !S_ISDIR(statbuf.st_mode)) {
+		fprintf(stderr, "Watch root is not a directory: %s\n", root);
+		return 1;
+	}
+
+	Watcher watcher = {
+		.pool = pool,
+		.options = options,
+		.filter = filter,
+		.max_depth = max_depth,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.bucket_count = 1024,
+	};
+	size_t root_len = strlen(root);
+	watcher.root_len = root_len + (root[root_len - 1] == '/' ? 0 : 1);
+
+	watcher.inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (watcher.inotify_fd == -1) {
+		perror("inotify_init1");
+		return 1;
+	}
+	watcher.buckets = calloc(watcher.bucket_count, sizeof(WatchedFile *));
+	if (watcher.buckets == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+	watcher.cursor = ts_query_cursor_new();
+
+	// No SA_RESTART, so a signal interrupts the blocking read below.
+	struct sigaction action = {0};
+	action.sa_handler = handle_stop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	scan_directory(&watcher, root, max_depth);
+	if (debug_enabled) {
+		fprintf(stderr, "Watching %zu files in %zu directories\n", watcher.file_count, watcher.dir_count);
+	}
+	fflush(stdout);
+
+	char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (!stop_requested) {
+		ssize_t nread = read(watcher.inotify_fd, buffer, sizeof(buffer));
+		if (nread == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("read");
+			break;
+		}
+
+		for (char *p = buffer; p < buffer + nread;) {
+			const struct inotify_event *event = (const struct inotify_event *)p;
+			handle_event(&watcher, event);
+			p += sizeof(struct inotify_event) + event->len;
+		}
+		fflush(stdout);
+	}
+
+	for (size_t i = 0; i < watcher.bucket_count; i++) {
+		WatchedFile *file = watcher.buckets[i];
+		while (file != NULL) {
+			WatchedFile *next = file->next;
+			watched_file_free(file);
+			file = next;
+		}
+	}
+	free(watcher.buckets);
+	for (size_t i = 0; i < watcher.dir_count; i++) {
+		free(watcher.dirs[i].path);
+	}
+	free(watcher.dirs);
+	for (int i = 0; i < LANG_COUNT; i++) {
+		if (watcher.parsers[i] != NULL) {
+			ts_parser_delete(watcher.parsers[i]);
+		}
+	}
+	ts_query_cursor_delete(watcher.cursor);
+	arena_free(&watcher.arena);
+	pthread_mutex_destroy(&watcher.lock);
+	close(watcher.inotify_fd);
+	return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "list.h"
+#include "search.h"
+#include "tpool.h"
+
+// Keeps the source, parse tree and symbols of every file under root in memory
+// and follows changes through inotify. Matching symbols are printed prefixed
+// with '+' as they appear and '-' as they disappear, starting with everything
+// found by the initial scan. Runs until interrupted.
+int watch_run(ThreadPool *pool, const SearchOptions *options, const char *root, int max_depth, file_filter_t filter);
+
+#endif